@@ -1,151 +1,728 @@
-#include "protocol/protocol.h"
+#include "clinet/client.h"
 #include <iostream>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
 #include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
+#include <poll.h>
+
+// Load generator for kvstore. Client threads each drive a share of the
+// connections with a mix of GETs and SETs over a configurable key space, and
+// record per-request latency in histograms that are merged at the end.
+//
+// By default every connection is closed-loop: it keeps --pipeline requests
+// in flight and sends a new one as soon as a response comes back. With
+// --rate the load is open-loop instead: requests are issued on a fixed
+// schedule and latency is measured from when a request was *due*, not from
+// when it could be sent, so a stalled server shows up in the tail instead of
+// silently slowing the benchmark down (coordinated omission).
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t nowNs(Clock::time_point base) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - base).count());
+}
+
+enum class KeyDistribution { UNIFORM, ZIPF };
+enum class OutputFormat { TEXT, JSON, CSV };
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int port = 6379;
+    int threads = 1;
+    int connections = 0;          // 0 = one per thread
+    int pipeline = 1;             // max requests in flight per connection
+    uint64_t requests = 100000;   // total, across all connections
+    double duration_sec = 0;      // when set, run for this long instead
+    uint64_t keyspace = 100000;
+    KeyDistribution distribution = KeyDistribution::UNIFORM;
+    double zipf_theta = 0.99;
+    size_t value_min = 64;
+    size_t value_max = 64;
+    double read_ratio = 0.9;
+    double rate = 0;              // total requests/sec; 0 = closed loop
+    bool preload = false;
+    bool accept_compressed = false;
+    OutputFormat format = OutputFormat::TEXT;
+    uint64_t seed = 1;
+};
 
-class BenchmarkClient {
+// Log-linear latency histogram in nanoseconds. Values are grouped by power
+// of two and every power of two is split into kSubBuckets linear buckets, so
+// a reported percentile is within 1/kSubBuckets of the recorded value.
+// Recording is a few instructions with no allocation.
+class Histogram {
 public:
-    BenchmarkClient(const std::string& host, int port) : host_(host), port_(port) {}
+    void record(uint64_t value) {
+        ++counts_[index(value)];
+        ++total_;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
 
-    bool connect() {
-        fd_ = socket(AF_INET, SOCK_STREAM, 0);
-        if (fd_ < 0) return false;
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
 
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(port_);
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ ? static_cast<double>(sum_) / total_ : 0; }
+
+    // Smallest recorded value such that a fraction q of samples are <= it
+    uint64_t percentile(double q) const {
+        if (total_ == 0) return 0;
+        uint64_t target = static_cast<uint64_t>(std::ceil(q * total_));
+        target = std::max<uint64_t>(target, 1);
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= target) {
+                return std::min(upperBound(i), max_);
+            }
+        }
+        return max_;
+    }
 
-        if (inet_pton(AF_INET, host_.c_str(), &addr.sin_addr) <= 0) return false;
-        if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) return false;
+private:
+    static constexpr int kSubBits = 6;
+    static constexpr size_t kSubBuckets = size_t(1) << kSubBits;
+
+    std::vector<uint64_t> counts_ = std::vector<uint64_t>((64 - kSubBits + 1) * kSubBuckets);
+    uint64_t total_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+
+    static size_t index(uint64_t value) {
+        if (value < kSubBuckets) return static_cast<size_t>(value);
+        int shift = (63 - __builtin_clzll(value)) - kSubBits;
+        size_t sub = static_cast<size_t>(value >> shift) & (kSubBuckets - 1);
+        return static_cast<size_t>(shift + 1) * kSubBuckets + sub;
+    }
 
-        return true;
+    static uint64_t upperBound(size_t index) {
+        if (index < kSubBuckets) return index;
+        size_t shift = index / kSubBuckets - 1;
+        size_t sub = index % kSubBuckets;
+        return ((kSubBuckets + sub + 1) << shift) - 1;
     }
+};
 
-    void disconnect() {
-        if (fd_ >= 0) {
-            close(fd_);
-            fd_ = -1;
+// Zipfian ranks over [0, n) using the method of Gray et al., "Quickly
+// Generating Billion-Record Synthetic Databases" (as in YCSB). The zeta
+// constant costs O(n) once; each sample is O(1).
+class ZipfGenerator {
+public:
+    ZipfGenerator(uint64_t n, double theta) : n_(n), theta_(theta) {
+        double zeta2 = 0;
+        zetan_ = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            zetan_ += 1.0 / std::pow(static_cast<double>(i), theta);
+            if (i == 2) zeta2 = zetan_;
         }
+        if (n < 2) zeta2 = zetan_;
+        alpha_ = 1.0 / (1.0 - theta);
+        eta_ = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
     }
 
-    bool set(const std::string& key, const std::string& value) {
-        kvstore::Protocol::Request req;
-        req.type = kvstore::CommandType::SET;
-        req.key = key;
-        req.value = value;
+    template <typename Rng>
+    uint64_t next(Rng& rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan_;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta_)) return std::min<uint64_t>(1, n_ - 1);
+        uint64_t rank = static_cast<uint64_t>(n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+        return std::min(rank, n_ - 1);
+    }
 
-        auto data = kvstore::Protocol::serializeRequest(req);
-        ssize_t sent = 0;
-        while (sent < static_cast<ssize_t>(data.size())) {
-            ssize_t n = send(fd_, data.data() + sent, data.size() - sent, 0);
-            if (n < 0) return false;
-            sent += n;
-        }
+private:
+    uint64_t n_;
+    double theta_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+};
 
-        std::vector<uint8_t> buffer(4096);
-        ssize_t n = recv(fd_, buffer.data(), buffer.size(), 0);
-        if (n <= 0) return false;
+// Hot ranks would otherwise be neighbouring keys; hashing them spreads the
+// hot set over the key space (and so over the server's shards).
+uint64_t scramble(uint64_t rank, uint64_t keyspace) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < 8; ++i) {
+        h ^= (rank >> (i * 8)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h % keyspace;
+}
 
-        buffer.resize(n);
-        kvstore::Protocol::Response resp;
-        return kvstore::Protocol::deserializeResponse(buffer, resp);
+struct OpStats {
+    Histogram latency;
+    uint64_t errors = 0;
+    uint64_t misses = 0;
+};
+
+struct ThreadStats {
+    OpStats get;
+    OpStats set;
+    bool failed = false;
+};
+
+// Request sent but not yet answered
+struct InFlight {
+    uint64_t start_ns;   // send time, or the scheduled time in open-loop mode
+    bool is_get;
+};
+
+struct BenchConnection {
+    std::unique_ptr<kvstore::Client> client;
+    std::deque<InFlight> in_flight;
+    uint64_t remaining = 0;      // requests left to send (request-count mode)
+    uint64_t next_send_ns = 0;   // open-loop schedule
+};
+
+// Releases all threads at once after they have connected, so connection
+// setup is not part of the measurement
+class StartGate {
+public:
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return open_; });
     }
 
-    bool get(const std::string& key) {
-        kvstore::Protocol::Request req;
-        req.type = kvstore::CommandType::GET;
-        req.key = key;
+    void open() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            open_ = true;
+        }
+        cv_.notify_all();
+    }
 
-        auto data = kvstore::Protocol::serializeRequest(req);
-        ssize_t sent = 0;
-        while (sent < static_cast<ssize_t>(data.size())) {
-            ssize_t n = send(fd_, data.data() + sent, data.size() - sent, 0);
-            if (n < 0) return false;
-            sent += n;
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool open_ = false;
+};
+
+class Workload {
+public:
+    Workload(const BenchConfig& config, const ZipfGenerator* zipf, uint64_t seed)
+        : config_(config), zipf_(zipf), rng_(seed),
+          filler_(config.value_max, 'x') {}
+
+    // Fills req with the next operation; returns true for a GET
+    bool next(kvstore::Protocol::Request& req) {
+        bool is_get = std::uniform_real_distribution<double>(0.0, 1.0)(rng_) < config_.read_ratio;
+        setKey(req, pickKey());
+
+        if (is_get) {
+            req.type = kvstore::CommandType::GET;
+            req.value.clear();
+        } else {
+            req.type = kvstore::CommandType::SET;
+            setValue(req);
         }
+        return is_get;
+    }
 
-        std::vector<uint8_t> buffer(4096);
-        ssize_t n = recv(fd_, buffer.data(), buffer.size(), 0);
-        if (n <= 0) return false;
+    void setKey(kvstore::Protocol::Request& req, uint64_t index) {
+        req.key.assign("key:");
+        req.key.append(std::to_string(index));
+    }
 
-        buffer.resize(n);
-        kvstore::Protocol::Response resp;
-        return kvstore::Protocol::deserializeResponse(buffer, resp);
+    void setValue(kvstore::Protocol::Request& req) {
+        size_t size = config_.value_min;
+        if (config_.value_max > config_.value_min) {
+            size = std::uniform_int_distribution<size_t>(config_.value_min, config_.value_max)(rng_);
+        }
+        req.value.assign(filler_, 0, size);
     }
 
 private:
-    std::string host_;
-    int port_;
-    int fd_ = -1;
+    const BenchConfig& config_;
+    const ZipfGenerator* zipf_;
+    std::mt19937_64 rng_;
+    std::string filler_;
+
+    uint64_t pickKey() {
+        if (zipf_) {
+            return scramble(zipf_->next(rng_), config_.keyspace);
+        }
+        return std::uniform_int_distribution<uint64_t>(0, config_.keyspace - 1)(rng_);
+    }
 };
 
-void runBenchmark(const std::string& name, int num_ops) {
-    std::cout << "\n=== " << name << " ===" << std::endl;
+void recordResponse(ThreadStats& stats, const InFlight& op,
+                    const kvstore::Protocol::Response& resp, uint64_t now) {
+    OpStats& op_stats = op.is_get ? stats.get : stats.set;
+    op_stats.latency.record(now > op.start_ns ? now - op.start_ns : 0);
+    if (resp.status == kvstore::StatusCode::ERROR) {
+        ++op_stats.errors;
+    } else if (resp.status == kvstore::StatusCode::NOT_FOUND) {
+        ++op_stats.misses;
+    }
+}
 
-    BenchmarkClient client("127.0.0.1", 6379);
+// Drives this thread's connections until every request has been sent and
+// answered (or the deadline has passed and the stragglers have drained).
+void runClientThread(const BenchConfig& config, const ZipfGenerator* zipf,
+                     std::vector<BenchConnection>& conns, uint64_t interval_ns,
+                     Clock::time_point base, ThreadStats& stats, uint64_t seed) {
+    const bool open_loop = interval_ns > 0;
+    const bool timed = config.duration_sec > 0;
+    const uint64_t deadline_ns = static_cast<uint64_t>(config.duration_sec * 1e9);
+    const size_t depth = static_cast<size_t>(config.pipeline);
+
+    Workload workload(config, zipf, seed);
+    kvstore::Protocol::Request req;
+    kvstore::Protocol::Response resp;
+    std::vector<pollfd> fds(conns.size());
+
+    auto hasBudget = [&](const BenchConnection& conn, uint64_t now) {
+        if (timed) {
+            return (open_loop ? conn.next_send_ns : now) < deadline_ns;
+        }
+        return conn.remaining > 0;
+    };
+
+    while (true) {
+        uint64_t now = nowNs(base);
+        bool active = false;
+        uint64_t wake_ns = UINT64_MAX;
+
+        for (size_t i = 0; i < conns.size(); ++i) {
+            BenchConnection& conn = conns[i];
+            bool queued = false;
+
+            while (conn.in_flight.size() < depth && hasBudget(conn, now)) {
+                uint64_t start = now;
+                if (open_loop) {
+                    if (conn.next_send_ns > now) break;
+                    start = conn.next_send_ns;
+                    conn.next_send_ns += interval_ns;
+                }
+
+                bool is_get = workload.next(req);
+                conn.client->queue(req);
+                conn.in_flight.push_back({start, is_get});
+                if (conn.remaining > 0) --conn.remaining;
+                queued = true;
+            }
+
+            if (queued && !conn.client->flush()) {
+                stats.failed = true;
+                return;
+            }
+
+            bool more = hasBudget(conn, now);
+            if (open_loop && more && conn.in_flight.size() < depth) {
+                wake_ns = std::min(wake_ns, conn.next_send_ns);
+            }
+            active = active || more || !conn.in_flight.empty();
+
+            fds[i].fd = conn.client->fd();
+            fds[i].events = conn.in_flight.empty() ? 0 : POLLIN;
+            fds[i].revents = 0;
+        }
 
-    if (!client.connect()) {
-        std::cerr << "Failed to connect" << std::endl;
-        return;
-    }
+        if (!active) break;
+
+        timespec timeout{};
+        timespec* timeout_ptr = nullptr;
+        if (wake_ns != UINT64_MAX) {
+            uint64_t wait = wake_ns > now ? wake_ns - now : 0;
+            timeout.tv_sec = static_cast<time_t>(wait / 1000000000);
+            timeout.tv_nsec = static_cast<long>(wait % 1000000000);
+            timeout_ptr = &timeout;
+        } else if (timed) {
+            // Closed loop: nothing to send until a response arrives, but
+            // wake up at the deadline so the run ends on time
+            timeout.tv_sec = 0;
+            timeout.tv_nsec = 100 * 1000 * 1000;
+            timeout_ptr = &timeout;
+        }
 
-    // Benchmark SET operations
-    auto start = std::chrono::high_resolution_clock::now();
+        if (ppoll(fds.data(), fds.size(), timeout_ptr, nullptr) < 0 && errno != EINTR) {
+            std::cerr << "poll error: " << strerror(errno) << std::endl;
+            stats.failed = true;
+            return;
+        }
 
-    for (int i = 0; i < num_ops; i++) {
-        std::string key = "key" + std::to_string(i);
-        std::string value = "value" + std::to_string(i);
-        if (!client.set(key, value)) {
-            std::cerr << "SET failed at " << i << std::endl;
-            break;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            if (!(fds[i].revents & (POLLIN | POLLERR | POLLHUP))) continue;
+
+            BenchConnection& conn = conns[i];
+            bool ready = true;
+            while (ready && !conn.in_flight.empty()) {
+                if (!conn.client->pollResponse(resp, ready)) {
+                    stats.failed = true;
+                    return;
+                }
+                if (ready) {
+                    recordResponse(stats, conn.in_flight.front(), resp, nowNs(base));
+                    conn.in_flight.pop_front();
+                }
+            }
         }
     }
+}
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+// Writes every key once so GETs hit. Each thread takes a slice of the keys.
+bool preload(const BenchConfig& config) {
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> threads;
+    uint64_t per_thread = (config.keyspace + config.threads - 1) / config.threads;
+
+    for (int t = 0; t < config.threads; ++t) {
+        uint64_t begin = t * per_thread;
+        uint64_t end = std::min(config.keyspace, begin + per_thread);
+        if (begin >= end) break;
+
+        threads.emplace_back([&config, &ok, begin, end, t] {
+            kvstore::Client client(config.host, config.port);
+            if (!client.connect()) {
+                ok = false;
+                return;
+            }
+
+            Workload workload(config, nullptr, config.seed + 1000 + t);
+            kvstore::Protocol::Request req;
+            kvstore::Protocol::Response resp;
+            req.type = kvstore::CommandType::SET;
+
+            const uint64_t batch = 256;
+            for (uint64_t i = begin; i < end; i += batch) {
+                uint64_t n = std::min(batch, end - i);
+                for (uint64_t j = 0; j < n; ++j) {
+                    workload.setKey(req, i + j);
+                    workload.setValue(req);
+                    client.queue(req);
+                }
+                if (!client.flush()) {
+                    ok = false;
+                    return;
+                }
+                for (uint64_t j = 0; j < n; ++j) {
+                    if (!client.readResponse(resp)) {
+                        ok = false;
+                        return;
+                    }
+                }
+            }
+        });
+    }
 
-    double ops_per_sec = (num_ops * 1000.0) / duration.count();
-    std::cout << "SET: " << num_ops << " ops in " << duration.count() << " ms" << std::endl;
-    std::cout << "     " << static_cast<int>(ops_per_sec) << " ops/sec" << std::endl;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return ok;
+}
 
-    // Benchmark GET operations
-    start = std::chrono::high_resolution_clock::now();
+double toUs(uint64_t ns) {
+    return ns / 1000.0;
+}
 
-    for (int i = 0; i < num_ops; i++) {
-        std::string key = "key" + std::to_string(i);
-        if (!client.get(key)) {
-            std::cerr << "GET failed at " << i << std::endl;
-            break;
-        }
+struct Result {
+    std::string name;
+    const OpStats* stats;
+};
+
+void printText(const BenchConfig& config, const std::vector<Result>& results,
+               uint64_t total_ops, double elapsed_sec) {
+    std::cout << "KVStore Benchmark" << std::endl;
+    std::cout << "=================" << std::endl;
+    std::cout << "Target:       " << config.host << ":" << config.port << std::endl;
+    std::cout << "Threads:      " << config.threads << ", connections: " << config.connections
+              << ", pipeline: " << config.pipeline << std::endl;
+    std::cout << "Key space:    " << config.keyspace << " ("
+              << (config.distribution == KeyDistribution::ZIPF ? "zipf" : "uniform") << ")"
+              << ", values: " << config.value_min << "-" << config.value_max << " bytes"
+              << ", reads: " << config.read_ratio * 100 << "%" << std::endl;
+    std::cout << "Mode:         ";
+    if (config.rate > 0) {
+        std::cout << "open loop at " << config.rate << " req/s" << std::endl;
+    } else {
+        std::cout << "closed loop" << std::endl;
     }
 
-    end = std::chrono::high_resolution_clock::now();
-    duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "\n" << total_ops << " requests in " << elapsed_sec << " s: "
+              << total_ops / elapsed_sec << " req/s\n" << std::endl;
+
+    std::cout << std::left << std::setw(6) << "op" << std::right
+              << std::setw(10) << "count" << std::setw(8) << "errors" << std::setw(8) << "misses"
+              << std::setw(10) << "mean us" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p999 us" << std::setw(10) << "max us" << std::endl;
+    for (const auto& result : results) {
+        const OpStats& s = *result.stats;
+        std::cout << std::left << std::setw(6) << result.name << std::right
+                  << std::setw(10) << s.latency.count() << std::setw(8) << s.errors
+                  << std::setw(8) << s.misses << std::setw(10) << toUs(s.latency.mean())
+                  << std::setw(10) << toUs(s.latency.percentile(0.50))
+                  << std::setw(10) << toUs(s.latency.percentile(0.99))
+                  << std::setw(10) << toUs(s.latency.percentile(0.999))
+                  << std::setw(10) << toUs(s.latency.max()) << std::endl;
+    }
+}
 
-    ops_per_sec = (num_ops * 1000.0) / duration.count();
-    std::cout << "GET: " << num_ops << " ops in " << duration.count() << " ms" << std::endl;
-    std::cout << "     " << static_cast<int>(ops_per_sec) << " ops/sec" << std::endl;
+void printJson(const BenchConfig& config, const std::vector<Result>& results,
+               uint64_t total_ops, double elapsed_sec) {
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "{\"config\":{\"host\":\"" << config.host << "\",\"port\":" << config.port
+              << ",\"threads\":" << config.threads << ",\"connections\":" << config.connections
+              << ",\"pipeline\":" << config.pipeline << ",\"keyspace\":" << config.keyspace
+              << ",\"distribution\":\""
+              << (config.distribution == KeyDistribution::ZIPF ? "zipf" : "uniform") << "\""
+              << ",\"zipf_theta\":" << config.zipf_theta
+              << ",\"value_min\":" << config.value_min << ",\"value_max\":" << config.value_max
+              << ",\"read_ratio\":" << config.read_ratio << ",\"rate\":" << config.rate << "}"
+              << ",\"requests\":" << total_ops << ",\"elapsed_s\":" << elapsed_sec
+              << ",\"throughput\":" << total_ops / elapsed_sec << ",\"ops\":{";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const OpStats& s = *results[i].stats;
+        std::cout << (i ? "," : "") << "\"" << results[i].name << "\":{"
+                  << "\"count\":" << s.latency.count() << ",\"errors\":" << s.errors
+                  << ",\"misses\":" << s.misses << ",\"mean_us\":" << toUs(s.latency.mean())
+                  << ",\"p50_us\":" << toUs(s.latency.percentile(0.50))
+                  << ",\"p99_us\":" << toUs(s.latency.percentile(0.99))
+                  << ",\"p999_us\":" << toUs(s.latency.percentile(0.999))
+                  << ",\"max_us\":" << toUs(s.latency.max()) << "}";
+    }
+    std::cout << "}}" << std::endl;
+}
+
+void printCsv(const std::vector<Result>& results, double elapsed_sec) {
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "op,count,errors,misses,throughput,mean_us,p50_us,p99_us,p999_us,max_us" << std::endl;
+    for (const auto& result : results) {
+        const OpStats& s = *result.stats;
+        std::cout << result.name << "," << s.latency.count() << "," << s.errors << ","
+                  << s.misses << "," << s.latency.count() / elapsed_sec << ","
+                  << toUs(s.latency.mean()) << "," << toUs(s.latency.percentile(0.50)) << ","
+                  << toUs(s.latency.percentile(0.99)) << "," << toUs(s.latency.percentile(0.999))
+                  << "," << toUs(s.latency.max()) << std::endl;
+    }
+}
 
-    client.disconnect();
+void printUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "    --host ADDR            server address (127.0.0.1)\n"
+              << "    --port N               server port (6379)\n"
+              << "    --threads N            client threads (1)\n"
+              << "    --connections N        total connections, spread over threads (= threads)\n"
+              << "    --pipeline N           max requests in flight per connection (1)\n"
+              << "    --requests N           total requests to send (100000)\n"
+              << "    --duration SEC         run for SEC seconds instead of a request count\n"
+              << "    --keyspace N           number of distinct keys (100000)\n"
+              << "    --distribution D       uniform | zipf | zipf:THETA (uniform; theta 0.99)\n"
+              << "    --value-size N|MIN-MAX SET value size in bytes (64)\n"
+              << "    --read-ratio R         fraction of requests that are GETs (0.9)\n"
+              << "    --rate N               open loop: N requests/sec in total (closed loop)\n"
+              << "    --preload              write every key once before measuring\n"
+              << "    --accept-compressed    take compressed values as stored and decompress them here\n"
+              << "    --format F             text | json | csv (text)\n"
+              << "    --seed N               random seed (1)" << std::endl;
 }
 
+bool parseArgs(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (std::strcmp(arg, "--host") == 0 && has_value) {
+            config.host = argv[++i];
+        } else if (std::strcmp(arg, "--port") == 0 && has_value) {
+            config.port = std::atoi(argv[++i]);
+            if (config.port <= 0 || config.port > 65535) return false;
+        } else if (std::strcmp(arg, "--threads") == 0 && has_value) {
+            config.threads = std::atoi(argv[++i]);
+            if (config.threads <= 0) return false;
+        } else if (std::strcmp(arg, "--connections") == 0 && has_value) {
+            config.connections = std::atoi(argv[++i]);
+            if (config.connections <= 0) return false;
+        } else if (std::strcmp(arg, "--pipeline") == 0 && has_value) {
+            config.pipeline = std::atoi(argv[++i]);
+            if (config.pipeline <= 0) return false;
+        } else if (std::strcmp(arg, "--requests") == 0 && has_value) {
+            config.requests = std::strtoull(argv[++i], nullptr, 10);
+            if (config.requests == 0) return false;
+        } else if (std::strcmp(arg, "--duration") == 0 && has_value) {
+            config.duration_sec = std::atof(argv[++i]);
+            if (config.duration_sec <= 0) return false;
+        } else if (std::strcmp(arg, "--keyspace") == 0 && has_value) {
+            config.keyspace = std::strtoull(argv[++i], nullptr, 10);
+            if (config.keyspace == 0) return false;
+        } else if (std::strcmp(arg, "--distribution") == 0 && has_value) {
+            std::string dist = argv[++i];
+            if (dist == "uniform") {
+                config.distribution = KeyDistribution::UNIFORM;
+            } else if (dist.compare(0, 4, "zipf") == 0) {
+                config.distribution = KeyDistribution::ZIPF;
+                if (dist.size() > 4) {
+                    if (dist[4] != ':') return false;
+                    config.zipf_theta = std::atof(dist.c_str() + 5);
+                }
+                // The generator divides by (1 - theta)
+                if (config.zipf_theta <= 0 || config.zipf_theta == 1.0) return false;
+            } else {
+                return false;
+            }
+        } else if (std::strcmp(arg, "--value-size") == 0 && has_value) {
+            const char* spec = argv[++i];
+            const char* dash = std::strchr(spec, '-');
+            config.value_min = std::strtoull(spec, nullptr, 10);
+            config.value_max = dash ? std::strtoull(dash + 1, nullptr, 10) : config.value_min;
+            if (config.value_max < config.value_min) return false;
+        } else if (std::strcmp(arg, "--read-ratio") == 0 && has_value) {
+            config.read_ratio = std::atof(argv[++i]);
+            if (config.read_ratio < 0 || config.read_ratio > 1) return false;
+        } else if (std::strcmp(arg, "--rate") == 0 && has_value) {
+            config.rate = std::atof(argv[++i]);
+            if (config.rate <= 0) return false;
+        } else if (std::strcmp(arg, "--preload") == 0) {
+            config.preload = true;
+        } else if (std::strcmp(arg, "--accept-compressed") == 0) {
+            config.accept_compressed = true;
+        } else if (std::strcmp(arg, "--format") == 0 && has_value) {
+            std::string format = argv[++i];
+            if (format == "text") {
+                config.format = OutputFormat::TEXT;
+            } else if (format == "json") {
+                config.format = OutputFormat::JSON;
+            } else if (format == "csv") {
+                config.format = OutputFormat::CSV;
+            } else {
+                return false;
+            }
+        } else if (std::strcmp(arg, "--seed") == 0 && has_value) {
+            config.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            return false;
+        }
+    }
+
+    if (config.connections == 0) {
+        config.connections = config.threads;
+    }
+    if (config.connections < config.threads) {
+        config.threads = config.connections;
+    }
+    return true;
+}
+
+} // namespace
+
 int main(int argc, char* argv[]) {
-    int num_ops = 10000;
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        printUsage(argv[0]);
+        return 1;
+    }
 
-    if (argc > 1) {
-        num_ops = std::atoi(argv[1]);
+    if (config.preload) {
+        if (config.format == OutputFormat::TEXT) {
+            std::cout << "Preloading " << config.keyspace << " keys..." << std::endl;
+        }
+        if (!preload(config)) {
+            std::cerr << "Preload failed" << std::endl;
+            return 1;
+        }
     }
 
-    std::cout << "KVStore Benchmark" << std::endl;
-    std::cout << "=================" << std::endl;
-    std::cout << "Operations: " << num_ops << std::endl;
+    std::unique_ptr<ZipfGenerator> zipf;
+    if (config.distribution == KeyDistribution::ZIPF) {
+        zipf = std::make_unique<ZipfGenerator>(config.keyspace, config.zipf_theta);
+    }
+
+    // Each connection gets an equal share of the requests (or of the rate)
+    const uint64_t conns_total = static_cast<uint64_t>(config.connections);
+    const uint64_t interval_ns = config.rate > 0
+        ? static_cast<uint64_t>(1e9 * conns_total / config.rate) : 0;
+
+    std::vector<std::vector<BenchConnection>> conns(config.threads);
+    for (uint64_t c = 0; c < conns_total; ++c) {
+        BenchConnection conn;
+        conn.client = std::make_unique<kvstore::Client>(config.host, config.port);
+        if (!conn.client->connect()) {
+            std::cerr << "Failed to connect" << std::endl;
+            return 1;
+        }
+        conn.client->setAcceptCompressed(config.accept_compressed);
+        conn.remaining = config.requests / conns_total + (c < config.requests % conns_total ? 1 : 0);
+        // Stagger the schedules so connections don't all fire at once
+        conn.next_send_ns = interval_ns * c / conns_total;
+        conns[c % config.threads].push_back(std::move(conn));
+    }
 
-    runBenchmark("Benchmark", num_ops);
+    std::vector<ThreadStats> stats(config.threads);
+    std::vector<std::thread> threads;
+    StartGate gate;
+    Clock::time_point base;
+
+    for (int t = 0; t < config.threads; ++t) {
+        threads.emplace_back([&, t] {
+            gate.wait();
+            runClientThread(config, zipf.get(), conns[t], interval_ns, base, stats[t],
+                            config.seed + t);
+        });
+    }
+
+    base = Clock::now();
+    gate.open();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double elapsed_sec = std::chrono::duration<double>(Clock::now() - base).count();
+
+    OpStats get_total;
+    OpStats set_total;
+    OpStats all;
+    bool failed = false;
+    for (const auto& s : stats) {
+        failed = failed || s.failed;
+        for (OpStats* total : {&get_total, &all}) {
+            total->latency.merge(s.get.latency);
+            total->errors += s.get.errors;
+            total->misses += s.get.misses;
+        }
+        for (OpStats* total : {&set_total, &all}) {
+            total->latency.merge(s.set.latency);
+            total->errors += s.set.errors;
+            total->misses += s.set.misses;
+        }
+    }
 
+    std::vector<Result> results = {{"GET", &get_total}, {"SET", &set_total}, {"ALL", &all}};
+    uint64_t total_ops = all.latency.count();
+
+    switch (config.format) {
+        case OutputFormat::TEXT: printText(config, results, total_ops, elapsed_sec); break;
+        case OutputFormat::JSON: printJson(config, results, total_ops, elapsed_sec); break;
+        case OutputFormat::CSV: printCsv(results, elapsed_sec); break;
+    }
+
+    if (failed) {
+        std::cerr << "Some connections failed; results are partial" << std::endl;
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -2,26 +2,165 @@
 #include <iostream>
 #include <csignal>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
 
 static kvstore::Server* g_server = nullptr; // ✅ capital "S"
 
 void signalHandler(int signal) {
     if (signal == SIGINT || signal == SIGTERM) {
         std::cout << "\nShutting down server..." << std::endl;
+        // run() notices the flag, joins its event loops and returns, so the
+        // store and WAL are torn down normally on the way out of main().
         if (g_server) {
             g_server->stop();
         }
-        exit(0);
     }
 }
 
+// Parses a byte count with an optional k/m/g suffix, e.g. "512m"
+static bool parseMemory(const char* text, size_t& bytes) {
+    char* end = nullptr;
+    unsigned long long value = std::strtoull(text, &end, 10);
+    if (end == text) return false;
+
+    switch (std::tolower(static_cast<unsigned char>(*end))) {
+        case '\0': break;
+        case 'k': value <<= 10; ++end; break;
+        case 'm': value <<= 20; ++end; break;
+        case 'g': value <<= 30; ++end; break;
+        default: return false;
+    }
+    if (*end == 'b' || *end == 'B') ++end;
+    if (*end != '\0') return false;
+
+    bytes = static_cast<size_t>(value);
+    return true;
+}
+
+static void printUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [port] [--io-threads N] [--shards N]\n"
+              << "    [--durability none|os-buffered|fsync-per-batch|fsync-every-<N>ms]\n"
+              << "    [--wal-segment-size BYTES[k|m|g]] [--wal-direct-io]\n"
+              << "    [--snapshot-interval SEC] [--recovery-threads N] [--expire-interval MS]\n"
+              << "    [--maxmemory BYTES[k|m|g]] [--eviction lru|lfu|random] [--eviction-samples N]\n"
+              << "    [--no-ordered-index] [--compress-threshold BYTES[k|m|g]] [--salvage-snapshot]\n"
+              << "    [--metrics-port PORT] [--io-backend epoll|io_uring]\n"
+              << "    [--replication-port PORT] [--replica-of HOST:PORT]" << std::endl;
+}
+
 int main(int argc, char* argv[]) {
-    int port = 6379;
+    kvstore::ServerConfig config;
 
-    if (argc > 1) {
-        port = std::atoi(argv[1]);
-        if (port <= 0 || port > 65535) {
-            std::cerr << "Invalid port number" << std::endl;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            int shards = std::atoi(argv[++i]);
+            if (shards <= 0) {
+                std::cerr << "Invalid shard count" << std::endl;
+                return 1;
+            }
+            config.store.num_shards = static_cast<size_t>(shards);
+        } else if (std::strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc) {
+            config.io_threads = std::atoi(argv[++i]);
+            if (config.io_threads <= 0) {
+                std::cerr << "Invalid I/O thread count" << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--durability") == 0 && i + 1 < argc) {
+            if (!kvstore::WAL::parseDurability(argv[++i], config.store.wal)) {
+                std::cerr << "Invalid durability mode: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--wal-segment-size") == 0 && i + 1 < argc) {
+            if (!parseMemory(argv[++i], config.store.wal.segment_size) ||
+                config.store.wal.segment_size == 0) {
+                std::cerr << "Invalid WAL segment size: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--wal-direct-io") == 0) {
+            config.store.wal.direct_io = true;
+        } else if (std::strcmp(argv[i], "--snapshot-interval") == 0 && i + 1 < argc) {
+            config.store.snapshot_interval_sec = std::atoi(argv[++i]);
+            if (config.store.snapshot_interval_sec < 0) {
+                std::cerr << "Invalid snapshot interval" << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--recovery-threads") == 0 && i + 1 < argc) {
+            int threads = std::atoi(argv[++i]);
+            if (threads < 0) {
+                std::cerr << "Invalid recovery thread count" << std::endl;
+                return 1;
+            }
+            config.store.recovery_threads = static_cast<size_t>(threads);
+        } else if (std::strcmp(argv[i], "--expire-interval") == 0 && i + 1 < argc) {
+            config.store.expire_interval_ms = std::atoi(argv[++i]);
+            if (config.store.expire_interval_ms < 0) {
+                std::cerr << "Invalid expire interval" << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc) {
+            if (!parseMemory(argv[++i], config.store.max_memory)) {
+                std::cerr << "Invalid memory limit: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--eviction") == 0 && i + 1 < argc) {
+            if (!kvstore::Store::parseEvictionPolicy(argv[++i], config.store.eviction)) {
+                std::cerr << "Invalid eviction policy: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--eviction-samples") == 0 && i + 1 < argc) {
+            int samples = std::atoi(argv[++i]);
+            if (samples <= 0) {
+                std::cerr << "Invalid eviction sample count" << std::endl;
+                return 1;
+            }
+            config.store.eviction_samples = static_cast<size_t>(samples);
+        } else if (std::strcmp(argv[i], "--no-ordered-index") == 0) {
+            config.store.ordered_index = false;
+        } else if (std::strcmp(argv[i], "--compress-threshold") == 0 && i + 1 < argc) {
+            if (!parseMemory(argv[++i], config.store.compress_threshold)) {
+                std::cerr << "Invalid compression threshold: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--salvage-snapshot") == 0) {
+            config.store.salvage_snapshot = true;
+        } else if (std::strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            config.metrics_port = std::atoi(argv[++i]);
+            if (config.metrics_port <= 0 || config.metrics_port > 65535) {
+                std::cerr << "Invalid metrics port" << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--replication-port") == 0 && i + 1 < argc) {
+            config.replication_port = std::atoi(argv[++i]);
+            if (config.replication_port <= 0 || config.replication_port > 65535) {
+                std::cerr << "Invalid replication port" << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--replica-of") == 0 && i + 1 < argc) {
+            // HOST:PORT, the primary's replication port
+            std::string primary = argv[++i];
+            size_t colon = primary.rfind(':');
+            int port = colon == std::string::npos ? 0 : std::atoi(primary.c_str() + colon + 1);
+            if (colon == 0 || port <= 0 || port > 65535) {
+                std::cerr << "Invalid primary address: " << primary << std::endl;
+                return 1;
+            }
+            config.primary_host = primary.substr(0, colon);
+            config.primary_port = port;
+        } else if (std::strcmp(argv[i], "--io-backend") == 0 && i + 1 < argc) {
+            if (!kvstore::Server::parseIoBackend(argv[++i], config.io_backend)) {
+                std::cerr << "Invalid or unsupported I/O backend: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (argv[i][0] != '-') {
+            config.port = std::atoi(argv[i]);
+            if (config.port <= 0 || config.port > 65535) {
+                std::cerr << "Invalid port number" << std::endl;
+                return 1;
+            }
+        } else {
+            printUsage(argv[0]);
             return 1;
         }
     }
@@ -30,10 +169,8 @@ int main(int argc, char* argv[]) {
     signal(SIGTERM, signalHandler);
     signal(SIGPIPE, SIG_IGN);
 
-    kvstore::Server server(port); // ✅ capital "S"
+    kvstore::Server server(config); // ✅ capital "S"
     g_server = &server;
 
-    server.run();
-
-    return 0;
+    return server.run() ? 0 : 1;
 }
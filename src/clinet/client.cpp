@@ -0,0 +1,358 @@
+#include "client.h"
+#include "../storage/compression.h"
+#include <iostream>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+namespace kvstore {
+
+Client::Client(const std::string& host, int port) : host_(host), port_(port) {}
+
+Client::~Client() {
+    disconnect();
+}
+
+bool Client::connect() {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+        std::cerr << "socket error: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+
+    if (inet_pton(AF_INET, host_.c_str(), &addr.sin_addr) <= 0) {
+        std::cerr << "Invalid address" << std::endl;
+        disconnect();
+        return false;
+    }
+
+    if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "connect error: " << strerror(errno) << std::endl;
+        disconnect();
+        return false;
+    }
+
+    // Requests are already batched by flush(); don't let Nagle hold them back
+    int opt = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    if (!recv_ring_.reserve(kRecvCapacity)) {
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+void Client::disconnect() {
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    send_buffer_.clear();
+    recv_ring_.clear();
+    queued_ = 0;
+    in_flight_ = 0;
+    next_id_ = 0;
+    expected_id_ = 0;
+}
+
+void Client::queue(const Protocol::Request& req) {
+    size_t start = send_buffer_.size();
+    Protocol::serializeRequest(req, send_buffer_);
+    Protocol::setRequestId(send_buffer_.data() + start, next_id_++);
+    if (accept_compressed_) {
+        Protocol::setFlags(send_buffer_.data() + start, req.flags | Protocol::kAcceptCompressed);
+    }
+    ++queued_;
+}
+
+bool Client::flush() {
+    size_t sent = 0;
+    while (sent < send_buffer_.size()) {
+        ssize_t n = send(fd_, send_buffer_.data() + sent, send_buffer_.size() - sent,
+                         MSG_DONTWAIT);
+        if (n >= 0) {
+            sent += static_cast<size_t>(n);
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            std::cerr << "send error: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        // The socket is full. The server stops reading once enough of our
+        // responses back up, so drain them while waiting or a deep pipeline
+        // would deadlock with both sides blocked in send().
+        pollfd pfd{fd_, POLLIN | POLLOUT, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            std::cerr << "poll error: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if ((pfd.revents & POLLIN) && !receive(MSG_DONTWAIT)) {
+            return false;
+        }
+    }
+
+    send_buffer_.clear();
+    in_flight_ += queued_;
+    queued_ = 0;
+    return true;
+}
+
+bool Client::readResponse(Protocol::Response& resp) {
+    if (in_flight_ == 0) {
+        std::cerr << "No response pending" << std::endl;
+        return false;
+    }
+
+    bool ready = false;
+    while (true) {
+        if (!decodeBuffered(resp, ready)) {
+            return false;
+        }
+        if (ready) {
+            return true;
+        }
+        if (!receive(0)) {
+            return false;
+        }
+    }
+}
+
+bool Client::pollResponse(Protocol::Response& resp, bool& ready) {
+    ready = false;
+    if (in_flight_ == 0) {
+        return true;
+    }
+
+    if (!decodeBuffered(resp, ready)) {
+        return false;
+    }
+    if (!ready) {
+        if (!receive(MSG_DONTWAIT)) {
+            return false;
+        }
+        return decodeBuffered(resp, ready);
+    }
+    return true;
+}
+
+bool Client::decodeBuffered(Protocol::Response& resp, bool& ready) {
+    ready = false;
+    size_t readable = recv_ring_.readable();
+
+    // The frame length is known as soon as its first bytes are in; make sure
+    // the whole frame will fit so it can be decoded in place
+    if (readable >= 4) {
+        uint32_t length = Protocol::frameLength(recv_ring_.readPtr());
+        if (length > recv_ring_.capacity() && !recv_ring_.reserve(length)) {
+            return false;
+        }
+    }
+
+    size_t used = Protocol::decodeResponse(recv_ring_.readPtr(), readable, resp);
+    if (used == 0) {
+        return true;
+    }
+    if (used == Protocol::kMalformed) {
+        std::cerr << "Malformed response" << std::endl;
+        return false;
+    }
+    if (resp.id != expected_id_) {
+        std::cerr << "Response for request " << resp.id << " while expecting "
+                  << expected_id_ << std::endl;
+        return false;
+    }
+
+    recv_ring_.consume(used);
+    ++expected_id_;
+    --in_flight_;
+
+    if (resp.flags & Protocol::kCompressed) {
+        std::string value;
+        if (!Compression::decompress(resp.data, value)) {
+            std::cerr << "Malformed compressed value" << std::endl;
+            return false;
+        }
+        resp.data = std::move(value);
+        resp.flags &= static_cast<uint8_t>(~Protocol::kCompressed);
+    }
+    ready = true;
+    return true;
+}
+
+bool Client::receive(int flags) {
+    // flush() receives without decoding, so the ring can fill up with
+    // complete responses
+    if (recv_ring_.writable() == 0 && !recv_ring_.reserve(recv_ring_.capacity() * 2)) {
+        return false;
+    }
+
+    while (true) {
+        ssize_t n = recv(fd_, recv_ring_.writePtr(), recv_ring_.writable(), flags);
+        if (n > 0) {
+            recv_ring_.commit(static_cast<size_t>(n));
+            return true;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        std::cerr << "recv error: " << (n == 0 ? "connection closed" : strerror(errno)) << std::endl;
+        return false;
+    }
+}
+
+bool Client::sendRequest(const Protocol::Request& req, Protocol::Response& resp) {
+    queue(req);
+    return flush() && readResponse(resp);
+}
+
+bool Client::pipeline(const std::vector<Protocol::Request>& reqs,
+                      std::vector<Protocol::Response>& resps) {
+    for (const auto& req : reqs) {
+        queue(req);
+    }
+    if (!flush()) {
+        return false;
+    }
+
+    resps.clear();
+    resps.resize(reqs.size());
+    for (auto& resp : resps) {
+        if (!readResponse(resp)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Client::expectOk(Protocol::Response& resp) {
+    if (!readResponse(resp)) {
+        return false;
+    }
+    if (resp.status != StatusCode::OK) {
+        std::cerr << "Error: " << (resp.error_msg.empty() ? "key not found" : resp.error_msg) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Client::setLarge(const std::string& key, std::string_view value, int64_t ttl_ms) {
+    if (in_flight_ > 0 || queued_ > 0) {
+        std::cerr << "setLarge needs an idle connection" << std::endl;
+        return false;
+    }
+
+    Protocol::Request req;
+    req.type = CommandType::PUTBEGIN;
+    req.args = {key, std::to_string(value.size())};
+    if (ttl_ms > 0) {
+        req.args.push_back(std::to_string(ttl_ms));
+    }
+    queue(req);
+
+    // Keep a window of chunks in flight; PUTEND goes out behind the last one
+    Protocol::Request chunk;
+    chunk.type = CommandType::PUTCHUNK;
+    chunk.key = key;
+    Protocol::Response resp;
+    size_t offset = 0;
+    bool ended = false;
+    while (!ended || in_flight_ > 0 || queued_ > 0) {
+        while (!ended && in_flight_ + queued_ < kStreamWindow) {
+            if (offset < value.size()) {
+                size_t size = std::min(Protocol::kMaxChunkSize, value.size() - offset);
+                chunk.value.assign(value.data() + offset, size);
+                queue(chunk);
+                offset += size;
+            } else {
+                Protocol::Request end;
+                end.type = CommandType::PUTEND;
+                end.key = key;
+                queue(end);
+                ended = true;
+            }
+        }
+        if (!flush() || !expectOk(resp)) {
+            // Drain the rest so the connection stays usable
+            while (in_flight_ > 0 && readResponse(resp)) {}
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Client::getLarge(const std::string& key, std::string& value, bool& found) {
+    if (in_flight_ > 0 || queued_ > 0) {
+        std::cerr << "getLarge needs an idle connection" << std::endl;
+        return false;
+    }
+
+    Protocol::Request req;
+    req.type = CommandType::GETRANGE;
+    req.args = {key, "0", std::to_string(Protocol::kMaxChunkSize)};
+    Protocol::Response resp;
+    if (!sendRequest(req, resp)) {
+        return false;
+    }
+    found = resp.status != StatusCode::NOT_FOUND;
+    if (!found) {
+        return true;
+    }
+    if (resp.status != StatusCode::OK) {
+        std::cerr << "Error: " << resp.error_msg << std::endl;
+        return false;
+    }
+
+    uint64_t total = 0;
+    std::string_view bytes;
+    if (!Protocol::decodeRange(resp.data, total, bytes)) {
+        std::cerr << "Malformed GETRANGE reply" << std::endl;
+        return false;
+    }
+    value.clear();
+    value.reserve(total);
+    value.append(bytes.data(), bytes.size());
+
+    uint64_t requested = value.size();
+    bool changed = false;
+    while (value.size() < total && !changed) {
+        while (requested < total && in_flight_ + queued_ < kStreamWindow) {
+            req.args[1] = std::to_string(requested);
+            queue(req);
+            requested += Protocol::kMaxChunkSize;
+        }
+        if (!flush() || !readResponse(resp)) {
+            return false;
+        }
+
+        uint64_t size = 0;
+        if (resp.status != StatusCode::OK || !Protocol::decodeRange(resp.data, size, bytes) ||
+            size != total || bytes.empty()) {
+            changed = true;
+            break;
+        }
+        value.append(bytes.data(), bytes.size());
+    }
+
+    if (changed) {
+        while (in_flight_ > 0 && readResponse(resp)) {}
+        std::cerr << "Value of " << key << " changed while it was being read" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+} // namespace kvstore
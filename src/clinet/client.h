@@ -0,0 +1,89 @@
+#pragma once
+
+#include "../protocol/protocol.h"
+#include "recv_ring.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace kvstore {
+
+    // Blocking client for the kvstore protocol. Besides one-request round
+    // trips it supports pipelining: queue() any number of requests, flush()
+    // them with a single send, then readResponse() once per request, in order.
+    // Each request is stamped with the next request id, and every response
+    // has to carry the id of the request it answers.
+    class Client {
+    public:
+        Client(const std::string& host, int port);
+        ~Client();
+
+        // non-copyable
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        bool connect();
+        void disconnect();
+        bool isConnected() const { return fd_ >= 0; }
+
+        // Ask for values the server keeps compressed to be sent that way.
+        // They are decompressed here, so responses look the same either way;
+        // this moves the work from the server to the client and shrinks the
+        // replies.
+        void setAcceptCompressed(bool accept) { accept_compressed_ = accept; }
+
+        // Single round trip
+        bool sendRequest(const Protocol::Request& req, Protocol::Response& resp);
+
+        void queue(const Protocol::Request& req);
+        bool flush();
+        bool readResponse(Protocol::Response& resp);
+        size_t pendingResponses() const { return in_flight_; }
+
+        // Non-blocking readResponse(): reads at most once from the socket and
+        // sets ready to false if no complete response has arrived yet. For
+        // callers that multiplex many clients with poll() on fd().
+        bool pollResponse(Protocol::Response& resp, bool& ready);
+        int fd() const { return fd_; }
+
+        // Queue all requests, send them together and collect every response
+        bool pipeline(const std::vector<Protocol::Request>& reqs,
+                      std::vector<Protocol::Response>& resps);
+
+        // Values of any size, moved in kMaxChunkSize pieces with up to
+        // kStreamWindow of them in flight. Nothing else may be pending.
+        // ttl_ms > 0 gives the value a time to live. getLarge() sets found to
+        // false if the key does not exist, and fails if the value changes
+        // size while it is being read.
+        bool setLarge(const std::string& key, std::string_view value, int64_t ttl_ms = 0);
+        bool getLarge(const std::string& key, std::string& value, bool& found);
+
+    private:
+        std::string host_;
+        int port_;
+        int fd_ = -1;
+
+        static constexpr size_t kRecvCapacity = 64 * 1024;
+        static constexpr size_t kStreamWindow = 8;
+
+        std::vector<uint8_t> send_buffer_;
+        RecvRing recv_ring_;
+        size_t queued_ = 0;        // requests in send_buffer_
+        size_t in_flight_ = 0;     // requests sent whose response is unread
+        uint32_t next_id_ = 0;     // id for the next queued request
+        uint32_t expected_id_ = 0; // id the next response must carry
+        bool accept_compressed_ = false;
+
+        // One recv() into recv_ring_; flags may include MSG_DONTWAIT
+        bool receive(int flags);
+
+        // Pops the first complete response off recv_ring_, if there is one.
+        // Fails on a malformed frame or one answering the wrong request.
+        bool decodeBuffered(Protocol::Response& resp, bool& ready);
+
+        // Reads one response and fails unless its status is OK
+        bool expectOk(Protocol::Response& resp);
+    };
+
+} // namespace kvstore
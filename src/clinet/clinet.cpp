@@ -1,82 +1,292 @@
-#include "../protocol/protocol.h"
+#include "client.h"
 #include <iostream>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <cstring>
+#include <cstdlib>
 #include <sstream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <optional>
 
-class Client {
+// Interactive front end over kvstore::Client. Several commands separated by
+// ';' on one line are sent as a single pipeline.
+class InteractiveClient {
 public:
-    Client(const std::string& host, int port) : host_(host), port_(port) {}
+    InteractiveClient(const std::string& host, int port)
+        : host_(host), port_(port), client_(host, port) {}
 
     bool connect() {
-        fd_ = socket(AF_INET, SOCK_STREAM, 0);
-        if (fd_ < 0) {
-            std::cerr << "socket error: " << strerror(errno) << std::endl;
+        if (!client_.connect()) {
             return false;
         }
-
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(port_);
-
-        if (inet_pton(AF_INET, host_.c_str(), &addr.sin_addr) <= 0) {
-            std::cerr << "Invalid address" << std::endl;
-            return false;
-        }
-
-        if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
-            std::cerr << "connect error: " << strerror(errno) << std::endl;
-            return false;
-        }
-
         std::cout << "Connected to " << host_ << ":" << port_ << std::endl;
         return true;
     }
 
     void disconnect() {
-        if (fd_ >= 0) {
-            close(fd_);
-            fd_ = -1;
-        }
+        client_.disconnect();
     }
 
-    bool sendRequest(const kvstore::Protocol::Request& req,
-                     kvstore::Protocol::Response& resp) {
-        auto data = kvstore::Protocol::serializeRequest(req);
+    // Parses one command; returns false (after printing why) if it is not valid
+    bool parseCommand(const std::string& text, kvstore::Protocol::Request& req) {
+        std::istringstream iss(text);
+        std::string cmd;
+        iss >> cmd;
+
+        for (char& c : cmd) c = std::toupper(c);
 
-        ssize_t sent = 0;
-        while (sent < static_cast<ssize_t>(data.size())) {
-            ssize_t n = send(fd_, data.data() + sent, data.size() - sent, 0);
-            if (n < 0) {
-                std::cerr << "send error: " << strerror(errno) << std::endl;
+        if (cmd == "SET") {
+            iss >> req.key >> req.value;
+            if (req.key.empty() || req.value.empty()) {
+                std::cout << "Usage: SET key value\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::SET;
+        } else if (cmd == "GET") {
+            iss >> req.key;
+            if (req.key.empty()) {
+                std::cout << "Usage: GET key\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::GET;
+        } else if (cmd == "DELETE" || cmd == "DEL") {
+            iss >> req.key;
+            if (req.key.empty()) {
+                std::cout << "Usage: DELETE key\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::DELETE;
+        } else if (cmd == "SETEX") {
+            iss >> req.key >> req.value >> req.ttl_ms;
+            if (req.key.empty() || req.value.empty() || !iss) {
+                std::cout << "Usage: SETEX key value ttl_ms\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::SETEX;
+        } else if (cmd == "EXPIRE") {
+            iss >> req.key >> req.ttl_ms;
+            if (req.key.empty() || !iss) {
+                std::cout << "Usage: EXPIRE key ttl_ms\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::EXPIRE;
+        } else if (cmd == "TTL") {
+            iss >> req.key;
+            if (req.key.empty()) {
+                std::cout << "Usage: TTL key\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::TTL;
+        } else if (cmd == "INCR" || cmd == "DECR" || cmd == "INCRBY" || cmd == "DECRBY") {
+            // All four are INCRBY on the wire; the delta is sent as text
+            bool by = cmd.size() > 4;
+            iss >> req.key;
+            if (by) {
+                iss >> req.value;
+            } else {
+                req.value = "1";
+            }
+            if (req.key.empty() || req.value.empty()) {
+                std::cout << "Usage: " << cmd << " key" << (by ? " delta\n" : "\n");
+                return false;
+            }
+            if (cmd[0] == 'D') {
+                req.value = req.value[0] == '-' ? req.value.substr(1) : "-" + req.value;
+            }
+            req.type = kvstore::CommandType::INCRBY;
+        } else if (cmd == "APPEND" || cmd == "GETSET") {
+            iss >> req.key >> req.value;
+            if (req.key.empty() || req.value.empty()) {
+                std::cout << "Usage: " << cmd << " key value\n";
+                return false;
+            }
+            req.type = cmd == "APPEND" ? kvstore::CommandType::APPEND : kvstore::CommandType::GETSET;
+        } else if (cmd == "GETV") {
+            iss >> req.key;
+            if (req.key.empty()) {
+                std::cout << "Usage: GETV key\n";
                 return false;
             }
-            sent += n;
+            req.type = kvstore::CommandType::GETV;
+        } else if (cmd == "CAS") {
+            std::string arg;
+            while (iss >> arg) {
+                req.args.push_back(arg);
+            }
+            if (req.args.size() != 3) {
+                std::cout << "Usage: CAS key version value\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::CAS;
+        } else if (cmd == "TXN") {
+            // TXN op [op ...] with ops SET key value, SETEX key value ttl_ms
+            // and DEL key; op words are sent in upper case
+            std::string arg;
+            size_t expected = 0;
+            while (iss >> arg) {
+                if (expected == 0) {
+                    for (char& c : arg) c = std::toupper(c);
+                    expected = arg == "SET" ? 2 : arg == "SETEX" ? 3 : arg == "DEL" ? 1 : 0;
+                    if (expected == 0) {
+                        std::cout << "Unknown transaction op: " << arg << "\n";
+                        return false;
+                    }
+                } else {
+                    --expected;
+                }
+                req.args.push_back(arg);
+            }
+            if (req.args.empty() || expected != 0) {
+                std::cout << "Usage: TXN op [op ...], ops SET k v, SETEX k v ttl_ms, DEL k\n";
+                return false;
+            }
+            req.type = kvstore::CommandType::TXN;
+        } else if (cmd == "SCAN" || cmd == "PREFIX") {
+            // "-" stands for an empty start or end
+            std::string arg;
+            while (iss >> arg) {
+                req.args.push_back(arg == "-" ? std::string() : arg);
+            }
+            if (cmd == "SCAN") {
+                if (req.args.size() != 3) {
+                    std::cout << "Usage: SCAN start|- end|- limit\n";
+                    return false;
+                }
+                req.type = kvstore::CommandType::SCAN;
+            } else {
+                if (req.args.size() != 2) {
+                    std::cout << "Usage: PREFIX prefix limit\n";
+                    return false;
+                }
+                req.type = kvstore::CommandType::PREFIX;
+            }
+        } else if (cmd == "PING") {
+            req.type = kvstore::CommandType::PING;
+        } else if (cmd == "STATS") {
+            req.type = kvstore::CommandType::STATS;
+        } else if (cmd == "MSET" || cmd == "MGET" || cmd == "MDEL") {
+            std::string arg;
+            while (iss >> arg) {
+                req.args.push_back(arg);
+            }
+            if (cmd == "MSET") {
+                if (req.args.empty() || req.args.size() % 2 != 0) {
+                    std::cout << "Usage: MSET key value [key value ...]\n";
+                    return false;
+                }
+                req.type = kvstore::CommandType::MSET;
+            } else {
+                if (req.args.empty()) {
+                    std::cout << "Usage: " << cmd << " key [key ...]\n";
+                    return false;
+                }
+                req.type = cmd == "MGET" ? kvstore::CommandType::MGET : kvstore::CommandType::MDEL;
+            }
+        } else {
+            std::cout << "Unknown command: " << cmd << "\n";
+            return false;
         }
+        return true;
+    }
 
-        std::vector<uint8_t> buffer(4096);
-        ssize_t n = recv(fd_, buffer.data(), buffer.size(), 0);
-        if (n <= 0) {
-            std::cerr << "recv error: " << strerror(errno) << std::endl;
-            return false;
+    void printResponse(const kvstore::Protocol::Request& req, const kvstore::Protocol::Response& resp) {
+        if (resp.status == kvstore::StatusCode::OK && req.type == kvstore::CommandType::MGET) {
+            std::vector<std::optional<std::string>> values;
+            if (!kvstore::Protocol::decodeMultiGet(resp.data, values)) {
+                std::cout << "Error: malformed MGET reply\n";
+                return;
+            }
+            for (size_t i = 0; i < values.size(); ++i) {
+                std::cout << (i + 1) << ") " << (values[i] ? *values[i] : "(nil)") << "\n";
+            }
+        } else if (resp.status == kvstore::StatusCode::OK &&
+                   (req.type == kvstore::CommandType::SCAN || req.type == kvstore::CommandType::PREFIX)) {
+            std::vector<std::pair<std::string, std::string>> items;
+            std::string cursor;
+            if (!kvstore::Protocol::decodeScan(resp.data, items, cursor)) {
+                std::cout << "Error: malformed scan reply\n";
+                return;
+            }
+            for (size_t i = 0; i < items.size(); ++i) {
+                std::cout << (i + 1) << ") " << items[i].first << " = " << items[i].second << "\n";
+            }
+            if (items.empty()) {
+                std::cout << "(empty)\n";
+            }
+            if (!cursor.empty()) {
+                std::cout << "(more after \"" << items.back().first << "\")\n";
+            }
+        } else if (resp.status == kvstore::StatusCode::OK && req.type == kvstore::CommandType::GETV) {
+            uint32_t version = 0;
+            std::string_view value;
+            if (!kvstore::Protocol::decodeVersioned(resp.data, version, value)) {
+                std::cout << "Error: malformed GETV reply\n";
+                return;
+            }
+            std::cout << value << " (version " << version << ")\n";
+        } else if (resp.status == kvstore::StatusCode::OK) {
+            std::cout << resp.data << "\n";
+        } else if (resp.status == kvstore::StatusCode::NOT_FOUND) {
+            std::cout << "(nil)\n";
+        } else if (resp.status == kvstore::StatusCode::CONFLICT) {
+            std::cout << "(conflict, version is " << resp.error_msg << ")\n";
+        } else {
+            std::cout << "Error: " << resp.error_msg << "\n";
         }
+    }
 
-        buffer.resize(n);
+    // PUTFILE key path and GETFILE key path move a file's contents in
+    // chunks, for values too large for a single SET or GET
+    void transferFile(const std::string& cmd, std::istringstream& iss) {
+        std::string key;
+        std::string path;
+        iss >> key >> path;
+        if (key.empty() || path.empty()) {
+            std::cout << "Usage: " << cmd << " key path\n";
+            return;
+        }
 
-        if (!kvstore::Protocol::deserializeResponse(buffer, resp)) {
-            std::cerr << "Failed to deserialize response" << std::endl;
-            return false;
+        if (cmd == "PUTFILE") {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                std::cout << "Error: cannot read " << path << "\n";
+                return;
+            }
+            std::string value((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (client_.setLarge(key, value)) {
+                std::cout << "OK (" << value.size() << " bytes)\n";
+            }
+            return;
         }
 
-        return true;
+        std::string value;
+        bool found = false;
+        if (!client_.getLarge(key, value, found)) {
+            return;
+        }
+        if (!found) {
+            std::cout << "(nil)\n";
+            return;
+        }
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out.write(value.data(), static_cast<std::streamsize>(value.size()))) {
+            std::cout << "Error: cannot write " << path << "\n";
+            return;
+        }
+        std::cout << "OK (" << value.size() << " bytes)\n";
     }
 
     void runInteractive() {
         std::cout << "\nKVStore Client\n";
-        std::cout << "Commands: SET key value, GET key, DELETE key, PING, QUIT\n\n";
+        std::cout << "Commands: SET key value, GET key, DELETE key, PING, STATS,\n"
+                  << "          MSET k v [k v ...], MGET k [k ...], MDEL k [k ...],\n"
+                  << "          SETEX key value ttl_ms, EXPIRE key ttl_ms, TTL key,\n"
+                  << "          INCR key, DECR key, INCRBY key n, DECRBY key n,\n"
+                  << "          APPEND key value, GETSET key value,\n"
+                  << "          GETV key, CAS key version value,\n"
+                  << "          TXN SET k v | SETEX k v ttl_ms | DEL k ...,\n"
+                  << "          SCAN start|- end|- limit, PREFIX prefix limit,\n"
+                  << "          PUTFILE key path, GETFILE key path, QUIT\n";
+        std::cout << "Separate commands with ';' to pipeline them\n\n";
 
         std::string line;
         while (true) {
@@ -87,54 +297,38 @@ public:
 
             if (line.empty()) continue;
 
-            std::istringstream iss(line);
+            std::istringstream first(line);
             std::string cmd;
-            iss >> cmd;
-
+            first >> cmd;
             for (char& c : cmd) c = std::toupper(c);
 
             if (cmd == "QUIT" || cmd == "EXIT") {
                 break;
             }
+            if (cmd == "PUTFILE" || cmd == "GETFILE") {
+                transferFile(cmd, first);
+                continue;
+            }
 
-            kvstore::Protocol::Request req;
-            kvstore::Protocol::Response resp;
-
-            if (cmd == "SET") {
-                iss >> req.key >> req.value;
-                if (req.key.empty() || req.value.empty()) {
-                    std::cout << "Usage: SET key value\n";
-                    continue;
-                }
-                req.type = kvstore::CommandType::SET;
-            } else if (cmd == "GET") {
-                iss >> req.key;
-                if (req.key.empty()) {
-                    std::cout << "Usage: GET key\n";
-                    continue;
+            std::vector<kvstore::Protocol::Request> reqs;
+            std::istringstream commands(line);
+            std::string text;
+            bool valid = true;
+            while (std::getline(commands, text, ';')) {
+                if (text.find_first_not_of(" \t") == std::string::npos) continue;
+                kvstore::Protocol::Request req;
+                if (!parseCommand(text, req)) {
+                    valid = false;
+                    break;
                 }
-                req.type = kvstore::CommandType::GET;
-            } else if (cmd == "DELETE" || cmd == "DEL") {
-                iss >> req.key;
-                if (req.key.empty()) {
-                    std::cout << "Usage: DELETE key\n";
-                    continue;
-                }
-                req.type = kvstore::CommandType::DELETE;
-            } else if (cmd == "PING") {
-                req.type = kvstore::CommandType::PING;
-            } else {
-                std::cout << "Unknown command: " << cmd << "\n";
-                continue;
+                reqs.push_back(std::move(req));
             }
+            if (!valid || reqs.empty()) continue;
 
-            if (sendRequest(req, resp)) {
-                if (resp.status == kvstore::StatusCode::OK) {
-                    std::cout << resp.data << "\n";
-                } else if (resp.status == kvstore::StatusCode::NOT_FOUND) {
-                    std::cout << "(nil)\n";
-                } else {
-                    std::cout << "Error: " << resp.error_msg << "\n";
+            std::vector<kvstore::Protocol::Response> resps;
+            if (client_.pipeline(reqs, resps)) {
+                for (size_t i = 0; i < resps.size(); ++i) {
+                    printResponse(reqs[i], resps[i]);
                 }
             }
         }
@@ -143,7 +337,7 @@ public:
 private:
     std::string host_;
     int port_;
-    int fd_ = -1;
+    kvstore::Client client_;
 };
 
 int main(int argc, char* argv[]) {
@@ -157,7 +351,7 @@ int main(int argc, char* argv[]) {
         port = std::atoi(argv[2]);
     }
 
-    Client client(host, port);
+    InteractiveClient client(host, port);
 
     if (!client.connect()) {
         return 1;
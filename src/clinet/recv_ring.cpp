@@ -0,0 +1,75 @@
+#include "recv_ring.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace kvstore {
+
+RecvRing::~RecvRing() {
+    unmap();
+}
+
+void RecvRing::unmap() {
+    if (data_) {
+        munmap(data_, capacity_ * 2);
+        data_ = nullptr;
+    }
+}
+
+bool RecvRing::reserve(size_t size) {
+    if (size <= capacity_) return true;
+
+    size_t capacity = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    int fd = memfd_create("kvstore-recv", MFD_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "memfd_create error: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(capacity)) != 0) {
+        std::cerr << "ftruncate error: " << strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+
+    // Reserve both halves first so nothing else can land in between, then
+    // map the file over each of them
+    void* base = mmap(nullptr, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        std::cerr << "mmap error: " << strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+    uint8_t* data = static_cast<uint8_t*>(base);
+    for (int half = 0; half < 2; ++half) {
+        if (mmap(data + half * capacity, capacity, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            std::cerr << "mmap error: " << strerror(errno) << std::endl;
+            munmap(base, capacity * 2);
+            close(fd);
+            return false;
+        }
+    }
+    // The mappings keep the memory alive
+    close(fd);
+
+    size_t unread = readable();
+    if (unread > 0) {
+        std::memcpy(data, readPtr(), unread);
+    }
+    unmap();
+
+    data_ = data;
+    capacity_ = capacity;
+    mask_ = capacity - 1;
+    head_ = 0;
+    tail_ = unread;
+    return true;
+}
+
+} // namespace kvstore
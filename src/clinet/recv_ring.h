@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace kvstore {
+
+    // Receive buffer for the client. The same pages are mapped twice, back
+    // to back, so the unread bytes always look contiguous even when they wrap
+    // around the end of the ring: responses are decoded straight out of it
+    // and recv() always gets every free byte, with nothing ever being moved
+    // down to the front.
+    class RecvRing {
+    public:
+        RecvRing() = default;
+        ~RecvRing();
+
+        RecvRing(const RecvRing&) = delete;
+        RecvRing& operator=(const RecvRing&) = delete;
+
+        // Makes room for at least size bytes, keeping the unread ones.
+        // Capacity is rounded up to a power of two number of pages.
+        bool reserve(size_t size);
+        size_t capacity() const { return capacity_; }
+
+        const uint8_t* readPtr() const { return data_ + (head_ & mask_); }
+        size_t readable() const { return static_cast<size_t>(tail_ - head_); }
+        void consume(size_t n) { head_ += n; }
+
+        uint8_t* writePtr() { return data_ + (tail_ & mask_); }
+        size_t writable() const { return capacity_ - readable(); }
+        void commit(size_t n) { tail_ += n; }
+
+        void clear() { head_ = tail_ = 0; }
+
+    private:
+        uint8_t* data_ = nullptr;
+        size_t capacity_ = 0;
+        size_t mask_ = 0;
+        uint64_t head_ = 0;   // total bytes consumed
+        uint64_t tail_ = 0;   // total bytes committed
+
+        void unmap();
+    };
+
+} // namespace kvstore
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <optional>
+#include <utility>
 #include <cstdint>
 
 namespace kvstore {
@@ -11,40 +14,267 @@ enum class CommandType : uint8_t {
     SET = 1,
     GET = 2,
     DELETE = 3,
-    PING = 4
+    PING = 4,
+
+    // Multi-key commands carry a list of strings instead of key/value:
+    // MSET k1 v1 k2 v2 ..., MGET k1 k2 ..., MDEL k1 k2 ...
+    MSET = 5,
+    MGET = 6,
+    MDEL = 7,
+
+    // Expiry. TTLs are in milliseconds: SETEX key value ttl, EXPIRE key ttl
+    // (ttl <= 0 deletes the key) and TTL key, which replies with the time
+    // left or -1 if the key does not expire. TTLs over 100 years are refused.
+    SETEX = 8,
+    EXPIRE = 9,
+    TTL = 10,
+
+    // Ordered scans, paginated with a cursor. Argument lists like the
+    // multi-key commands: SCAN start end limit (empty end: no bound) and
+    // PREFIX prefix limit [cursor]. The reply carries the cursor to send as
+    // start (or cursor) for the next page, empty once the scan is done.
+    SCAN = 11,
+    PREFIX = 12,
+
+    // Server metrics as text, one "name value" sample per line in the
+    // Prometheus exposition format. Takes no key.
+    STATS = 13,
+
+    // Values too large for one frame are moved in chunks of at most
+    // kMaxChunkSize. An upload is PUTBEGIN key size [ttl_ms] (an argument
+    // list), then PUTCHUNK key data for each chunk in order, then PUTEND key,
+    // which stores the value. A connection has one upload at a time. Values
+    // are read back with GETRANGE key offset length (an argument list),
+    // which replies with the value's total size and the requested bytes.
+    PUTBEGIN = 14,
+    PUTCHUNK = 15,
+    PUTEND = 16,
+    GETRANGE = 17,
+
+    // Atomic read-modify-write, all single-key with a value except CAS.
+    // INCRBY key delta takes the delta as signed decimal text and replies
+    // with the new number; APPEND key suffix replies with the new length;
+    // GETSET key value replies with the old value (NOT_FOUND if there was
+    // none, though the value is still set). Both INCRBY and APPEND create a
+    // missing key and keep an existing TTL.
+    INCRBY = 18,
+    APPEND = 19,
+    GETSET = 20,
+
+    // Optimistic concurrency. Every write gives a key a new version; GETV
+    // key replies with the value and its version, and CAS key version value
+    // (an argument list) sets the value only if the version still matches,
+    // replying with the new version or CONFLICT and the current one (0 if
+    // the key is missing; CAS with version 0 creates a key only if missing).
+    // Versions are decimal text except in the GETV reply.
+    CAS = 21,
+    GETV = 22,
+
+    // Several writes applied and logged as one atomic unit. An argument
+    // list of ops, each a word and its arguments: SET key value,
+    // SETEX key value ttl_ms or DEL key. Replies with the number of keys
+    // the DELs removed.
+    TXN = 23,
+
+    // Replication, spoken only on a primary's replication port. A replica
+    // sends SYNC (an empty argument list) and gets back an endless stream
+    // of OK frames whose payload is a run of whole WAL records: first a
+    // copy of the store, ended by a frame flagged kSyncComplete, then
+    // everything the primary logs. Now and then the replica answers with
+    // REPLACK bytes (an argument list), the stream payload applied so far.
+    SYNC = 24,
+    REPLACK = 25
 };
 
 // Response status
 enum class StatusCode : uint8_t {
     OK = 0,
     ERROR = 1,
-    NOT_FOUND = 2
+    NOT_FOUND = 2,
+    CONFLICT = 3
 };
 
 class Protocol {
 public:
+    // Every request and response is one frame that starts with the same
+    // header: [length(4)][version(1)][flags(1)][request_id(4)]. length is
+    // the size of the whole frame, header included, so a reader knows how
+    // much to wait for before looking at anything else. The client picks
+    // request_id and the server echoes it in the response. Integers are
+    // big-endian.
+    //
+    // Requests continue with the command:
+    //   Single-key: [type(1)][key_len(4)][key]([value_len(4)][value])([ttl_ms(8)])
+    //   Multi-key:  [type(1)][argc(4)] then argc x [len(4)][bytes]
+    // Responses with [status(1)] and the payload, which runs to the end of
+    // the frame.
+    static constexpr uint8_t kVersion = 2;
+    static constexpr size_t kHeaderSize = 10;
+
+    // Frame flags. A request with kAcceptCompressed lets GET and MGET send
+    // values the server keeps compressed as they are, in Compression's
+    // form, rather than decompressing them; a GET response with kCompressed
+    // (and an MGET item marked 2 instead of 1) holds such a value.
+    static constexpr uint8_t kAcceptCompressed = 0x01;
+    static constexpr uint8_t kCompressed = 0x01;
+
+    // Replication stream frame flag; see CommandType::SYNC
+    static constexpr uint8_t kSyncComplete = 0x02;
+
+    // Largest frame either side accepts, and the largest PUTCHUNK or
+    // GETRANGE slice, which leaves room for the rest of its frame
+    static constexpr size_t kMaxFrameSize = 1024 * 1024;
+    static constexpr size_t kMaxChunkSize = 512 * 1024;
+
     struct Request {
         CommandType type;
         std::string key;
         std::string value;
+        std::vector<std::string> args;   // multi-key commands only
+        int64_t ttl_ms = 0;              // SETEX and EXPIRE only
+        uint32_t id = 0;
+        uint8_t flags = 0;
     };
 
+    // Zero-copy form of Request: key, value and args point into the buffer
+    // the frame was parsed from and are only valid while it is untouched.
+    // args holds argc encoded strings; walk them with nextArg().
+    struct RequestView {
+        CommandType type;
+        std::string_view key;
+        std::string_view value;
+        uint32_t argc = 0;
+        std::string_view args;
+        int64_t ttl_ms = 0;
+        uint32_t id = 0;
+        uint8_t flags = 0;
+    };
+
+    static bool hasValue(CommandType type) {
+        return type == CommandType::SET || type == CommandType::SETEX || type == CommandType::PUTCHUNK ||
+               type == CommandType::INCRBY || type == CommandType::APPEND || type == CommandType::GETSET;
+    }
+
+    static bool hasTtl(CommandType type) {
+        return type == CommandType::SETEX || type == CommandType::EXPIRE;
+    }
+
+    static bool isMultiKey(CommandType type) {
+        return type == CommandType::MSET || type == CommandType::MGET || type == CommandType::MDEL;
+    }
+
+    // Commands framed as an argument list rather than key/value
+    static bool hasArgList(CommandType type) {
+        return isMultiKey(type) || type == CommandType::SCAN || type == CommandType::PREFIX ||
+               type == CommandType::PUTBEGIN || type == CommandType::GETRANGE || type == CommandType::CAS ||
+               type == CommandType::TXN || type == CommandType::SYNC || type == CommandType::REPLACK;
+    }
+
+    // Commands a read-only replica refuses
+    static bool isWrite(CommandType type) {
+        switch (type) {
+            case CommandType::SET: case CommandType::DELETE: case CommandType::MSET:
+            case CommandType::MDEL: case CommandType::SETEX: case CommandType::EXPIRE:
+            case CommandType::PUTBEGIN: case CommandType::PUTCHUNK: case CommandType::PUTEND:
+            case CommandType::INCRBY: case CommandType::APPEND: case CommandType::GETSET:
+            case CommandType::CAS: case CommandType::TXN:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Pops the next encoded string off the front of args
+    static bool nextArg(std::string_view& args, std::string_view& arg);
+
     struct Response {
         StatusCode status;
         std::string data;
         std::string error_msg;
+        uint32_t id = 0;
+        uint8_t flags = 0;
     };
 
+    // Size of the frame starting at data, once its first 4 bytes are there
+    static uint32_t frameLength(const uint8_t* data) { return readUint32(data); }
+
+    // Writes a header for a frame of length bytes in total
+    static void encodeHeader(uint8_t* out, uint32_t length, uint8_t flags, uint32_t id);
+
+    // Back-patches the length of a frame whose size was not known up front
+    static void setFrameLength(uint8_t* frame, size_t length) { writeUint32(frame, static_cast<uint32_t>(length)); }
+
+    // Stamps id and flags into an already encoded frame
+    static void setRequestId(uint8_t* frame, uint32_t id) { writeUint32(frame + 6, id); }
+    static void setFlags(uint8_t* frame, uint8_t flags) { frame[5] = flags; }
+    static uint8_t frameFlags(const uint8_t* frame) { return frame[5]; }
+
     static std::vector<uint8_t> serializeRequest(const Request& req);
+
+    // Appends the framed request to out without any temporary buffers
+    static void serializeRequest(const Request& req, std::vector<uint8_t>& out);
+
     static bool deserializeRequest(const std::vector<uint8_t>& data, Request& req);
+
+    // Decodes the frame at data (size bytes, at least the whole frame) in
+    // place; fields are never read past the end of the frame
+    static bool deserializeRequest(const uint8_t* data, size_t size, Request& req);
+    static bool parseRequest(const uint8_t* data, size_t size, RequestView& req);
+
     static std::vector<uint8_t> serializeResponse(const Response& resp);
+
+    // Encodes a response straight into caller-provided memory, which must
+    // hold responseSize(payload) bytes. The status byte is at kStatusOffset.
+    static constexpr size_t kStatusOffset = kHeaderSize;
+    static size_t responseSize(std::string_view payload) { return kHeaderSize + 1 + payload.size(); }
+    static void encodeResponse(uint8_t* out, uint32_t id, StatusCode status, std::string_view payload,
+                               uint8_t flags = 0);
     static bool deserializeResponse(const std::vector<uint8_t>& data, Response& resp);
 
+    // Pipelining: decodes the response at the front of data. Returns the
+    // number of bytes it occupied, 0 if data does not yet hold all of it, or
+    // kMalformed if it is not a valid response frame, so a client can read
+    // many responses out of one receive buffer.
+    static constexpr size_t kMalformed = static_cast<size_t>(-1);
+    static size_t decodeResponse(const uint8_t* data, size_t size, Response& resp);
+
+    // MGET reply payload: [count(4)] then per key [found(1)][len(4)][value].
+    // found is 2 for a compressed value; decodeMultiGet() decompresses it.
+    static size_t multiGetItemSize(std::string_view value) { return 5 + value.size(); }
+    static void encodeMultiGetItem(uint8_t* out, bool found, std::string_view value, bool compressed = false);
+    static bool decodeMultiGet(std::string_view payload, std::vector<std::optional<std::string>>& values);
+
+    // SCAN/PREFIX reply payload: [count(4)] then per item
+    // [key_len(4)][key][value_len(4)][value], then [cursor_len(4)][cursor]
+    static size_t scanItemSize(std::string_view key, std::string_view value) {
+        return 8 + key.size() + value.size();
+    }
+    static void encodeScanItem(uint8_t* out, std::string_view key, std::string_view value);
+    static bool decodeScan(std::string_view payload, std::vector<std::pair<std::string, std::string>>& items,
+                           std::string& cursor);
+
+    // GETRANGE reply payload: [total_size(8)][bytes]
+    static size_t rangeSize(std::string_view bytes) { return 8 + bytes.size(); }
+    static void encodeRange(uint8_t* out, uint64_t total_size, std::string_view bytes);
+    static bool decodeRange(std::string_view payload, uint64_t& total_size, std::string_view& bytes);
+
+    // GETV reply payload: [version(4)][value]
+    static size_t versionedSize(std::string_view value) { return 4 + value.size(); }
+    static void encodeVersioned(uint8_t* out, uint32_t version, std::string_view value);
+    static bool decodeVersioned(std::string_view payload, uint32_t& version, std::string_view& value);
+
     // Helper functions
     static void writeUint32(std::vector<uint8_t>& buf, uint32_t val);
     static uint32_t readUint32(const std::vector<uint8_t>& buf, size_t offset);
-    static void writeString(std::vector<uint8_t>& buf, const std::string& str);
+    static uint32_t readUint32(const uint8_t* data);
+    static void writeUint32(uint8_t* out, uint32_t val);
+    static void writeUint64(std::vector<uint8_t>& buf, uint64_t val);
+    static void writeUint64(uint8_t* out, uint64_t val);
+    static uint64_t readUint64(const uint8_t* data);
+    static void writeString(std::vector<uint8_t>& buf, std::string_view str);
     static bool readString(const std::vector<uint8_t>& buf, size_t& offset, std::string& str);
+    static bool readString(const uint8_t* data, size_t size, size_t& offset, std::string& str);
+    static bool readStringView(const uint8_t* data, size_t size, size_t& offset, std::string_view& str);
 };
 
 } // namespace kvstore
\ No newline at end of file
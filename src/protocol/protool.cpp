@@ -1,4 +1,5 @@
 #include "protocol.h"
+#include "../storage/compression.h"
 #include <cstring>
 #include <arpa/inet.h>
 
@@ -12,91 +13,320 @@ void Protocol::writeUint32(std::vector<uint8_t>& buf, uint32_t val) {
 
 uint32_t Protocol::readUint32(const std::vector<uint8_t>& buf, size_t offset) {
     if (offset + 4 > buf.size()) return 0;
+    return readUint32(buf.data() + offset);
+}
+
+uint32_t Protocol::readUint32(const uint8_t* data) {
     uint32_t net_val;
-    std::memcpy(&net_val, buf.data() + offset, 4);
+    std::memcpy(&net_val, data, 4);
     return ntohl(net_val);
 }
 
-void Protocol::writeString(std::vector<uint8_t>& buf, const std::string& str) {
+void Protocol::writeUint32(uint8_t* out, uint32_t val) {
+    uint32_t net_val = htonl(val);
+    std::memcpy(out, &net_val, 4);
+}
+
+void Protocol::writeUint64(std::vector<uint8_t>& buf, uint64_t val) {
+    writeUint32(buf, static_cast<uint32_t>(val >> 32));
+    writeUint32(buf, static_cast<uint32_t>(val));
+}
+
+void Protocol::writeUint64(uint8_t* out, uint64_t val) {
+    writeUint32(out, static_cast<uint32_t>(val >> 32));
+    writeUint32(out + 4, static_cast<uint32_t>(val));
+}
+
+uint64_t Protocol::readUint64(const uint8_t* data) {
+    return (static_cast<uint64_t>(readUint32(data)) << 32) | readUint32(data + 4);
+}
+
+bool Protocol::nextArg(std::string_view& args, std::string_view& arg) {
+    size_t offset = 0;
+    if (!readStringView(reinterpret_cast<const uint8_t*>(args.data()), args.size(), offset, arg)) {
+        return false;
+    }
+    args.remove_prefix(offset);
+    return true;
+}
+
+void Protocol::writeString(std::vector<uint8_t>& buf, std::string_view str) {
     writeUint32(buf, str.size());
     buf.insert(buf.end(), str.begin(), str.end());
 }
 
 bool Protocol::readString(const std::vector<uint8_t>& buf, size_t& offset, std::string& str) {
-    if (offset + 4 > buf.size()) return false;
+    return readString(buf.data(), buf.size(), offset, str);
+}
 
-    uint32_t len = readUint32(buf, offset);
+bool Protocol::readString(const uint8_t* data, size_t size, size_t& offset, std::string& str) {
+    std::string_view view;
+    if (!readStringView(data, size, offset, view)) return false;
+    str.assign(view.data(), view.size());
+    return true;
+}
+
+bool Protocol::readStringView(const uint8_t* data, size_t size, size_t& offset, std::string_view& str) {
+    if (offset + 4 > size) return false;
+
+    uint32_t len = readUint32(data + offset);
     offset += 4;
 
-    if (offset + len > buf.size()) return false;
+    if (len > size - offset) return false;
 
-    str.assign(buf.begin() + offset, buf.begin() + offset + len);
+    str = std::string_view(reinterpret_cast<const char*>(data + offset), len);
     offset += len;
     return true;
 }
 
 std::vector<uint8_t> Protocol::serializeRequest(const Request& req) {
-    std::vector<uint8_t> payload;
+    std::vector<uint8_t> result;
+    serializeRequest(req, result);
+    return result;
+}
 
-    payload.push_back(static_cast<uint8_t>(req.type));
-    writeString(payload, req.key);
+void Protocol::encodeHeader(uint8_t* out, uint32_t length, uint8_t flags, uint32_t id) {
+    writeUint32(out, length);
+    out[4] = kVersion;
+    out[5] = flags;
+    writeUint32(out + 6, id);
+}
 
-    if (req.type == CommandType::SET) {
-        writeString(payload, req.value);
-    }
+void Protocol::serializeRequest(const Request& req, std::vector<uint8_t>& out) {
+    // Reserve the header and fill it in once the size is known
+    size_t start = out.size();
+    out.resize(start + kHeaderSize);
 
-    std::vector<uint8_t> result;
-    writeUint32(result, payload.size());
-    result.insert(result.end(), payload.begin(), payload.end());
+    out.push_back(static_cast<uint8_t>(req.type));
 
-    return result;
+    if (hasArgList(req.type)) {
+        writeUint32(out, req.args.size());
+        for (const auto& arg : req.args) {
+            writeString(out, arg);
+        }
+    } else {
+        writeString(out, req.key);
+
+        if (hasValue(req.type)) {
+            writeString(out, req.value);
+        }
+        if (hasTtl(req.type)) {
+            writeUint64(out, static_cast<uint64_t>(req.ttl_ms));
+        }
+    }
+
+    encodeHeader(out.data() + start, static_cast<uint32_t>(out.size() - start), req.flags, req.id);
 }
 
 bool Protocol::deserializeRequest(const std::vector<uint8_t>& data, Request& req) {
-    if (data.size() < 5) return false;
+    return deserializeRequest(data.data(), data.size(), req);
+}
 
-    uint32_t msg_len = readUint32(data, 0);
-    if (data.size() < 4 + msg_len) return false;
+bool Protocol::deserializeRequest(const uint8_t* data, size_t size, Request& req) {
+    RequestView view;
+    if (!parseRequest(data, size, view)) return false;
 
-    size_t offset = 4;
+    req.type = view.type;
+    req.id = view.id;
+    req.flags = view.flags;
+    req.key.assign(view.key.data(), view.key.size());
+    req.value.assign(view.value.data(), view.value.size());
+    req.ttl_ms = view.ttl_ms;
+
+    req.args.clear();
+    std::string_view args = view.args;
+    std::string_view arg;
+    for (uint32_t i = 0; i < view.argc; ++i) {
+        if (!nextArg(args, arg)) return false;
+        req.args.emplace_back(arg);
+    }
+    return true;
+}
+
+bool Protocol::parseRequest(const uint8_t* data, size_t size, RequestView& req) {
+    if (size < kHeaderSize + 1) return false;
+
+    uint32_t length = frameLength(data);
+    if (length < kHeaderSize + 1 || length > size || data[4] != kVersion) return false;
+
+    // Only look at this frame, even if more data follows it
+    size = length;
+    req.flags = data[5];
+    req.id = readUint32(data + 6);
+
+    size_t offset = kHeaderSize;
     req.type = static_cast<CommandType>(data[offset++]);
+    req.key = std::string_view();
+    req.value = std::string_view();
+    req.argc = 0;
+    req.args = std::string_view();
+    req.ttl_ms = 0;
+
+    if (hasArgList(req.type)) {
+        if (offset + 4 > size) return false;
+        req.argc = readUint32(data + offset);
+        offset += 4;
+
+        // Every argument needs at least its 4-byte length
+        if (req.argc > (size - offset) / 4) return false;
+        req.args = std::string_view(reinterpret_cast<const char*>(data + offset), size - offset);
+        return true;
+    }
 
-    if (!readString(data, offset, req.key)) return false;
+    if (!readStringView(data, size, offset, req.key)) return false;
 
-    if (req.type == CommandType::SET) {
-        if (!readString(data, offset, req.value)) return false;
+    if (hasValue(req.type)) {
+        if (!readStringView(data, size, offset, req.value)) return false;
+    }
+
+    if (hasTtl(req.type)) {
+        if (size - offset < 8) return false;
+        req.ttl_ms = static_cast<int64_t>(readUint64(data + offset));
     }
 
     return true;
 }
 
 std::vector<uint8_t> Protocol::serializeResponse(const Response& resp) {
-    std::vector<uint8_t> result;
-
-    result.push_back(static_cast<uint8_t>(resp.status));
-
     const std::string& payload = (resp.status == StatusCode::OK) ? resp.data : resp.error_msg;
-    writeString(result, payload);
 
+    std::vector<uint8_t> result(responseSize(payload));
+    encodeResponse(result.data(), resp.id, resp.status, payload);
     return result;
 }
 
+void Protocol::encodeResponse(uint8_t* out, uint32_t id, StatusCode status, std::string_view payload,
+                              uint8_t flags) {
+    encodeHeader(out, static_cast<uint32_t>(responseSize(payload)), flags, id);
+    out[kStatusOffset] = static_cast<uint8_t>(status);
+    if (!payload.empty()) {
+        std::memcpy(out + kStatusOffset + 1, payload.data(), payload.size());
+    }
+}
+
 bool Protocol::deserializeResponse(const std::vector<uint8_t>& data, Response& resp) {
-    if (data.size() < 5) return false;
+    size_t used = decodeResponse(data.data(), data.size(), resp);
+    return used > 0 && used != kMalformed;
+}
 
-    size_t offset = 0;
-    resp.status = static_cast<StatusCode>(data[offset++]);
+size_t Protocol::decodeResponse(const uint8_t* data, size_t size, Response& resp) {
+    if (size < 4) return 0;
+
+    uint32_t length = frameLength(data);
+    if (length < kHeaderSize + 1) return kMalformed;
+    if (size < length) return 0;
+    if (data[4] != kVersion) return kMalformed;
 
-    std::string payload;
-    if (!readString(data, offset, payload)) return false;
+    resp.flags = data[5];
+    resp.id = readUint32(data + 6);
+    resp.status = static_cast<StatusCode>(data[kStatusOffset]);
+    const char* payload = reinterpret_cast<const char*>(data + kStatusOffset + 1);
+    size_t len = length - kStatusOffset - 1;
 
     if (resp.status == StatusCode::OK) {
-        resp.data = payload;
+        resp.data.assign(payload, len);
+        resp.error_msg.clear();
     } else {
-        resp.error_msg = payload;
+        resp.error_msg.assign(payload, len);
+        resp.data.clear();
+    }
+
+    return length;
+}
+
+void Protocol::encodeMultiGetItem(uint8_t* out, bool found, std::string_view value, bool compressed) {
+    out[0] = found ? (compressed ? 2 : 1) : 0;
+    writeUint32(out + 1, static_cast<uint32_t>(value.size()));
+    if (!value.empty()) {
+        std::memcpy(out + 5, value.data(), value.size());
+    }
+}
+
+bool Protocol::decodeMultiGet(std::string_view payload, std::vector<std::optional<std::string>>& values) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(payload.data());
+    size_t size = payload.size();
+    if (size < 4) return false;
+
+    uint32_t count = readUint32(data);
+    size_t offset = 4;
+
+    values.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        if (offset + 1 > size) return false;
+        uint8_t found = data[offset++];
+
+        std::string_view value;
+        if (!readStringView(data, size, offset, value)) return false;
+
+        if (found == 2) {
+            values.emplace_back(std::string());
+            if (!Compression::decompress(value, *values.back())) return false;
+        } else if (found) {
+            values.emplace_back(std::string(value));
+        } else {
+            values.emplace_back(std::nullopt);
+        }
+    }
+    return true;
+}
+
+void Protocol::encodeScanItem(uint8_t* out, std::string_view key, std::string_view value) {
+    writeUint32(out, static_cast<uint32_t>(key.size()));
+    std::memcpy(out + 4, key.data(), key.size());
+    out += 4 + key.size();
+    writeUint32(out, static_cast<uint32_t>(value.size()));
+    if (!value.empty()) {
+        std::memcpy(out + 4, value.data(), value.size());
+    }
+}
+
+bool Protocol::decodeScan(std::string_view payload, std::vector<std::pair<std::string, std::string>>& items,
+                          std::string& cursor) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(payload.data());
+    size_t size = payload.size();
+    if (size < 4) return false;
+
+    uint32_t count = readUint32(data);
+    size_t offset = 4;
+
+    items.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string_view key;
+        std::string_view value;
+        if (!readStringView(data, size, offset, key)) return false;
+        if (!readStringView(data, size, offset, value)) return false;
+        items.emplace_back(std::string(key), std::string(value));
     }
 
+    return readString(data, size, offset, cursor);
+}
+
+void Protocol::encodeRange(uint8_t* out, uint64_t total_size, std::string_view bytes) {
+    writeUint64(out, total_size);
+    if (!bytes.empty()) {
+        std::memcpy(out + 8, bytes.data(), bytes.size());
+    }
+}
+
+bool Protocol::decodeRange(std::string_view payload, uint64_t& total_size, std::string_view& bytes) {
+    if (payload.size() < 8) return false;
+    total_size = readUint64(reinterpret_cast<const uint8_t*>(payload.data()));
+    bytes = payload.substr(8);
+    return true;
+}
+
+void Protocol::encodeVersioned(uint8_t* out, uint32_t version, std::string_view value) {
+    writeUint32(out, version);
+    if (!value.empty()) {
+        std::memcpy(out + 4, value.data(), value.size());
+    }
+}
+
+bool Protocol::decodeVersioned(std::string_view payload, uint32_t& version, std::string_view& value) {
+    if (payload.size() < 4) return false;
+    version = readUint32(reinterpret_cast<const uint8_t*>(payload.data()));
+    value = payload.substr(4);
     return true;
 }
 
-} // namespace kvstore
\ No newline at end of file
+} // namespace kvstore
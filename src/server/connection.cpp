@@ -1,16 +1,40 @@
 #include "connection.h"
 #include "../storage/store.h"
 #include "../protocol/protocol.h"
+#include "metrics.h"
 #include <unistd.h>
 #include <sys/socket.h>
 #include <iostream>
+#include <new>
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace kvstore {
 
-Connection::Connection(int fd, std::shared_ptr<Store> store)
-    : fd_(fd), store_(store) {
+namespace {
+    // Decimal argument in [0, max]
+    bool parseNumber(std::string_view text, uint64_t max, uint64_t& value) {
+        if (text.empty()) return false;
+        value = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') return false;
+            uint64_t digit = static_cast<uint64_t>(c - '0');
+            if (digit > max || value > (max - digit) / 10) return false;
+            value = value * 10 + digit;
+        }
+        return true;
+    }
+}
+
+Connection::Connection(int fd, std::shared_ptr<Store> store, WorkerStats& stats, const Metrics& metrics,
+                       bool read_only)
+    : fd_(fd), store_(store), stats_(stats), metrics_(metrics), read_only_(read_only) {
 }
 
 Connection::~Connection() {
@@ -21,11 +45,20 @@ Connection::~Connection() {
 }
 
 bool Connection::tryReadMessageLength() {
-    if (expected_msg_len_ == 0 && read_buffer_.size() >= 4) {
-        // Protocol::readUint32 should read a big-endian or little-endian length depending on your protocol
-        expected_msg_len_ = Protocol::readUint32(read_buffer_, 0);
-        // sanity limit (adjust as needed)
-        if (expected_msg_len_ > 1024 * 1024) {
+    // The length and version come first in every frame; both are checked
+    // before waiting for the rest of it
+    if (expected_msg_len_ == 0 && read_buffer_.readable() >= 5) {
+        if (read_buffer_.readPtr()[4] != Protocol::kVersion) {
+            std::cerr << "Unsupported protocol version: " << static_cast<int>(read_buffer_.readPtr()[4]) << std::endl;
+            return false;
+        }
+        expected_msg_len_ = Protocol::frameLength(read_buffer_.readPtr());
+        if (expected_msg_len_ <= Protocol::kHeaderSize) {
+            std::cerr << "Empty message" << std::endl;
+            return false;
+        }
+        // Larger values go through PUTCHUNK and GETRANGE
+        if (expected_msg_len_ > Protocol::kMaxFrameSize) {
             std::cerr << "Message too large: " << expected_msg_len_ << std::endl;
             return false;
         }
@@ -33,32 +66,52 @@ bool Connection::tryReadMessageLength() {
     return true;
 }
 
-bool Connection::handleRead() {
-    char buffer[4096];
+bool Connection::processPendingRequests() {
+    if (!tryReadMessageLength()) {
+        return false;
+    }
 
-    while (true) {
-        ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+    // Process all complete messages in buffer. Their responses accumulate in
+    // write_buffer_ and go out together with one send() per event.
+    while (expected_msg_len_ > 0 && read_buffer_.readable() >= expected_msg_len_) {
+        if (write_buffer_.readable() >= kMaxPendingWrite) {
+            // The client pipelines faster than it reads; stop until it catches up
+            read_paused_ = true;
+            return true;
+        }
 
-        if (n > 0) {
-            read_buffer_.insert(read_buffer_.end(), buffer, buffer + n);
+        processRequest();
 
-            if (!tryReadMessageLength()) {
-                return false;
-            }
+        // remove processed message (the length covers the whole frame)
+        read_buffer_.consume(expected_msg_len_);
+        expected_msg_len_ = 0;
 
-            // Process all complete messages in buffer
-            while (expected_msg_len_ > 0 &&
-                   read_buffer_.size() >= static_cast<size_t>(4 + expected_msg_len_)) {
-                processRequest();
+        if (!tryReadMessageLength()) {
+            return false;
+        }
+    }
+
+    read_paused_ = false;
+    return true;
+}
+
+bool Connection::handleRead() {
+    // Finish whatever was left over from a paused read first
+    if (!processPendingRequests()) {
+        return false;
+    }
 
-                // remove processed message (4 bytes length + payload)
-                read_buffer_.erase(read_buffer_.begin(),
-                                   read_buffer_.begin() + 4 + expected_msg_len_);
-                expected_msg_len_ = 0;
+    while (!read_paused_) {
+        // Receive straight into the buffer's free tail
+        read_buffer_.ensureWritable(kReadChunk);
+        ssize_t n = recv(fd_, read_buffer_.writePtr(), read_buffer_.writable(), 0);
+
+        if (n > 0) {
+            read_buffer_.commit(static_cast<size_t>(n));
+            stats_.bytes_in.add(static_cast<uint64_t>(n));
 
-                if (!tryReadMessageLength()) {
-                    return false;
-                }
+            if (!processPendingRequests()) {
+                return false;
             }
         } else if (n == 0) {
             // peer closed connection
@@ -79,36 +132,115 @@ bool Connection::handleRead() {
     return true;
 }
 
+bool Connection::feed(const uint8_t* data, size_t n) {
+    read_buffer_.append(data, n);
+    stats_.bytes_in.add(static_cast<uint64_t>(n));
+    return processPendingRequests();
+}
+
+void Connection::reply(StatusCode status, std::string_view payload, uint8_t flags) {
+    // Encode straight into the write buffer; no intermediate Response
+    size_t size = Protocol::responseSize(payload);
+    write_buffer_.ensureWritable(size);
+    Protocol::encodeResponse(write_buffer_.writePtr(), request_id_, status, payload, flags);
+    write_buffer_.commit(size);
+}
+
+void Connection::replyTooLarge() {
+    reply(StatusCode::ERROR, "Value too large for one reply; read it with GETRANGE");
+}
+
+void Connection::replyLogFailed() {
+    reply(StatusCode::ERROR, "Write not logged: the WAL has failed");
+}
+
 void Connection::processRequest() {
-    Protocol::Request req;
-    if (!Protocol::deserializeRequest(read_buffer_, req)) {
-        Protocol::Response resp;
-        resp.status = StatusCode::ERROR;
-        resp.error_msg = "Invalid request format";
+    auto start = std::chrono::steady_clock::now();
+    size_t reply_at = write_buffer_.readable();
 
-        auto data = Protocol::serializeResponse(resp);
-        write_buffer_.insert(write_buffer_.end(), data.begin(), data.end());
-        return;
+    // Parse the frame in place at the front of the read buffer. The views
+    // in req stay valid until the frame is consumed after this returns.
+    // The id is echoed even when the rest of the frame does not parse
+    Protocol::RequestView req;
+    request_id_ = Protocol::readUint32(read_buffer_.readPtr() + 6);
+    if (Protocol::parseRequest(read_buffer_.readPtr(), expected_msg_len_, req)) {
+        try {
+            execute(req);
+        } catch (const std::bad_alloc&) {
+            // Failing one request beats taking the whole worker down. A
+            // write may already be logged, so its outcome is unknown.
+            write_buffer_.truncate(reply_at);
+            reply(StatusCode::ERROR, "Out of memory");
+        }
+
+        // A write the log lost must not be acknowledged, whatever it replied
+        if (Protocol::isWrite(req.type) && store_->logFailed()) {
+            write_buffer_.truncate(reply_at);
+            replyLogFailed();
+        }
+    } else {
+        req.type = static_cast<CommandType>(0);
+        reply(StatusCode::ERROR, "Invalid request format");
     }
 
-    Protocol::Response resp;
+    // Every request gets exactly one reply; its status byte follows the header
+    auto status = static_cast<StatusCode>(*write_buffer_.readableAt(reply_at + Protocol::kStatusOffset));
+    WorkerStats::Command& command = stats_.command(req.type);
+    command.calls.add();
+    if (status == StatusCode::ERROR) {
+        command.errors.add();
+    } else if (status == StatusCode::NOT_FOUND) {
+        command.misses.add();
+    }
+    if (req.type == CommandType::GET || req.type == CommandType::TTL || req.type == CommandType::GETV) {
+        (status == StatusCode::OK ? stats_.keyspace_hits : stats_.keyspace_misses).add();
+    }
+    command.service_ns.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count()));
+}
+
+void Connection::execute(const Protocol::RequestView& req) {
+    // A replica's data comes only from its primary
+    if (read_only_ && Protocol::isWrite(req.type)) {
+        reply(StatusCode::ERROR, "Read-only replica");
+        return;
+    }
+    if (Protocol::isWrite(req.type) && store_->logFailed()) {
+        replyLogFailed();
+        return;
+    }
 
     switch (req.type) {
         case CommandType::SET: {
             store_->set(req.key, req.value);
-            resp.status = StatusCode::OK;
-            resp.data = "OK";
+            reply(StatusCode::OK, "OK");
             break;
         }
 
         case CommandType::GET: {
-            auto value = store_->get(req.key);
-            if (value) {
-                resp.status = StatusCode::OK;
-                resp.data = *value;
+            // The value is copied once, from the store into the socket buffer.
+            // A client that takes compressed values gets them as stored.
+            bool found;
+            bool too_large = false;
+            if (req.flags & Protocol::kAcceptCompressed) {
+                found = store_->readStored(req.key, [&](std::string_view value, bool compressed) {
+                    too_large = value.size() > kMaxReplyValue;
+                    if (!too_large) {
+                        reply(StatusCode::OK, value, compressed ? Protocol::kCompressed : 0);
+                    }
+                });
             } else {
-                resp.status = StatusCode::NOT_FOUND;
-                resp.error_msg = "Key not found";
+                found = store_->read(req.key, [&](std::string_view value) {
+                    too_large = value.size() > kMaxReplyValue;
+                    if (!too_large) {
+                        reply(StatusCode::OK, value);
+                    }
+                });
+            }
+            if (!found) {
+                reply(StatusCode::NOT_FOUND, "Key not found");
+            } else if (too_large) {
+                replyTooLarge();
             }
             break;
         }
@@ -116,39 +248,545 @@ void Connection::processRequest() {
         case CommandType::DELETE: {
             bool removed = store_->remove(req.key);
             if (removed) {
-                resp.status = StatusCode::OK;
-                resp.data = "OK";
+                reply(StatusCode::OK, "OK");
             } else {
-                resp.status = StatusCode::NOT_FOUND;
-                resp.error_msg = "Key not found";
+                reply(StatusCode::NOT_FOUND, "Key not found");
             }
             break;
         }
 
         case CommandType::PING: {
-            resp.status = StatusCode::OK;
-            resp.data = "PONG";
+            reply(StatusCode::OK, "PONG");
+            break;
+        }
+
+        case CommandType::STATS: {
+            reply(StatusCode::OK, metrics_.render());
+            break;
+        }
+
+        case CommandType::SETEX: {
+            if (req.ttl_ms <= 0 || req.ttl_ms > Store::kMaxTtlMs) {
+                reply(StatusCode::ERROR, "Invalid TTL");
+                break;
+            }
+            store_->set(req.key, req.value, req.ttl_ms);
+            reply(StatusCode::OK, "OK");
+            break;
+        }
+
+        case CommandType::EXPIRE: {
+            if (req.ttl_ms > Store::kMaxTtlMs) {
+                reply(StatusCode::ERROR, "Invalid TTL");
+            } else if (store_->expire(req.key, req.ttl_ms)) {
+                reply(StatusCode::OK, "OK");
+            } else {
+                reply(StatusCode::NOT_FOUND, "Key not found");
+            }
+            break;
+        }
+
+        case CommandType::TTL: {
+            auto ttl = store_->ttl(req.key);
+            if (ttl) {
+                reply(StatusCode::OK, std::to_string(*ttl));
+            } else {
+                reply(StatusCode::NOT_FOUND, "Key not found");
+            }
+            break;
+        }
+
+        case CommandType::SCAN:
+        case CommandType::PREFIX: {
+            processScan(req);
+            break;
+        }
+
+        case CommandType::MSET:
+        case CommandType::MGET:
+        case CommandType::MDEL: {
+            processMultiKey(req);
+            break;
+        }
+
+        case CommandType::PUTBEGIN:
+        case CommandType::PUTCHUNK:
+        case CommandType::PUTEND: {
+            processUpload(req);
+            break;
+        }
+
+        case CommandType::GETRANGE: {
+            processGetRange(req);
+            break;
+        }
+
+        case CommandType::INCRBY: {
+            int64_t delta = 0;
+            const char* end = req.value.data() + req.value.size();
+            auto parsed = std::from_chars(req.value.data(), end, delta);
+            if (parsed.ec != std::errc() || parsed.ptr != end) {
+                reply(StatusCode::ERROR, "Invalid increment");
+                break;
+            }
+            auto result = store_->incrBy(req.key, delta);
+            if (result) {
+                reply(StatusCode::OK, std::to_string(*result));
+            } else {
+                reply(StatusCode::ERROR, "Value is not an integer or would overflow");
+            }
+            break;
+        }
+
+        case CommandType::APPEND: {
+            reply(StatusCode::OK, std::to_string(store_->append(req.key, req.value)));
+            break;
+        }
+
+        case CommandType::GETSET: {
+            auto previous = store_->getSet(req.key, req.value);
+            if (previous && previous->size() > kMaxReplyValue) {
+                // The new value is set all the same
+                replyTooLarge();
+            } else if (previous) {
+                reply(StatusCode::OK, *previous);
+            } else {
+                reply(StatusCode::NOT_FOUND, "Key not found");
+            }
+            break;
+        }
+
+        case CommandType::CAS: {
+            processCompareAndSwap(req);
+            break;
+        }
+
+        case CommandType::TXN: {
+            processTransaction(req);
+            break;
+        }
+
+        case CommandType::GETV: {
+            bool too_large = false;
+            bool found = store_->readVersioned(req.key, [&](std::string_view value, uint32_t version) {
+                too_large = value.size() > kMaxReplyValue;
+                if (too_large) return;
+                const size_t header_size = Protocol::responseSize(std::string_view());
+                size_t size = header_size + Protocol::versionedSize(value);
+                size_t start = write_buffer_.readable();
+                write_buffer_.ensureWritable(size);
+                Protocol::encodeResponse(write_buffer_.writePtr(), request_id_, StatusCode::OK, std::string_view());
+                Protocol::encodeVersioned(write_buffer_.writePtr() + header_size, version, value);
+                write_buffer_.commit(size);
+                Protocol::setFrameLength(write_buffer_.readableAt(start), size);
+            });
+            if (!found) {
+                reply(StatusCode::NOT_FOUND, "Key not found");
+            } else if (too_large) {
+                replyTooLarge();
+            }
             break;
         }
 
         default: {
-            resp.status = StatusCode::ERROR;
-            resp.error_msg = "Unknown command";
+            reply(StatusCode::ERROR, "Unknown command");
+            break;
+        }
+    }
+}
+
+void Connection::processMultiKey(const Protocol::RequestView& req) {
+    std::vector<std::string_view> args;
+    args.reserve(req.argc);
+    std::string_view rest = req.args;
+    std::string_view arg;
+    for (uint32_t i = 0; i < req.argc; ++i) {
+        if (!Protocol::nextArg(rest, arg)) {
+            reply(StatusCode::ERROR, "Invalid request format");
+            return;
+        }
+        args.push_back(arg);
+    }
+
+    if (args.empty()) {
+        reply(StatusCode::ERROR, "Wrong number of arguments");
+        return;
+    }
+
+    switch (req.type) {
+        case CommandType::MSET: {
+            if (args.size() % 2 != 0) {
+                reply(StatusCode::ERROR, "Wrong number of arguments");
+                return;
+            }
+            std::vector<std::pair<std::string_view, std::string_view>> items;
+            items.reserve(args.size() / 2);
+            for (size_t i = 0; i < args.size(); i += 2) {
+                items.emplace_back(args[i], args[i + 1]);
+            }
+            store_->setMany(items);
+            reply(StatusCode::OK, "OK");
+            break;
+        }
+
+        case CommandType::MGET: {
+            // Values go straight from the store into the write buffer behind a
+            // placeholder header; the frame length is patched in afterwards.
+            const size_t header_size = Protocol::responseSize(std::string_view());
+            size_t start = write_buffer_.readable();
+            write_buffer_.ensureWritable(header_size + 4);
+            Protocol::encodeResponse(write_buffer_.writePtr(), request_id_, StatusCode::OK, std::string_view());
+            Protocol::writeUint32(write_buffer_.writePtr() + header_size, static_cast<uint32_t>(args.size()));
+            write_buffer_.commit(header_size + 4);
+
+            // A reply that would outgrow one frame is dropped for an error,
+            // without buffering the rest of it
+            size_t reply_size = header_size + 4;
+            bool too_large = false;
+            auto encodeItem = [&](bool found, std::string_view value, bool compressed) {
+                (found ? stats_.keyspace_hits : stats_.keyspace_misses).add();
+                size_t size = Protocol::multiGetItemSize(value);
+                reply_size += size;
+                too_large = too_large || reply_size > Protocol::kMaxFrameSize;
+                if (too_large) return;
+                write_buffer_.ensureWritable(size);
+                Protocol::encodeMultiGetItem(write_buffer_.writePtr(), found, value, compressed);
+                write_buffer_.commit(size);
+            };
+            if (req.flags & Protocol::kAcceptCompressed) {
+                store_->readManyStored(args, [&](size_t, bool found, std::string_view value, bool compressed) {
+                    encodeItem(found, value, compressed);
+                });
+            } else {
+                store_->readMany(args, [&](size_t, bool found, std::string_view value) {
+                    encodeItem(found, value, false);
+                });
+            }
+
+            if (too_large) {
+                write_buffer_.truncate(start);
+                reply(StatusCode::ERROR, "Reply too large; ask for fewer keys or read values with GETRANGE");
+                break;
+            }
+
+            // ensureWritable() may have moved the data, so find the header by
+            // its offset from the read cursor rather than by pointer
+            Protocol::setFrameLength(write_buffer_.readableAt(start), write_buffer_.readable() - start);
+            break;
+        }
+
+        case CommandType::MDEL: {
+            size_t removed = store_->removeMany(args);
+            reply(StatusCode::OK, std::to_string(removed));
+            break;
+        }
+
+        default:
             break;
+    }
+}
+
+void Connection::processScan(const Protocol::RequestView& req) {
+    std::string_view rest = req.args;
+    std::string_view args[3];
+    uint32_t argc = std::min<uint32_t>(req.argc, 3);
+    for (uint32_t i = 0; i < argc; ++i) {
+        if (!Protocol::nextArg(rest, args[i])) {
+            reply(StatusCode::ERROR, "Invalid request format");
+            return;
+        }
+    }
+
+    // SCAN start end limit | PREFIX prefix limit [cursor]
+    bool is_scan = req.type == CommandType::SCAN;
+    if (is_scan ? req.argc != 3 : (req.argc < 2 || req.argc > 3)) {
+        reply(StatusCode::ERROR, "Wrong number of arguments");
+        return;
+    }
+    if (!store_->hasOrderedIndex()) {
+        reply(StatusCode::ERROR, "Ordered index is disabled");
+        return;
+    }
+
+    uint64_t limit = 0;
+    if (!parseNumber(is_scan ? args[2] : args[1], kMaxScanLimit, limit) || limit == 0) {
+        reply(StatusCode::ERROR, "Invalid limit");
+        return;
+    }
+
+    std::string_view start = args[0];
+    std::string end;
+    if (is_scan) {
+        end.assign(args[1].data(), args[1].size());
+    } else {
+        end = Store::prefixEnd(args[0]);
+        // The cursor from a previous page is always past the prefix itself
+        if (req.argc == 3 && args[2] > start) {
+            start = args[2];
+        }
+    }
+
+    // Same shape as MGET: items are encoded straight into the write buffer
+    // and the count and length are patched once the page is complete
+    const size_t header_size = Protocol::responseSize(std::string_view());
+    size_t begin = write_buffer_.readable();
+    write_buffer_.ensureWritable(header_size + 4);
+    Protocol::encodeResponse(write_buffer_.writePtr(), request_id_, StatusCode::OK, std::string_view());
+    write_buffer_.commit(header_size + 4);
+
+    // The page ends early rather than outgrow one frame. Each item leaves
+    // room for the cursor that would follow it: its key plus one byte.
+    uint32_t count = 0;
+    size_t reply_size = header_size + 4;
+    bool too_large = false;
+    std::string cursor = store_->scan(start, end, limit,
+        [&](std::string_view key, std::string_view value) {
+            size_t size = Protocol::scanItemSize(key, value);
+            if (reply_size + size + 4 + key.size() + 1 > Protocol::kMaxFrameSize) {
+                too_large = count == 0;
+                return false;
+            }
+            reply_size += size;
+            write_buffer_.ensureWritable(size);
+            Protocol::encodeScanItem(write_buffer_.writePtr(), key, value);
+            write_buffer_.commit(size);
+            ++count;
+            return true;
+        });
+
+    if (too_large) {
+        // Not even the first item fits; the caller can read that value with
+        // GETRANGE and carry on from the key after it
+        write_buffer_.truncate(begin);
+        reply(StatusCode::ERROR, "Value of key '" + cursor + "' too large for SCAN; read it with GETRANGE");
+        return;
+    }
+
+    write_buffer_.ensureWritable(4 + cursor.size());
+    Protocol::writeUint32(write_buffer_.writePtr(), static_cast<uint32_t>(cursor.size()));
+    std::memcpy(write_buffer_.writePtr() + 4, cursor.data(), cursor.size());
+    write_buffer_.commit(4 + cursor.size());
+
+    Protocol::setFrameLength(write_buffer_.readableAt(begin), write_buffer_.readable() - begin);
+    Protocol::writeUint32(write_buffer_.readableAt(begin + header_size), count);
+}
+
+void Connection::processUpload(const Protocol::RequestView& req) {
+    if (req.type == CommandType::PUTBEGIN) {
+        std::string_view rest = req.args;
+        std::string_view args[3];
+        if (req.argc < 2 || req.argc > 3) {
+            reply(StatusCode::ERROR, "Wrong number of arguments");
+            return;
+        }
+        for (uint32_t i = 0; i < req.argc; ++i) {
+            if (!Protocol::nextArg(rest, args[i])) {
+                reply(StatusCode::ERROR, "Invalid request format");
+                return;
+            }
+        }
+
+        uint64_t size = 0;
+        uint64_t ttl_ms = 0;
+        if (!parseNumber(args[1], kMaxUploadSize, size)) {
+            reply(StatusCode::ERROR, "Invalid size");
+            return;
+        }
+        if (req.argc == 3 && (!parseNumber(args[2], Store::kMaxTtlMs, ttl_ms) || ttl_ms == 0)) {
+            reply(StatusCode::ERROR, "Invalid TTL");
+            return;
         }
+        if (!upload_.open(store_->dataDirectory(), args[0], size, static_cast<int64_t>(ttl_ms))) {
+            reply(StatusCode::ERROR, "Cannot stage upload");
+            return;
+        }
+        reply(StatusCode::OK, "OK");
+        return;
     }
 
-    auto data = Protocol::serializeResponse(resp);
-    write_buffer_.insert(write_buffer_.end(), data.begin(), data.end());
+    // Chunks and the commit must name the key being uploaded, so a client
+    // that lost track of its upload cannot store the wrong value
+    if (!upload_.active() || upload_.key() != req.key) {
+        reply(StatusCode::ERROR, "No upload in progress for key");
+        return;
+    }
+
+    if (req.type == CommandType::PUTCHUNK) {
+        if (req.value.size() > Protocol::kMaxChunkSize || !upload_.append(req.value)) {
+            upload_.reset();
+            reply(StatusCode::ERROR, "Chunk rejected; upload aborted");
+            return;
+        }
+        reply(StatusCode::OK, "OK");
+        return;
+    }
+
+    std::string_view value;
+    if (!upload_.complete()) {
+        upload_.reset();
+        reply(StatusCode::ERROR, "Upload incomplete; aborted");
+        return;
+    }
+    if (!upload_.map(value)) {
+        upload_.reset();
+        reply(StatusCode::ERROR, "Cannot read upload");
+        return;
+    }
+
+    // The store copies straight out of the staged file's pages
+    if (upload_.ttl() > 0) {
+        store_->set(req.key, value, upload_.ttl());
+    } else {
+        store_->set(req.key, value);
+    }
+    upload_.reset();
+    reply(StatusCode::OK, "OK");
+}
+
+void Connection::processGetRange(const Protocol::RequestView& req) {
+    std::string_view rest = req.args;
+    std::string_view args[3];
+    if (req.argc != 3) {
+        reply(StatusCode::ERROR, "Wrong number of arguments");
+        return;
+    }
+    for (std::string_view& arg : args) {
+        if (!Protocol::nextArg(rest, arg)) {
+            reply(StatusCode::ERROR, "Invalid request format");
+            return;
+        }
+    }
+
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    if (!parseNumber(args[1], UINT64_MAX, offset) ||
+        !parseNumber(args[2], Protocol::kMaxChunkSize, length)) {
+        reply(StatusCode::ERROR, "Invalid range");
+        return;
+    }
+
+    // At most one chunk is copied out of the store, so the reply stays
+    // small however large the value is
+    bool found = store_->read(args[0], [&](std::string_view value) {
+        std::string_view bytes;
+        if (offset < value.size()) {
+            bytes = value.substr(offset, length);
+        }
+
+        const size_t header_size = Protocol::responseSize(std::string_view());
+        size_t size = header_size + Protocol::rangeSize(bytes);
+        size_t start = write_buffer_.readable();
+        write_buffer_.ensureWritable(size);
+        Protocol::encodeResponse(write_buffer_.writePtr(), request_id_, StatusCode::OK, std::string_view());
+        Protocol::encodeRange(write_buffer_.writePtr() + header_size, value.size(), bytes);
+        write_buffer_.commit(size);
+        Protocol::setFrameLength(write_buffer_.readableAt(start), size);
+    });
+    (found ? stats_.keyspace_hits : stats_.keyspace_misses).add();
+    if (!found) {
+        reply(StatusCode::NOT_FOUND, "Key not found");
+    }
+}
+
+void Connection::processCompareAndSwap(const Protocol::RequestView& req) {
+    std::string_view rest = req.args;
+    std::string_view args[3];
+    if (req.argc != 3) {
+        reply(StatusCode::ERROR, "Wrong number of arguments");
+        return;
+    }
+    for (std::string_view& arg : args) {
+        if (!Protocol::nextArg(rest, arg)) {
+            reply(StatusCode::ERROR, "Invalid request format");
+            return;
+        }
+    }
+
+    uint64_t expected = 0;
+    if (!parseNumber(args[1], UINT32_MAX, expected)) {
+        reply(StatusCode::ERROR, "Invalid version");
+        return;
+    }
+
+    uint32_t version = 0;
+    if (store_->compareAndSwap(args[0], static_cast<uint32_t>(expected), args[2], version)) {
+        reply(StatusCode::OK, std::to_string(version));
+    } else {
+        reply(StatusCode::CONFLICT, std::to_string(version));
+    }
+}
+
+void Connection::processTransaction(const Protocol::RequestView& req) {
+    // Everything is parsed before anything is applied, so a bad op fails
+    // the whole transaction
+    std::vector<Store::WriteOp> ops;
+    std::string_view rest = req.args;
+    std::string_view word;
+    uint32_t remaining = req.argc;
+    while (remaining > 0) {
+        if (!Protocol::nextArg(rest, word)) {
+            reply(StatusCode::ERROR, "Invalid request format");
+            return;
+        }
+        --remaining;
+
+        size_t arity;
+        if (word == "SET") {
+            arity = 2;
+        } else if (word == "SETEX") {
+            arity = 3;
+        } else if (word == "DEL") {
+            arity = 1;
+        } else {
+            reply(StatusCode::ERROR, "Unknown transaction op");
+            return;
+        }
+        if (remaining < arity) {
+            reply(StatusCode::ERROR, "Wrong number of arguments");
+            return;
+        }
+
+        std::string_view args[3];
+        for (size_t i = 0; i < arity; ++i) {
+            if (!Protocol::nextArg(rest, args[i])) {
+                reply(StatusCode::ERROR, "Invalid request format");
+                return;
+            }
+        }
+        remaining -= static_cast<uint32_t>(arity);
+
+        Store::WriteOp op;
+        op.key = args[0];
+        if (word == "DEL") {
+            op.remove = true;
+        } else {
+            op.value = args[1];
+        }
+        if (word == "SETEX") {
+            uint64_t ttl_ms = 0;
+            if (!parseNumber(args[2], Store::kMaxTtlMs, ttl_ms) || ttl_ms == 0) {
+                reply(StatusCode::ERROR, "Invalid TTL");
+                return;
+            }
+            op.ttl_ms = static_cast<int64_t>(ttl_ms);
+        }
+        ops.push_back(op);
+    }
+
+    if (ops.empty()) {
+        reply(StatusCode::ERROR, "Wrong number of arguments");
+        return;
+    }
+    reply(StatusCode::OK, std::to_string(store_->transact(ops)));
 }
 
 bool Connection::handleWrite() {
     while (!write_buffer_.empty()) {
-        ssize_t n = send(fd_, reinterpret_cast<const char*>(write_buffer_.data()),
-                         write_buffer_.size(), 0);
+        ssize_t n = send(fd_, write_buffer_.readPtr(), write_buffer_.readable(), 0);
 
         if (n > 0) {
-            write_buffer_.erase(write_buffer_.begin(), write_buffer_.begin() + n);
+            write_buffer_.consume(static_cast<size_t>(n));
+            stats_.bytes_out.add(static_cast<uint64_t>(n));
         } else if (n < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // socket not ready for write, try later
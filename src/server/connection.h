@@ -3,14 +3,23 @@
 #include <vector>
 #include <cstdint>
 #include <memory>
+#include <string_view>
+#include "io_buffer.h"
+#include "staged_value.h"
+#include "../protocol/protocol.h"
 
 namespace kvstore {
 
     class Store;
+    class Metrics;
+    struct WorkerStats;
 
     class Connection {
     public:
-        explicit Connection(int fd, std::shared_ptr<Store> store);
+        // stats belongs to the event loop that owns this connection. A
+        // read_only connection (on a replica) refuses every write command.
+        Connection(int fd, std::shared_ptr<Store> store, WorkerStats& stats, const Metrics& metrics,
+                   bool read_only = false);
         ~Connection();
 
         // non-copyable
@@ -23,15 +32,63 @@ namespace kvstore {
         bool handleWrite();
         bool hasDataToWrite() const { return !write_buffer_.empty(); }
 
+        // Reading is paused while too many pipelined responses are waiting to
+        // be sent; the caller resumes with handleRead() once they drain.
+        bool readPaused() const { return read_paused_; }
+        bool canResumeRead() const { return read_paused_ && write_buffer_.readable() < kMaxPendingWrite; }
+
+        // Completion-based I/O, for event loops that issue the socket calls
+        // themselves (io_uring). feed() takes received bytes and runs the
+        // complete requests among them, resumeRead() picks up requests left
+        // buffered by a pause, and takeOutput() moves all pending responses
+        // into out (which must be empty) for the caller to send.
+        bool feed(const uint8_t* data, size_t n);
+        bool resumeRead() { return processPendingRequests(); }
+        void takeOutput(IOBuffer& out) { out.swap(write_buffer_); }
+
     private:
+        static constexpr size_t kMaxPendingWrite = 4 * 1024 * 1024;
+        static constexpr size_t kReadChunk = 16 * 1024;
+
+        // Largest page a SCAN or PREFIX may ask for. The whole store is
+        // read-locked while a page is collected.
+        static constexpr size_t kMaxScanLimit = 10000;
+
+        // Largest value PUTBEGIN accepts; the store keeps sizes in 32 bits
+        static constexpr uint64_t kMaxUploadSize = uint64_t(1) << 31;
+
+        // Largest value a GET, GETV or GETSET reply carries whole, so that
+        // the reply fits in one frame. Bigger values, which only uploads can
+        // build, are read with GETRANGE. MGET and SCAN replies are bounded
+        // by the frame size as a whole.
+        static constexpr size_t kMaxReplyValue =
+            Protocol::kMaxFrameSize - Protocol::kHeaderSize - 1 - 4;
+
         int fd_;
         std::shared_ptr<Store> store_;
+        WorkerStats& stats_;
+        const Metrics& metrics_;
+        bool read_only_;
 
-        std::vector<uint8_t> read_buffer_;
-        std::vector<uint8_t> write_buffer_;
-        uint32_t expected_msg_len_ = 0;
+        IOBuffer read_buffer_;
+        IOBuffer write_buffer_;
+        uint32_t expected_msg_len_ = 0;   // whole frame, header included
+        uint32_t request_id_ = 0;         // echoed in the reply being built
+        bool read_paused_ = false;
+        StagedValue upload_;              // PUTBEGIN..PUTEND in progress
 
         void processRequest();
+        void execute(const Protocol::RequestView& req);
+        void reply(StatusCode status, std::string_view payload, uint8_t flags = 0);
+        void replyTooLarge();
+        void replyLogFailed();
+        void processMultiKey(const Protocol::RequestView& req);
+        void processScan(const Protocol::RequestView& req);
+        void processUpload(const Protocol::RequestView& req);
+        void processGetRange(const Protocol::RequestView& req);
+        void processCompareAndSwap(const Protocol::RequestView& req);
+        void processTransaction(const Protocol::RequestView& req);
+        bool processPendingRequests();
         bool tryReadMessageLength();
     };
 
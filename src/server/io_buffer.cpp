@@ -0,0 +1,57 @@
+#include "io_buffer.h"
+#include <algorithm>
+#include <cstring>
+
+namespace kvstore {
+
+void IOBuffer::consume(size_t n) {
+    read_ += std::min(n, readable());
+
+    if (read_ == write_) {
+        read_ = 0;
+        write_ = 0;
+        if (capacity_ > kShrinkThreshold) {
+            data_.reset();
+            capacity_ = 0;
+        }
+    }
+}
+
+void IOBuffer::ensureWritable(size_t n) {
+    if (writable() >= n) {
+        return;
+    }
+
+    size_t unread = readable();
+
+    // Compact in place when that frees enough room and costs no more than
+    // what has already been consumed.
+    if (capacity_ - unread >= n && read_ >= unread) {
+        std::memmove(data_.get(), data_.get() + read_, unread);
+        read_ = 0;
+        write_ = unread;
+        return;
+    }
+
+    size_t new_capacity = std::max(kInitialCapacity, capacity_ * 2);
+    while (new_capacity - unread < n) {
+        new_capacity *= 2;
+    }
+
+    std::unique_ptr<uint8_t[]> grown(new uint8_t[new_capacity]);
+    if (unread > 0) {
+        std::memcpy(grown.get(), data_.get() + read_, unread);
+    }
+    data_ = std::move(grown);
+    capacity_ = new_capacity;
+    read_ = 0;
+    write_ = unread;
+}
+
+void IOBuffer::append(const void* data, size_t n) {
+    ensureWritable(n);
+    std::memcpy(writePtr(), data, n);
+    commit(n);
+}
+
+} // namespace kvstore
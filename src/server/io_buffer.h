@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace kvstore {
+
+    // Byte buffer with separate read and write cursors, used for connection
+    // I/O. Consuming from the front only advances the read cursor. Unread
+    // bytes are moved back to the start lazily, and only when at least as many
+    // bytes have been consumed as remain, so every byte is copied O(1) times
+    // and a burst of pipelined messages is processed in linear time. Unread
+    // data is always contiguous, which lets frames be parsed in place.
+    class IOBuffer {
+    public:
+        IOBuffer() = default;
+
+        IOBuffer(const IOBuffer&) = delete;
+        IOBuffer& operator=(const IOBuffer&) = delete;
+
+        const uint8_t* readPtr() const { return data_.get() + read_; }
+
+        // Writable view of an unread byte, for back-patching a length that
+        // is only known after the data following it has been appended
+        uint8_t* readableAt(size_t offset) { return data_.get() + read_ + offset; }
+        size_t readable() const { return write_ - read_; }
+        bool empty() const { return read_ == write_; }
+
+        // Drop n bytes from the front
+        void consume(size_t n);
+
+        // Make room for at least n more bytes after writePtr()
+        void ensureWritable(size_t n);
+        uint8_t* writePtr() { return data_.get() + write_; }
+        size_t writable() const { return capacity_ - write_; }
+
+        // Mark n bytes written at writePtr() as readable
+        void commit(size_t n) { write_ += n; }
+
+        // Drop everything after the first n unread bytes, e.g. a reply
+        // abandoned half way through
+        void truncate(size_t n) { write_ = read_ + n; }
+
+        void append(const void* data, size_t n);
+
+        size_t capacity() const { return capacity_; }
+
+        // Exchange contents, e.g. to hand pending output to an asynchronous
+        // send whose memory must stay put until it completes
+        void swap(IOBuffer& other) noexcept {
+            data_.swap(other.data_);
+            std::swap(capacity_, other.capacity_);
+            std::swap(read_, other.read_);
+            std::swap(write_, other.write_);
+        }
+
+    private:
+        static constexpr size_t kInitialCapacity = 16 * 1024;
+
+        // An empty buffer bigger than this is released, so one large burst
+        // does not pin memory for the rest of the connection's life.
+        static constexpr size_t kShrinkThreshold = 1024 * 1024;
+
+        std::unique_ptr<uint8_t[]> data_;
+        size_t capacity_ = 0;
+        size_t read_ = 0;
+        size_t write_ = 0;
+    };
+
+} // namespace kvstore
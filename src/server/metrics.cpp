@@ -0,0 +1,191 @@
+#include "metrics.h"
+#include "replication.h"
+#include "../storage/store.h"
+#include <sstream>
+
+namespace kvstore {
+
+namespace {
+    const char* commandName(size_t type) {
+        switch (static_cast<CommandType>(type)) {
+            case CommandType::SET: return "set";
+            case CommandType::GET: return "get";
+            case CommandType::DELETE: return "delete";
+            case CommandType::PING: return "ping";
+            case CommandType::MSET: return "mset";
+            case CommandType::MGET: return "mget";
+            case CommandType::MDEL: return "mdel";
+            case CommandType::SETEX: return "setex";
+            case CommandType::EXPIRE: return "expire";
+            case CommandType::TTL: return "ttl";
+            case CommandType::SCAN: return "scan";
+            case CommandType::PREFIX: return "prefix";
+            case CommandType::STATS: return "stats";
+            case CommandType::PUTBEGIN: return "putbegin";
+            case CommandType::PUTCHUNK: return "putchunk";
+            case CommandType::PUTEND: return "putend";
+            case CommandType::GETRANGE: return "getrange";
+            case CommandType::INCRBY: return "incrby";
+            case CommandType::APPEND: return "append";
+            case CommandType::GETSET: return "getset";
+            case CommandType::CAS: return "cas";
+            case CommandType::GETV: return "getv";
+            case CommandType::TXN: return "txn";
+            case CommandType::SYNC: return "sync";
+            case CommandType::REPLACK: return "replack";
+        }
+        return "unknown";
+    }
+
+    constexpr double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    class Writer {
+    public:
+        void type(const char* name, const char* kind) {
+            out_ << "# TYPE " << name << ' ' << kind << '\n';
+        }
+
+        // Counters are printed as integers, durations as doubles
+        template <typename T>
+        void sample(const std::string& name, const std::string& labels, T value) {
+            out_ << name;
+            if (!labels.empty()) out_ << '{' << labels << '}';
+            out_ << ' ' << value << '\n';
+        }
+
+        template <typename T>
+        void sample(const std::string& name, T value) {
+            sample(name, std::string(), value);
+        }
+
+        // A latency summary in seconds: quantiles, _sum and _count
+        void summary(const std::string& name, const std::string& labels, const Histogram::Summary& h) {
+            std::string sep = labels.empty() ? "" : ",";
+            for (double q : kQuantiles) {
+                std::ostringstream label;
+                label << labels << sep << "quantile=\"" << q << '"';
+                sample(name, label.str(), static_cast<double>(h.percentile(q)) / 1e9);
+            }
+            sample(name + "_sum", labels, static_cast<double>(h.sum) / 1e9);
+            sample(name + "_count", labels, h.count);
+        }
+
+        std::string str() const { return out_.str(); }
+
+    private:
+        std::ostringstream out_;
+    };
+}
+
+Metrics::Metrics(std::shared_ptr<Store> store) : store_(std::move(store)) {
+}
+
+WorkerStats& Metrics::addWorker() {
+    workers_.push_back(std::make_unique<WorkerStats>());
+    return *workers_.back();
+}
+
+std::string Metrics::render() const {
+    // Sum the workers first; each counter is read once
+    struct Totals {
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        uint64_t misses = 0;
+        Histogram::Summary service;
+    };
+    std::vector<Totals> commands(WorkerStats::kCommandSlots);
+    uint64_t hits = 0, key_misses = 0, opened = 0, closed = 0, bytes_in = 0, bytes_out = 0;
+
+    for (const auto& worker : workers_) {
+        for (size_t i = 0; i < WorkerStats::kCommandSlots; ++i) {
+            // Types this build does not know all report as "unknown"
+            Totals& totals = commands[std::string(commandName(i)) == "unknown" ? 0 : i];
+            const WorkerStats::Command& command = worker->commands[i];
+            totals.calls += command.calls.get();
+            totals.errors += command.errors.get();
+            totals.misses += command.misses.get();
+            command.service_ns.mergeInto(totals.service);
+        }
+        hits += worker->keyspace_hits.get();
+        key_misses += worker->keyspace_misses.get();
+        opened += worker->connections_opened.get();
+        closed += worker->connections_closed.get();
+        bytes_in += worker->bytes_in.get();
+        bytes_out += worker->bytes_out.get();
+    }
+
+    Writer out;
+    auto perCommand = [&](const char* name, const char* kind, uint64_t Totals::*field) {
+        out.type(name, kind);
+        for (size_t i = 0; i < commands.size(); ++i) {
+            if (commands[i].calls == 0) continue;
+            out.sample(name, std::string("cmd=\"") + commandName(i) + '"', commands[i].*field);
+        }
+    };
+    perCommand("kvstore_commands_total", "counter", &Totals::calls);
+    perCommand("kvstore_command_errors_total", "counter", &Totals::errors);
+    perCommand("kvstore_command_misses_total", "counter", &Totals::misses);
+
+    out.type("kvstore_command_duration_seconds", "summary");
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (commands[i].calls == 0) continue;
+        out.summary("kvstore_command_duration_seconds",
+                    std::string("cmd=\"") + commandName(i) + '"', commands[i].service);
+    }
+
+    out.type("kvstore_keyspace_hits_total", "counter");
+    out.sample("kvstore_keyspace_hits_total", hits);
+    out.type("kvstore_keyspace_misses_total", "counter");
+    out.sample("kvstore_keyspace_misses_total", key_misses);
+    out.type("kvstore_connections_active", "gauge");
+    out.sample("kvstore_connections_active", opened - closed);
+    out.type("kvstore_connections_total", "counter");
+    out.sample("kvstore_connections_total", opened);
+    out.type("kvstore_net_input_bytes_total", "counter");
+    out.sample("kvstore_net_input_bytes_total", bytes_in);
+    out.type("kvstore_net_output_bytes_total", "counter");
+    out.sample("kvstore_net_output_bytes_total", bytes_out);
+
+    if (const WAL::Stats* wal = store_->walStats()) {
+        out.type("kvstore_wal_batches_total", "counter");
+        out.sample("kvstore_wal_batches_total", wal->batches.get());
+        out.type("kvstore_wal_bytes_total", "counter");
+        out.sample("kvstore_wal_bytes_total", wal->bytes.get());
+        out.type("kvstore_wal_fsyncs_total", "counter");
+        out.sample("kvstore_wal_fsyncs_total", wal->fsyncs.get());
+
+        Histogram::Summary write, fsync;
+        wal->write_ns.mergeInto(write);
+        wal->fsync_ns.mergeInto(fsync);
+        out.type("kvstore_wal_write_duration_seconds", "summary");
+        out.summary("kvstore_wal_write_duration_seconds", "", write);
+        out.type("kvstore_wal_fsync_duration_seconds", "summary");
+        out.summary("kvstore_wal_fsync_duration_seconds", "", fsync);
+    }
+
+    Store::MemoryStats memory = store_->memoryStats();
+    out.type("kvstore_keys", "gauge");
+    out.sample("kvstore_keys", store_->size());
+    out.type("kvstore_memory_used_bytes", "gauge");
+    out.sample("kvstore_memory_used_bytes", store_->usedMemory());
+    out.type("kvstore_value_bytes", "gauge");
+    out.sample("kvstore_value_bytes", memory.value_bytes);
+    out.type("kvstore_slab_touched_bytes", "gauge");
+    out.sample("kvstore_slab_touched_bytes", memory.slab.touched);
+    out.type("kvstore_slab_mapped_bytes", "gauge");
+    out.sample("kvstore_slab_mapped_bytes", memory.slab.reserved);
+    out.type("kvstore_evicted_keys_total", "counter");
+    out.sample("kvstore_evicted_keys_total", store_->evictedKeys());
+
+    if (replication_) {
+        ReplicationSource::Status status = replication_->status();
+        out.type("kvstore_connected_replicas", "gauge");
+        out.sample("kvstore_connected_replicas", status.replicas);
+        out.type("kvstore_replication_lag_bytes", "gauge");
+        out.sample("kvstore_replication_lag_bytes", status.max_lag_bytes);
+    }
+
+    return out.str();
+}
+
+} // namespace kvstore
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../storage/stats.h"
+#include "../protocol/protocol.h"
+
+namespace kvstore {
+
+    class Store;
+    class ReplicationSource;
+
+    // Counters of one event loop. Only that loop's thread records into them,
+    // so the hot path never shares a cache line with another thread; STATS
+    // and the metrics port sum them across workers when asked.
+    struct WorkerStats {
+        // Indexed by CommandType; slot 0 collects unparseable requests
+        static constexpr size_t kCommandSlots = 32;
+
+        struct Command {
+            Counter calls;
+            Counter errors;        // ERROR replies
+            Counter misses;        // NOT_FOUND replies
+            Histogram service_ns;  // from parsing the request to encoding the reply
+        };
+
+        Command& command(CommandType type) {
+            size_t index = static_cast<size_t>(type);
+            return commands[index < kCommandSlots ? index : 0];
+        }
+
+        std::array<Command, kCommandSlots> commands;
+
+        // Key lookups by GET, MGET and TTL
+        Counter keyspace_hits;
+        Counter keyspace_misses;
+
+        Counter connections_opened;
+        Counter connections_closed;
+        Counter bytes_in;
+        Counter bytes_out;
+    };
+
+    // Every worker's stats plus the store's own figures, rendered on demand
+    class Metrics {
+    public:
+        explicit Metrics(std::shared_ptr<Store> store);
+
+        // Called before the workers start. The stats live as long as this.
+        WorkerStats& addWorker();
+
+        // Adds the primary's replica figures; source must outlive rendering
+        void setReplicationSource(const ReplicationSource* source) { replication_ = source; }
+
+        // Everything in the Prometheus text exposition format
+        std::string render() const;
+
+    private:
+        std::shared_ptr<Store> store_;
+        std::vector<std::unique_ptr<WorkerStats>> workers_;
+        const ReplicationSource* replication_ = nullptr;
+    };
+
+} // namespace kvstore
@@ -0,0 +1,420 @@
+#include "replication.h"
+#include "../storage/store.h"
+#include "../protocol/protocol.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <new>
+#include <thread>
+
+namespace kvstore {
+
+namespace {
+    // Blocking socket calls time out this often, so that the replication
+    // threads notice stop()
+    constexpr int kPollMs = 500;
+
+    void setTimeouts(int fd) {
+        timeval timeout{0, kPollMs * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+
+    bool sendAll(int fd, const uint8_t* data, size_t size, int flags, const std::atomic<bool>& running) {
+        while (size > 0) {
+            ssize_t n = send(fd, data, size, flags | MSG_NOSIGNAL);
+            if (n < 0) {
+                if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && running) continue;
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool recvAll(int fd, uint8_t* data, size_t size, const std::atomic<bool>& running) {
+        while (size > 0) {
+            ssize_t n = recv(fd, data, size, 0);
+            if (n == 0) return false;
+            if (n < 0) {
+                if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && running) continue;
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Reads one whole frame. Fails if the connection closes or breaks, and
+    // on a frame of another protocol version or larger than max_size.
+    bool recvFrame(int fd, std::vector<uint8_t>& frame, size_t max_size, const std::atomic<bool>& running) {
+        frame.resize(Protocol::kHeaderSize);
+        if (!recvAll(fd, frame.data(), Protocol::kHeaderSize, running)) return false;
+
+        uint32_t length = Protocol::frameLength(frame.data());
+        if (frame[4] != Protocol::kVersion || length <= Protocol::kHeaderSize || length > max_size) {
+            std::cerr << "Replication: invalid frame of " << length << " bytes" << std::endl;
+            return false;
+        }
+        frame.resize(length);
+        return recvAll(fd, frame.data() + Protocol::kHeaderSize, length - Protocol::kHeaderSize, running);
+    }
+
+    bool sendRequest(int fd, const Protocol::Request& req, const std::atomic<bool>& running) {
+        std::vector<uint8_t> data = Protocol::serializeRequest(req);
+        return sendAll(fd, data.data(), data.size(), 0, running);
+    }
+
+    // True if fd has something to read (or has been closed) right now
+    bool readable(int fd) {
+        pollfd pfd{fd, POLLIN, 0};
+        return poll(&pfd, 1, 0) > 0;
+    }
+}
+
+ReplicationSource::ReplicationSource(std::shared_ptr<Store> store) : store_(std::move(store)) {
+}
+
+void ReplicationSource::run(int listen_fd, const std::atomic<bool>& running) {
+    // Each replica's thread raises its flag on the way out and is joined on
+    // the loop's next round, so a replica that keeps reconnecting does not
+    // pile up finished threads
+    struct Served {
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+    std::list<Served> served;
+
+    while (running) {
+        for (auto it = served.begin(); it != served.end();) {
+            if (it->done) {
+                it->thread.join();
+                it = served.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        pollfd pfd{listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, kPollMs) <= 0) {
+            continue;
+        }
+
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        Served& entry = served.emplace_back();
+        entry.thread = std::thread([this, fd, &running, &entry] {
+            serve(fd, running);
+            entry.done = true;
+        });
+    }
+
+    for (auto& entry : served) {
+        entry.thread.join();
+    }
+}
+
+void ReplicationSource::serve(int fd, const std::atomic<bool>& running) {
+    setTimeouts(fd);
+
+    std::vector<uint8_t> frame;
+    Protocol::RequestView req;
+    if (!recvFrame(fd, frame, Protocol::kMaxFrameSize, running) ||
+        !Protocol::parseRequest(frame.data(), frame.size(), req) || req.type != CommandType::SYNC) {
+        std::cerr << "Replication: expected SYNC on fd=" << fd << std::endl;
+        close(fd);
+        return;
+    }
+
+    // Subscribed before the dump starts, so every write the dump misses is
+    // in the backlog
+    auto replica = std::make_shared<Replica>();
+    replica->fd = fd;
+    replica->id = req.id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        replicas_.push_back(replica);
+    }
+    std::cout << "Replica connected: fd=" << fd << std::endl;
+
+    stream(*replica, running);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        replicas_.erase(std::find(replicas_.begin(), replicas_.end(), replica));
+    }
+    close(fd);
+    std::cout << "Replica disconnected: fd=" << fd << std::endl;
+}
+
+void ReplicationSource::stream(Replica& replica, const std::atomic<bool>& running) {
+    std::vector<uint8_t> records;
+    bool ok = true;
+    store_->dump([&](const WAL::Entry& entry) {
+        if (!ok) return;
+        WAL::encodeRecord(records, entry.op, entry.key, entry.value);
+        if (records.size() >= kDumpFrameSize) {
+            ok = sendFrame(replica, records.data(), records.size(), 0, running);
+            records.clear();
+        }
+    });
+    if (!ok || !sendFrame(replica, records.data(), records.size(), Protocol::kSyncComplete, running)) {
+        return;
+    }
+    std::cout << "Replica fd=" << replica.fd << " synced; streaming the WAL" << std::endl;
+
+    while (running) {
+        records.clear();
+        {
+            std::unique_lock<std::mutex> lock(replica.mutex);
+            replica.cv.wait_for(lock, std::chrono::milliseconds(kPollMs),
+                                [&replica] {
+                                    return !replica.backlog.empty() || replica.overflowed || replica.dropped;
+                                });
+            if (replica.overflowed) {
+                std::cerr << "Replica fd=" << replica.fd << " fell too far behind; dropping it" << std::endl;
+                return;
+            }
+            if (replica.dropped) {
+                std::cerr << "Store replaced by a full sync; dropping replica fd=" << replica.fd << std::endl;
+                return;
+            }
+            records.swap(replica.backlog);
+        }
+
+        if (!records.empty() && !sendFrame(replica, records.data(), records.size(), 0, running)) {
+            return;
+        }
+        if (!readAcks(replica, running)) {
+            return;
+        }
+    }
+}
+
+bool ReplicationSource::sendFrame(Replica& replica, const uint8_t* payload, size_t size, uint8_t flags,
+                                  const std::atomic<bool>& running) {
+    // The header and status go first, so the payload is sent from where it is
+    uint8_t head[Protocol::kHeaderSize + 1];
+    Protocol::encodeHeader(head, static_cast<uint32_t>(sizeof(head) + size), flags, replica.id);
+    head[Protocol::kStatusOffset] = static_cast<uint8_t>(StatusCode::OK);
+    if (!sendAll(replica.fd, head, sizeof(head), size > 0 ? MSG_MORE : 0, running) ||
+        !sendAll(replica.fd, payload, size, 0, running)) {
+        return false;
+    }
+    replica.sent.fetch_add(size, std::memory_order_relaxed);
+    return true;
+}
+
+bool ReplicationSource::readAcks(Replica& replica, const std::atomic<bool>& running) {
+    std::vector<uint8_t> frame;
+    Protocol::RequestView req;
+    while (readable(replica.fd)) {
+        if (!recvFrame(replica.fd, frame, Protocol::kMaxFrameSize, running) ||
+            !Protocol::parseRequest(frame.data(), frame.size(), req) || req.type != CommandType::REPLACK) {
+            return false;
+        }
+
+        std::string_view rest = req.args;
+        std::string_view text;
+        uint64_t offset = 0;
+        if (req.argc != 1 || !Protocol::nextArg(rest, text) ||
+            std::from_chars(text.data(), text.data() + text.size(), offset).ec != std::errc()) {
+            std::cerr << "Replication: malformed REPLACK from fd=" << replica.fd << std::endl;
+            return false;
+        }
+        replica.acked.store(offset, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void ReplicationSource::publish(const uint8_t* records, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& replica : replicas_) {
+        std::lock_guard<std::mutex> replica_lock(replica->mutex);
+        if (replica->overflowed) continue;
+
+        // A single batch larger than the limit still goes through on its own
+        if (!replica->backlog.empty() && replica->backlog.size() + size > kMaxBacklog) {
+            replica->overflowed = true;
+            std::vector<uint8_t>().swap(replica->backlog);
+        } else {
+            replica->backlog.insert(replica->backlog.end(), records, records + size);
+        }
+        replica->cv.notify_one();
+    }
+}
+
+void ReplicationSource::dropReplicas() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& replica : replicas_) {
+        std::lock_guard<std::mutex> replica_lock(replica->mutex);
+        replica->dropped = true;
+        replica->cv.notify_one();
+    }
+}
+
+ReplicationSource::Status ReplicationSource::status() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Status status;
+    status.replicas = replicas_.size();
+    for (const auto& replica : replicas_) {
+        uint64_t sent = replica->sent.load(std::memory_order_relaxed);
+        uint64_t acked = replica->acked.load(std::memory_order_relaxed);
+        status.max_lag_bytes = std::max(status.max_lag_bytes, sent > acked ? sent - acked : 0);
+    }
+    return status;
+}
+
+ReplicationClient::ReplicationClient(std::shared_ptr<Store> store, std::string host, int port,
+                                     std::shared_ptr<ReplicationSource> downstream)
+    : store_(std::move(store)), host_(std::move(host)), port_(port), downstream_(std::move(downstream)) {
+}
+
+void ReplicationClient::run(const std::atomic<bool>& running) {
+    while (running && !store_->logFailed()) {
+        int fd = connectToPrimary();
+        if (fd >= 0) {
+            follow(fd, running);
+            close(fd);
+        }
+
+        for (int waited = 0; running && waited < kRetryMs; waited += kPollMs) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(kPollMs));
+        }
+    }
+}
+
+int ReplicationClient::connectToPrimary() {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    if (inet_pton(AF_INET, host_.c_str(), &addr.sin_addr) <= 0) {
+        std::cerr << "Replication: invalid primary address " << host_ << std::endl;
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "socket error: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "Replication: cannot reach primary " << host_ << ":" << port_
+                  << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    setTimeouts(fd);
+    return fd;
+}
+
+void ReplicationClient::follow(int fd, const std::atomic<bool>& running) {
+    Protocol::Request sync;
+    sync.type = CommandType::SYNC;
+    if (!sendRequest(fd, sync, running)) {
+        return;
+    }
+
+    // The dump that follows holds everything the primary has. It is staged
+    // until it is complete, and the store serves what it held until then.
+    std::cout << "Full sync from primary " << host_ << ":" << port_ << std::endl;
+
+    using Clock = std::chrono::steady_clock;
+    const auto ack_interval = std::chrono::milliseconds(kAckIntervalMs);
+    std::vector<uint8_t> frame;
+    std::vector<uint8_t> dump;
+    bool synced = false;
+    std::vector<WAL::Entry> entries;
+    uint64_t applied = 0;
+    uint64_t acked = 0;
+    auto last_ack = Clock::now();
+
+    while (running) {
+        if (!recvFrame(fd, frame, std::numeric_limits<uint32_t>::max(), running)) {
+            if (running) {
+                std::cerr << "Replication stream from primary lost" << std::endl;
+            }
+            return;
+        }
+        if (frame.size() <= Protocol::kStatusOffset ||
+            static_cast<StatusCode>(frame[Protocol::kStatusOffset]) != StatusCode::OK) {
+            std::cerr << "Primary refused to replicate" << std::endl;
+            return;
+        }
+
+        // A frame holds whole records and is applied in one go
+        std::string_view records(reinterpret_cast<const char*>(frame.data()) + Protocol::kStatusOffset + 1,
+                                 frame.size() - Protocol::kStatusOffset - 1);
+        if (!synced) {
+            dump.insert(dump.end(), records.begin(), records.end());
+            if (!(Protocol::frameFlags(frame.data()) & Protocol::kSyncComplete)) {
+                continue;
+            }
+            // The whole dump replaces the store at once
+            if (!store_->replaceWith(std::string_view(reinterpret_cast<const char*>(dump.data()), dump.size()))) {
+                return;
+            }
+            synced = true;
+            applied += dump.size();
+            std::vector<uint8_t>().swap(dump);
+            std::cout << "Full sync complete: " << store_->size() << " keys" << std::endl;
+
+            // Nothing of the swap went through the WAL, so this replica's own
+            // replicas never saw it; they start over from the new copy
+            if (downstream_) {
+                downstream_->dropReplicas();
+            }
+        } else {
+            entries.clear();
+            if (!WAL::decodeRecords(records, [&entries](const WAL::Entry& entry) { entries.push_back(entry); })) {
+                std::cerr << "Corrupt replication stream; resyncing" << std::endl;
+                return;
+            }
+            try {
+                store_->applyReplicated(entries);
+            } catch (const std::bad_alloc&) {
+                std::cerr << "Out of memory applying the replication stream; resyncing" << std::endl;
+                return;
+            }
+            if (store_->logFailed()) {
+                // Acknowledging would tell the primary these records are safe
+                std::cerr << "Replication stopped: the local WAL has failed" << std::endl;
+                return;
+            }
+            applied += records.size();
+        }
+
+        // One acknowledgement covers everything applied since the last, and
+        // waits while more frames are queued up behind this one
+        if (applied != acked && (!readable(fd) || Clock::now() - last_ack >= ack_interval)) {
+            Protocol::Request ack;
+            ack.type = CommandType::REPLACK;
+            ack.args.push_back(std::to_string(applied));
+            if (!sendRequest(fd, ack, running)) {
+                return;
+            }
+            acked = applied;
+            last_ack = Clock::now();
+        }
+    }
+}
+
+} // namespace kvstore
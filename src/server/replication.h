@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kvstore {
+
+    class Store;
+
+    // Primary side of replication. Replicas connect to the replication port
+    // and send SYNC (see CommandType::SYNC); each one is then served by a
+    // thread of its own, which streams a dump of the store followed by every
+    // WAL record written since the replica subscribed. Replication is
+    // asynchronous: clients are acknowledged without waiting for replicas.
+    class ReplicationSource {
+    public:
+        explicit ReplicationSource(std::shared_ptr<Store> store);
+
+        // non-copyable
+        ReplicationSource(const ReplicationSource&) = delete;
+        ReplicationSource& operator=(const ReplicationSource&) = delete;
+
+        // Accepts and serves replicas on listen_fd until running turns false
+        void run(int listen_fd, const std::atomic<bool>& running);
+
+        // The store's WAL sink: queues freshly logged records for every replica
+        void publish(const uint8_t* records, size_t size);
+
+        // Disconnects every replica, so each one starts over from a fresh
+        // dump; for when the store changed without going through the WAL
+        void dropReplicas();
+
+        struct Status {
+            size_t replicas = 0;
+            uint64_t max_lag_bytes = 0;   // streamed but not yet acknowledged
+        };
+        Status status() const;
+
+    private:
+        // A replica whose backlog grows past this is dropped; it reconnects
+        // and starts over from a fresh dump
+        static constexpr size_t kMaxBacklog = 64 * 1024 * 1024;
+
+        // Dump frames are cut once they reach this size
+        static constexpr size_t kDumpFrameSize = 256 * 1024;
+
+        struct Replica {
+            int fd = -1;
+            uint32_t id = 0;                 // the SYNC request id, echoed on every frame
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::vector<uint8_t> backlog;    // logged since subscribing, not yet sent
+            bool overflowed = false;
+            bool dropped = false;            // see dropReplicas()
+            std::atomic<uint64_t> sent{0};   // stream payload bytes
+            std::atomic<uint64_t> acked{0};
+        };
+
+        std::shared_ptr<Store> store_;
+        mutable std::mutex mutex_;
+        std::vector<std::shared_ptr<Replica>> replicas_;
+
+        // One replica's connection, from SYNC until it drops or we stop
+        void serve(int fd, const std::atomic<bool>& running);
+        void stream(Replica& replica, const std::atomic<bool>& running);
+        bool sendFrame(Replica& replica, const uint8_t* payload, size_t size, uint8_t flags,
+                       const std::atomic<bool>& running);
+
+        // Reads the REPLACKs that have arrived, without blocking for more
+        bool readAcks(Replica& replica, const std::atomic<bool>& running);
+    };
+
+    // Replica side: follows a primary's replication port from a thread of
+    // its own and applies the stream to the store. Whenever the stream
+    // breaks it reconnects and resynchronizes from scratch; the dump is
+    // staged in memory and swapped in whole with Store::replaceWith(), so
+    // reads meanwhile see the previous copy and a restarted replica serves
+    // its last complete one until it is back in sync. Records after the
+    // dump are logged locally. It stops for good once the local WAL fails.
+    class ReplicationClient {
+    public:
+        // downstream, if set, serves this replica's own replicas; they are
+        // dropped after every full sync, which bypasses the WAL they follow
+        ReplicationClient(std::shared_ptr<Store> store, std::string host, int port,
+                          std::shared_ptr<ReplicationSource> downstream = nullptr);
+
+        // Follows the primary until running turns false
+        void run(const std::atomic<bool>& running);
+
+    private:
+        static constexpr int kRetryMs = 1000;
+
+        // Acknowledgements are held back while more of the stream is already
+        // waiting, but never for longer than this
+        static constexpr int kAckIntervalMs = 100;
+
+        std::shared_ptr<Store> store_;
+        std::string host_;
+        int port_;
+        std::shared_ptr<ReplicationSource> downstream_;
+
+        int connectToPrimary();
+
+        // Syncs over fd and keeps applying the stream; returns when it breaks
+        void follow(int fd, const std::atomic<bool>& running);
+    };
+
+} // namespace kvstore
@@ -5,16 +5,56 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
 #include <cerrno>
 #include <iostream>
+#include <string>
 
 namespace kvstore {
 
+namespace {
+    // A replica's store must not evict on its own; see StoreConfig::replica
+    StoreConfig storeConfig(const ServerConfig& config) {
+        StoreConfig store = config.store;
+        store.replica = store.replica || !config.primary_host.empty();
+        return store;
+    }
+}
+
 Server::Server(int port)
-    : port_(port), store_(std::make_shared<Store>()) {
+    : port_(port), io_threads_(1), metrics_port_(0), replication_port_(0), read_only_(false),
+      io_backend_(IoBackend::EPOLL), store_(std::make_shared<Store>()), metrics_(store_) {
+}
+
+Server::Server(const ServerConfig& config)
+    : port_(config.port),
+      io_threads_(config.io_threads > 0 ? config.io_threads : 1),
+      metrics_port_(config.metrics_port),
+      replication_port_(config.replication_port),
+      read_only_(!config.primary_host.empty()),
+      io_backend_(config.io_backend),
+      store_(std::make_shared<Store>(storeConfig(config))),
+      metrics_(store_) {
+    if (replication_port_ > 0) {
+        replication_source_ = std::make_shared<ReplicationSource>(store_);
+        metrics_.setReplicationSource(replication_source_.get());
+
+        // The WAL may outlive the server by a little; the weak reference
+        // keeps its sink from reaching a destroyed source
+        std::weak_ptr<ReplicationSource> source = replication_source_;
+        store_->setWalSink([source](const uint8_t* records, size_t size) {
+            if (auto live = source.lock()) {
+                live->publish(records, size);
+            }
+        });
+    }
+    if (read_only_) {
+        replication_client_ = std::make_unique<ReplicationClient>(store_, config.primary_host,
+                                                                  config.primary_port, replication_source_);
+    }
 }
 
 Server::~Server() {
@@ -36,56 +76,64 @@ bool Server::setNonBlocking(int fd) {
     return true;
 }
 
-bool Server::createListenSocket() {
-    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd_ < 0) {
+int Server::createListenSocket() {
+    return createListenSocket(port_, io_threads_ > 1);
+}
+
+int Server::createListenSocket(int port, bool reuse_port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
         std::cerr << "socket error: " << strerror(errno) << std::endl;
-        return false;
+        return -1;
     }
 
     int opt = 1;
-    if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         std::cerr << "setsockopt error: " << strerror(errno) << std::endl;
-        close(listen_fd_);
-        listen_fd_ = -1;
-        return false;
+        close(listen_fd);
+        return -1;
     }
 
-    if (!setNonBlocking(listen_fd_)) {
-        close(listen_fd_);
-        listen_fd_ = -1;
-        return false;
+    // With several event loops every worker binds its own socket to the same
+    // port and the kernel load-balances new connections between them.
+    if (reuse_port &&
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        std::cerr << "setsockopt SO_REUSEPORT error: " << strerror(errno) << std::endl;
+        close(listen_fd);
+        return -1;
+    }
+
+    if (!setNonBlocking(listen_fd)) {
+        close(listen_fd);
+        return -1;
     }
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port_);
+    addr.sin_port = htons(port);
 
-    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
         std::cerr << "bind error: " << strerror(errno) << std::endl;
-        close(listen_fd_);
-        listen_fd_ = -1;
-        return false;
+        close(listen_fd);
+        return -1;
     }
 
-    if (listen(listen_fd_, SOMAXCONN) < 0) {
+    if (listen(listen_fd, SOMAXCONN) < 0) {
         std::cerr << "listen error: " << strerror(errno) << std::endl;
-        close(listen_fd_);
-        listen_fd_ = -1;
-        return false;
+        close(listen_fd);
+        return -1;
     }
 
-    std::cout << "Server listening on port " << port_ << std::endl;
-    return true;
+    return listen_fd;
 }
 
-void Server::acceptConnection() {
+void Server::acceptConnection(Worker& worker) {
     while (true) {
         sockaddr_in client_addr{};
         socklen_t client_len = sizeof(client_addr);
 
-        int client_fd = accept(listen_fd_,
+        int client_fd = accept(worker.listen_fd,
                               reinterpret_cast<sockaddr*>(&client_addr),
                               &client_len);
 
@@ -104,26 +152,32 @@ void Server::acceptConnection() {
             continue;
         }
 
+        // Edge-triggered read and write: EPOLLOUT fires again whenever a
+        // socket that had filled up becomes writable, so pipelined responses
+        // that did not fit into one send() are not stranded.
         epoll_event ev{};
-        ev.events = EPOLLIN | EPOLLET; // edge-triggered read
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
         ev.data.fd = client_fd;
 
-        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+        if (epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
             std::cerr << "epoll_ctl ADD client error: " << strerror(errno) << std::endl;
             close(client_fd);
             continue;
         }
 
-        connections_[client_fd] = std::make_unique<Connection>(client_fd, store_);
+        worker.connections[client_fd] =
+            std::make_unique<Connection>(client_fd, store_, *worker.stats, metrics_, read_only_);
+        worker.stats->connections_opened.add();
 
         std::cout << "New connection: fd=" << client_fd
-                  << ", total connections: " << connections_.size() << std::endl;
+                  << ", worker=" << worker.id
+                  << ", worker connections: " << worker.connections.size() << std::endl;
     }
 }
 
-void Server::handleClient(int fd, uint32_t events) {
-    auto it = connections_.find(fd);
-    if (it == connections_.end()) {
+void Server::handleClient(Worker& worker, int fd, uint32_t events) {
+    auto it = worker.connections.find(fd);
+    if (it == worker.connections.end()) {
         return;
     }
 
@@ -139,55 +193,68 @@ void Server::handleClient(int fd, uint32_t events) {
         keep_alive = conn->handleWrite();
     }
 
+    // Reading stopped because responses backed up. Now that some of them
+    // went out, pick up the buffered requests and the unread socket data;
+    // with edge triggering no new EPOLLIN would arrive for the latter.
+    while (keep_alive && conn->canResumeRead()) {
+        keep_alive = conn->handleRead() && conn->handleWrite();
+        if (conn->readPaused() && conn->hasDataToWrite()) {
+            break;
+        }
+    }
+
     if (events & (EPOLLERR | EPOLLHUP)) {
         keep_alive = false;
     }
 
     if (!keep_alive) {
-        closeConnection(fd);
+        closeConnection(worker, fd);
     }
 }
 
-void Server::closeConnection(int fd) {
+void Server::closeConnection(Worker& worker, int fd) {
     std::cout << "Closing connection: fd=" << fd << std::endl;
 
-    if (epoll_fd_ >= 0) {
-        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    if (worker.epoll_fd >= 0) {
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
     }
 
     // unique_ptr destructor will close socket via Connection::~Connection
-    connections_.erase(fd);
+    if (worker.connections.erase(fd)) {
+        worker.stats->connections_closed.add();
+    }
 }
 
-void Server::run() {
-    if (!createListenSocket()) {
-        return;
+bool Server::initWorker(Worker& worker) {
+    worker.listen_fd = createListenSocket();
+    if (worker.listen_fd < 0) {
+        return false;
     }
 
-    epoll_fd_ = epoll_create1(0);
-    if (epoll_fd_ < 0) {
+    worker.epoll_fd = epoll_create1(0);
+    if (worker.epoll_fd < 0) {
         std::cerr << "epoll_create1 error: " << strerror(errno) << std::endl;
-        return;
+        return false;
     }
 
     epoll_event ev{};
     ev.events = EPOLLIN;
-    ev.data.fd = listen_fd_;
+    ev.data.fd = worker.listen_fd;
 
-    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) < 0) {
+    if (epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, worker.listen_fd, &ev) < 0) {
         std::cerr << "epoll_ctl ADD listen_fd error: " << strerror(errno) << std::endl;
-        return;
+        return false;
     }
 
-    running_ = true;
+    return true;
+}
 
+void Server::runWorker(Worker& worker) {
     const int MAX_EVENTS = 64;
     std::vector<epoll_event> events(MAX_EVENTS);
 
-    std::cout << "Server running..." << std::endl;
-
     while (running_) {
-        int nfds = epoll_wait(epoll_fd_, events.data(), MAX_EVENTS, 1000);
+        int nfds = epoll_wait(worker.epoll_fd, events.data(), MAX_EVENTS, 1000);
 
         if (nfds < 0) {
             if (errno == EINTR) {
@@ -200,35 +267,212 @@ void Server::run() {
         for (int i = 0; i < nfds; ++i) {
             int fd = events[i].data.fd;
 
-            if (fd == listen_fd_) {
-                acceptConnection();
+            if (fd == worker.listen_fd) {
+                acceptConnection(worker);
             } else {
-                handleClient(fd, events[i].events);
+                handleClient(worker, fd, events[i].events);
             }
         }
     }
-
-    // cleanup on exit
-    stop();
 }
 
-void Server::stop() {
-    running_ = false;
+void Server::serve(Worker& worker) {
+#ifdef KVSTORE_HAVE_IO_URING
+    if (io_backend_ == IoBackend::IO_URING) {
+        if (runUringWorker(worker)) {
+            return;
+        }
+        std::cerr << "Worker " << worker.id << ": io_uring unavailable, falling back to epoll" << std::endl;
+    }
+#endif
+    runWorker(worker);
+}
 
+void Server::closeWorker(Worker& worker) {
     // Remove and destroy all connections (Connection destructor closes fd)
-    connections_.clear();
+    worker.connections.clear();
 
-    if (epoll_fd_ >= 0) {
-        close(epoll_fd_);
-        epoll_fd_ = -1;
+    if (worker.epoll_fd >= 0) {
+        close(worker.epoll_fd);
+        worker.epoll_fd = -1;
     }
 
-    if (listen_fd_ >= 0) {
-        close(listen_fd_);
-        listen_fd_ = -1;
+    if (worker.listen_fd >= 0) {
+        close(worker.listen_fd);
+        worker.listen_fd = -1;
+    }
+}
+
+bool Server::run() {
+    // Serving a store with a hole in its history would hide the loss
+    if (!store_->recovered()) {
+        std::cerr << "Refusing to start; the WAL or snapshot needs attention" << std::endl;
+        return false;
     }
 
+    // All listening sockets are bound up front so that a bind failure is
+    // reported before any worker starts serving.
+    for (int i = 0; i < io_threads_; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->id = i;
+        worker->stats = &metrics_.addWorker();
+        bool ok = initWorker(*worker);
+        workers_.push_back(std::move(worker));
+        if (!ok) {
+            for (auto& w : workers_) {
+                closeWorker(*w);
+            }
+            workers_.clear();
+            return false;
+        }
+    }
+
+    int metrics_fd = -1;
+    if (metrics_port_ > 0) {
+        metrics_fd = createListenSocket(metrics_port_, false);
+        if (metrics_fd < 0) {
+            for (auto& w : workers_) {
+                closeWorker(*w);
+            }
+            workers_.clear();
+            return false;
+        }
+    }
+
+    int replication_fd = -1;
+    if (replication_port_ > 0) {
+        replication_fd = createListenSocket(replication_port_, false);
+        if (replication_fd < 0) {
+            for (auto& w : workers_) {
+                closeWorker(*w);
+            }
+            workers_.clear();
+            if (metrics_fd >= 0) {
+                close(metrics_fd);
+            }
+            return false;
+        }
+    }
+
+    std::cout << "Server listening on port " << port_
+              << " with " << io_threads_ << " I/O thread(s) ("
+              << (io_backend_ == IoBackend::IO_URING ? "io_uring" : "epoll") << ")" << std::endl;
+    if (metrics_fd >= 0) {
+        std::cout << "Metrics on port " << metrics_port_ << std::endl;
+    }
+    if (replication_fd >= 0) {
+        std::cout << "Replicas served on port " << replication_port_ << std::endl;
+    }
+    if (read_only_) {
+        std::cout << "Read-only replica" << std::endl;
+    }
+
+    running_ = true;
+
+    std::cout << "Server running..." << std::endl;
+
+    // The calling thread drives worker 0; the rest get their own threads.
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        threads.emplace_back([this, i] { serve(*workers_[i]); });
+    }
+    if (metrics_fd >= 0) {
+        threads.emplace_back([this, metrics_fd] { runMetrics(metrics_fd); });
+    }
+    if (replication_fd >= 0) {
+        threads.emplace_back([this, replication_fd] { replication_source_->run(replication_fd, running_); });
+    }
+    if (replication_client_) {
+        threads.emplace_back([this] { replication_client_->run(running_); });
+    }
+    serve(*workers_[0]);
+
+    // If worker 0 bailed out on an error, take the others down with it.
+    running_ = false;
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // cleanup on exit
+    for (auto& worker : workers_) {
+        closeWorker(*worker);
+    }
+    workers_.clear();
+    if (metrics_fd >= 0) {
+        close(metrics_fd);
+    }
+    if (replication_fd >= 0) {
+        close(replication_fd);
+    }
+
+    Store::MemoryStats memory = store_->memoryStats();
+    std::cout << "Values: " << memory.value_bytes << " bytes in " << memory.slab.touched
+              << " bytes of slab memory (" << memory.slab.reserved << " mapped, fragmentation "
+              << memory.fragmentation() << ")" << std::endl;
+
     std::cout << "Server stopped" << std::endl;
+    return true;
+}
+
+void Server::runMetrics(int listen_fd) {
+    while (running_) {
+        // Wake up regularly to notice stop()
+        pollfd pfd{listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+
+        // Scrapes are rare and small, so each one is served synchronously;
+        // the timeouts keep a stalled client from wedging the thread
+        timeval timeout{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Read the request head; every path gets the same answer
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            request.append(buf, static_cast<size_t>(n));
+        }
+
+        std::string body = metrics_.render();
+        std::string response = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += static_cast<size_t>(n);
+        }
+        close(fd);
+    }
+}
+
+bool Server::parseIoBackend(const std::string& name, IoBackend& backend) {
+    if (name == "epoll") {
+        backend = IoBackend::EPOLL;
+        return true;
+    }
+#ifdef KVSTORE_HAVE_IO_URING
+    if (name == "io_uring") {
+        backend = IoBackend::IO_URING;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void Server::stop() {
+    running_ = false;
 }
 
 } // namespace kvstore
@@ -4,16 +4,57 @@
 #include <atomic>
 #include <memory>
 #include <map>
+#include <string>
+#include <thread>
+#include <vector>
 #include <sys/epoll.h>
+#include "../storage/store.h"
+#include "metrics.h"
+#include "replication.h"
 
 namespace kvstore {
 
-    class Store;
     class Connection;
 
+    // How the event loops wait for socket I/O
+    enum class IoBackend : uint8_t {
+        EPOLL,      // readiness: epoll, then recv()/send() on the socket
+        IO_URING    // completion: multishot accept and recv, batched sends
+    };
+
+    struct ServerConfig {
+        int port = 6379;
+
+        // Number of event loops. Each one runs on its own thread with its own
+        // epoll instance, listening socket (SO_REUSEPORT) and connection
+        // table; the kernel spreads incoming connections across them.
+        int io_threads = 1;
+
+        // Serve the STATS text over plain HTTP on this port, for scrapers;
+        // 0 disables it
+        int metrics_port = 0;
+
+        // IO_URING needs a build with KVSTORE_HAVE_IO_URING and Linux 6.0 or
+        // newer; a worker whose ring cannot be set up falls back to epoll
+        IoBackend io_backend = IoBackend::EPOLL;
+
+        // Stream the store and its WAL to replicas that connect to this
+        // port; 0 disables it
+        int replication_port = 0;
+
+        // Replicate from the primary whose replication port is at
+        // primary_host:primary_port and serve reads only; an empty host
+        // disables it. A replica may have replicas of its own.
+        std::string primary_host;
+        int primary_port = 0;
+
+        StoreConfig store;
+    };
+
     class Server {
     public:
         explicit Server(int port);
+        explicit Server(const ServerConfig& config);
         ~Server();
 
         // non-copyable
@@ -21,23 +62,67 @@ namespace kvstore {
         Server& operator=(const Server&) = delete;
 
         bool setNonBlocking(int fd);
-        bool createListenSocket();
+        int createListenSocket();
+        int createListenSocket(int port, bool reuse_port);
+
+        // Serves until stop(); false if the server could not start
+        bool run();
 
-        void run();
+        // "epoll" or "io_uring"; false for an unknown name or a backend this
+        // build does not include
+        static bool parseIoBackend(const std::string& name, IoBackend& backend);
+
+        // Ask every event loop to exit. Safe to call from another thread or a
+        // signal handler; run() returns once all loops have stopped.
         void stop();
 
     private:
-        void acceptConnection();
-        void handleClient(int fd, uint32_t events);
-        void closeConnection(int fd);
+        // One event loop. Workers share nothing but the store, so no locking
+        // is needed around the connection table.
+        struct Worker {
+            int id = 0;
+            int listen_fd = -1;
+            int epoll_fd = -1;
+            std::map<int, std::unique_ptr<Connection>> connections;
+            WorkerStats* stats = nullptr;
+        };
+
+        bool initWorker(Worker& worker);
+        void runWorker(Worker& worker);
+        void closeWorker(Worker& worker);
+
+        // Runs the worker's loop on the configured backend
+        void serve(Worker& worker);
+
+#ifdef KVSTORE_HAVE_IO_URING
+        // The io_uring loop (uring_worker.cpp), which drives the same
+        // Connection objects through their completion-based entry points.
+        // Returns false, before serving anything, if no ring could be set up.
+        bool runUringWorker(Worker& worker);
+#endif
+
+        void acceptConnection(Worker& worker);
+        void handleClient(Worker& worker, int fd, uint32_t events);
+        void closeConnection(Worker& worker, int fd);
+
+        // Answers every connection on the metrics port with render()'s text
+        void runMetrics(int listen_fd);
 
         int port_;
-        int listen_fd_ = -1;
-        int epoll_fd_ = -1;
+        int io_threads_;
+        int metrics_port_;
+        int replication_port_;
+        bool read_only_;
+        IoBackend io_backend_;
         std::atomic<bool> running_{false};
 
+        // The replication members come after the store, so they are torn
+        // down while it is still alive
         std::shared_ptr<Store> store_;
-        std::map<int, std::unique_ptr<Connection>> connections_;
+        Metrics metrics_;
+        std::shared_ptr<ReplicationSource> replication_source_;
+        std::unique_ptr<ReplicationClient> replication_client_;
+        std::vector<std::unique_ptr<Worker>> workers_;
     };
 
 } // namespace kvstore
@@ -0,0 +1,107 @@
+#include "staged_value.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace kvstore {
+
+StagedValue::~StagedValue() {
+    reset();
+}
+
+void StagedValue::reset() {
+    if (mapping_) {
+        munmap(mapping_, size_);
+        mapping_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    key_.clear();
+    size_ = 0;
+    written_ = 0;
+    ttl_ms_ = 0;
+}
+
+bool StagedValue::open(const std::string& dir, std::string_view key, uint64_t size, int64_t ttl_ms) {
+    reset();
+
+    // Anonymous file: nothing to clean up if the server dies mid-upload
+    int fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == ENOENT)) {
+        std::string path = dir + "/.upload.XXXXXX";
+        fd = mkostemp(path.data(), O_CLOEXEC);
+        if (fd >= 0) {
+            unlink(path.c_str());
+        }
+    }
+    if (fd < 0) {
+        std::cerr << "Failed to create upload file in " << dir << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Claim the space up front so a full disk fails the upload at the start
+    if (size > 0) {
+        int err = posix_fallocate(fd, 0, static_cast<off_t>(size));
+        if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+            std::cerr << "Failed to allocate " << size << " bytes for upload: " << strerror(err) << std::endl;
+            close(fd);
+            return false;
+        }
+    }
+
+    fd_ = fd;
+    key_.assign(key.data(), key.size());
+    size_ = size;
+    ttl_ms_ = ttl_ms;
+    return true;
+}
+
+bool StagedValue::append(std::string_view data) {
+    if (data.size() > size_ - written_) {
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = pwrite(fd_, data.data() + done, data.size() - done,
+                           static_cast<off_t>(written_ + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Upload write error: " << strerror(errno) << std::endl;
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    written_ += data.size();
+    return true;
+}
+
+bool StagedValue::map(std::string_view& value) {
+    if (!active() || !complete()) {
+        return false;
+    }
+    if (size_ == 0) {
+        value = std::string_view();
+        return true;
+    }
+
+    if (!mapping_) {
+        void* addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED) {
+            std::cerr << "Failed to map upload: " << strerror(errno) << std::endl;
+            return false;
+        }
+        madvise(addr, size_, MADV_SEQUENTIAL);
+        mapping_ = addr;
+    }
+    value = std::string_view(static_cast<const char*>(mapping_), size_);
+    return true;
+}
+
+} // namespace kvstore
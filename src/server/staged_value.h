@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+
+namespace kvstore {
+
+    // A value being uploaded in chunks (PUTBEGIN/PUTCHUNK/PUTEND). The chunks
+    // are written to an unlinked file in the data directory as they arrive,
+    // so a connection never holds more than the chunk in its read buffer no
+    // matter how large the value is. Once every byte is in, map() exposes the
+    // file so the store can copy the value in with no intermediate buffer.
+    class StagedValue {
+    public:
+        StagedValue() = default;
+        ~StagedValue();
+
+        StagedValue(const StagedValue&) = delete;
+        StagedValue& operator=(const StagedValue&) = delete;
+
+        // Starts staging size bytes for key, dropping any previous upload
+        bool open(const std::string& dir, std::string_view key, uint64_t size, int64_t ttl_ms);
+
+        // Appends the next chunk; fails if it would run past the declared size
+        bool append(std::string_view data);
+
+        // The whole value, once every byte has been appended. Valid until
+        // reset() or the next open().
+        bool map(std::string_view& value);
+
+        void reset();
+
+        bool active() const { return fd_ >= 0; }
+        bool complete() const { return written_ == size_; }
+        const std::string& key() const { return key_; }
+        int64_t ttl() const { return ttl_ms_; }
+
+    private:
+        int fd_ = -1;
+        std::string key_;
+        uint64_t size_ = 0;
+        uint64_t written_ = 0;
+        int64_t ttl_ms_ = 0;
+        void* mapping_ = nullptr;
+    };
+
+} // namespace kvstore
@@ -0,0 +1,218 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+namespace kvstore {
+
+namespace {
+
+int ringSetup(unsigned entries, io_uring_params& params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+}
+
+int ringRegister(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+void* mapRing(int fd, size_t size, off_t offset) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+} // namespace
+
+IoUring::~IoUring() {
+    // Closing the ring cancels whatever is still in flight, so the receive
+    // buffers may only go after it
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    if (buf_ring_) {
+        munmap(buf_ring_, buf_ring_size_);
+    }
+    if (sqes_) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+}
+
+bool IoUring::init(unsigned entries) {
+    // Room for several completions per submission: multishot requests keep
+    // posting without being resubmitted
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    fd_ = ringSetup(entries, params);
+    if (fd_ < 0 && errno == EINVAL) {
+        // Kernels before 6.0 know neither hint
+        params = io_uring_params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        fd_ = ringSetup(entries, params);
+    }
+    if (fd_ < 0) {
+        std::cerr << "io_uring_setup error: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        std::cerr << "io_uring: kernel too old (needs EXT_ARG and NODROP)" << std::endl;
+        return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mapRing(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ : mapRing(fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(mapRing(fd_, sqes_size_, IORING_OFF_SQES));
+    if (!sq_ring_ || !cq_ring_ || !sqes_) {
+        std::cerr << "io_uring mmap error: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    auto* sq = static_cast<uint8_t*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = sq_submitted_ = *sq_tail_;
+
+    // Submission slot i always describes entry i
+    auto* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) {
+        array[i] = i;
+    }
+
+    auto* cq = static_cast<uint8_t*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+io_uring_sqe* IoUring::sqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_local_tail_ - head >= sq_entries_) {
+        // Full: without SQPOLL the kernel consumes everything on submit
+        submit();
+        head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sq_local_tail_ - head >= sq_entries_) {
+            return nullptr;
+        }
+    }
+
+    io_uring_sqe* entry = &sqes_[sq_local_tail_ & sq_mask_];
+    ++sq_local_tail_;
+    std::memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+int IoUring::enter(unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, arg, arg_size));
+}
+
+bool IoUring::submit() {
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned pending = sq_local_tail_ - sq_submitted_;
+    while (pending > 0) {
+        int n = enter(pending, 0, 0, nullptr, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "io_uring_enter error: " << strerror(errno) << std::endl;
+            return false;
+        }
+        sq_submitted_ += static_cast<unsigned>(n);
+        pending -= static_cast<unsigned>(n);
+    }
+    return true;
+}
+
+bool IoUring::submitAndWait(int timeout_ms) {
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned pending = sq_local_tail_ - sq_submitted_;
+
+    __kernel_timespec ts{};
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+    // One system call both submits the batch and waits for completions
+    int n = enter(pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (n < 0) {
+        if (errno == ETIME || errno == EINTR || errno == EBUSY) {
+            // Timed out, interrupted, or the completion queue needs
+            // draining first; submissions are retried next time
+            return true;
+        }
+        std::cerr << "io_uring_enter error: " << strerror(errno) << std::endl;
+        return false;
+    }
+    sq_submitted_ += static_cast<unsigned>(n);
+    return true;
+}
+
+bool IoUring::setupBuffers(uint16_t group, unsigned count, size_t size) {
+    // The ring shares its memory with the kernel, which picks a buffer for
+    // each receive as data arrives
+    buf_ring_size_ = count * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        std::cerr << "io_uring buffer ring mmap error: " << strerror(errno) << std::endl;
+        return false;
+    }
+    buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+    buf_mask_ = count - 1;
+    buffer_size_ = size;
+    buffers_.resize(count * size);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (ringRegister(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        std::cerr << "io_uring buffer ring registration error: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        recycleBuffer(static_cast<uint16_t>(i));
+    }
+    return true;
+}
+
+void IoUring::recycleBuffer(uint16_t id) {
+    // Not buf_ring_->bufs: the header declares it as a flexible array
+    // behind an empty struct, which C++ (unlike C) gives a nonzero size
+    uint16_t tail = buf_ring_->tail;
+    io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(buf_ring_)[tail & buf_mask_];
+    buf.addr = reinterpret_cast<uint64_t>(buffer(id));
+    buf.len = static_cast<uint32_t>(buffer_size_);
+    buf.bid = id;
+    __atomic_store_n(&buf_ring_->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+}
+
+} // namespace kvstore
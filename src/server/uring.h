@@ -0,0 +1,84 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace kvstore {
+
+    // Minimal io_uring wrapper over the raw syscalls: one submission and one
+    // completion ring, plus a ring of provided receive buffers. Used by a
+    // single thread.
+    class IoUring {
+    public:
+        IoUring() = default;
+        ~IoUring();
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        // Returns false (after printing why) if the kernel lacks what the
+        // server needs
+        bool init(unsigned entries);
+
+        // A zeroed submission entry; flushes the queue to the kernel first
+        // if it is full
+        io_uring_sqe* sqe();
+
+        // Submit everything queued and wait up to timeout_ms for at least
+        // one completion. Returns false on an unexpected error.
+        bool submitAndWait(int timeout_ms);
+
+        // Calls fn(const io_uring_cqe&) for every available completion
+        template <typename Fn>
+        void forEachCompletion(Fn&& fn) {
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                fn(cqes_[head & cq_mask_]);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+
+        // Registers count buffers of size bytes each as buffer group group,
+        // for receives submitted with IOSQE_BUFFER_SELECT
+        bool setupBuffers(uint16_t group, unsigned count, size_t size);
+        uint8_t* buffer(uint16_t id) { return buffers_.data() + static_cast<size_t>(id) * buffer_size_; }
+
+        // Hand a buffer back to the kernel once its data has been consumed
+        void recycleBuffer(uint16_t id);
+
+    private:
+        int fd_ = -1;
+
+        void* sq_ring_ = nullptr;
+        size_t sq_ring_size_ = 0;
+        void* cq_ring_ = nullptr;
+        size_t cq_ring_size_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        size_t sqes_size_ = 0;
+
+        unsigned* sq_head_ = nullptr;
+        unsigned* sq_tail_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        unsigned sq_local_tail_ = 0;   // entries handed out by sqe()
+        unsigned sq_submitted_ = 0;    // ...of which the kernel has seen
+
+        unsigned* cq_head_ = nullptr;
+        unsigned* cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+
+        io_uring_buf_ring* buf_ring_ = nullptr;
+        size_t buf_ring_size_ = 0;
+        unsigned buf_mask_ = 0;
+        size_t buffer_size_ = 0;
+        std::vector<uint8_t> buffers_;
+
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size);
+        bool submit();
+    };
+
+} // namespace kvstore
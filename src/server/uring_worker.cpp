@@ -0,0 +1,236 @@
+#include "server.h"
+
+#include "connection.h"
+#include "uring.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+namespace kvstore {
+
+namespace {
+
+constexpr unsigned kRingEntries = 256;
+constexpr uint16_t kBufferGroup = 0;
+constexpr unsigned kRecvBuffers = 256;         // power of two
+constexpr size_t kRecvBufferSize = 16 * 1024;
+
+// user_data of a submission: connection id in the high bits, operation in
+// the low two. Ids are never reused, so a late completion for a closed
+// connection cannot be mistaken for one of its successor on the same fd.
+enum Op : uint64_t { OP_ACCEPT = 0, OP_RECV = 1, OP_SEND = 2, OP_CANCEL = 3 };
+
+uint64_t tag(uint64_t id, Op op) { return id << 2 | op; }
+
+struct UringConnection {
+    std::unique_ptr<Connection> conn;
+    IOBuffer sending;           // handed to the kernel; untouched until the send completes
+    bool recv_armed = false;
+    bool send_armed = false;
+    bool cancelling = false;    // recv cancelled while reading is paused
+    bool closing = false;
+};
+
+} // namespace
+
+bool Server::runUringWorker(Worker& worker) {
+    // Declared first so it is destroyed last: the ring has to be closed
+    // before the buffers its pending sends point into are freed
+    std::unordered_map<uint64_t, UringConnection> connections;
+
+    IoUring ring;
+    if (!ring.init(kRingEntries) || !ring.setupBuffers(kBufferGroup, kRecvBuffers, kRecvBufferSize)) {
+        return false;
+    }
+
+    uint64_t next_id = 1;
+    bool accept_armed = false;
+
+    auto armAccept = [&] {
+        io_uring_sqe* sqe = ring.sqe();
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = worker.listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = tag(0, OP_ACCEPT);
+        accept_armed = true;
+    };
+
+    // One multishot receive per connection; the kernel fills a provided
+    // buffer per completion until it is cancelled or runs dry
+    auto armRecv = [&](uint64_t id, UringConnection& c) {
+        io_uring_sqe* sqe = ring.sqe();
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = c.conn->fd();
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufferGroup;
+        sqe->user_data = tag(id, OP_RECV);
+        c.recv_armed = true;
+        c.cancelling = false;
+    };
+
+    // Queued only; every send produced while draining the completion queue
+    // goes to the kernel in the loop's single submit call
+    auto armSend = [&](uint64_t id, UringConnection& c) {
+        if (c.sending.empty()) {
+            c.conn->takeOutput(c.sending);
+        }
+        if (c.sending.empty()) return;
+        io_uring_sqe* sqe = ring.sqe();
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c.conn->fd();
+        sqe->addr = reinterpret_cast<uint64_t>(c.sending.readPtr());
+        sqe->len = static_cast<uint32_t>(c.sending.readable());
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(id, OP_SEND);
+        c.send_armed = true;
+    };
+
+    auto cancelRecv = [&](uint64_t id, UringConnection& c) {
+        io_uring_sqe* sqe = ring.sqe();
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = tag(id, OP_RECV);
+        sqe->user_data = tag(id, OP_CANCEL);
+        c.cancelling = true;
+    };
+
+    // Shutting the socket down completes whatever is still in flight; the
+    // connection is destroyed once nothing references its buffers
+    auto startClose = [&](UringConnection& c) {
+        if (c.closing) return;
+        c.closing = true;
+        shutdown(c.conn->fd(), SHUT_RDWR);
+    };
+
+    auto finishIfClosed = [&](uint64_t id, UringConnection& c) {
+        if (!c.closing || c.recv_armed || c.send_armed) return;
+        std::cout << "Closing connection: fd=" << c.conn->fd() << std::endl;
+        connections.erase(id);
+        worker.stats->connections_closed.add();
+    };
+
+    // After the connection consumed input or output drained: send what is
+    // pending, and stop or restart reading to follow the pause state
+    auto update = [&](uint64_t id, UringConnection& c) {
+        if (!c.closing && c.conn->canResumeRead() && !c.conn->resumeRead()) {
+            startClose(c);
+        }
+        if (!c.closing) {
+            if (!c.send_armed) {
+                armSend(id, c);
+            }
+            if (c.conn->readPaused()) {
+                if (c.recv_armed && !c.cancelling) {
+                    cancelRecv(id, c);
+                }
+            } else if (!c.recv_armed) {
+                armRecv(id, c);
+            }
+        }
+        finishIfClosed(id, c);
+    };
+
+    auto onAccept = [&](const io_uring_cqe& cqe) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            accept_armed = false;
+        }
+        if (cqe.res < 0) {
+            std::cerr << "accept error: " << strerror(-cqe.res) << std::endl;
+            return;
+        }
+
+        uint64_t id = next_id++;
+        UringConnection& c = connections[id];
+        c.conn = std::make_unique<Connection>(cqe.res, store_, *worker.stats, metrics_, read_only_);
+        worker.stats->connections_opened.add();
+        armRecv(id, c);
+
+        std::cout << "New connection: fd=" << cqe.res
+                  << ", worker=" << worker.id
+                  << ", worker connections: " << connections.size() << std::endl;
+    };
+
+    auto onRecv = [&](uint64_t id, UringConnection& c, const io_uring_cqe& cqe) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            c.recv_armed = false;
+        }
+
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            auto buffer_id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (cqe.res > 0 && !c.closing &&
+                !c.conn->feed(ring.buffer(buffer_id), static_cast<size_t>(cqe.res))) {
+                startClose(c);
+            }
+            ring.recycleBuffer(buffer_id);
+        } else if (cqe.res == 0) {
+            // peer closed connection
+            startClose(c);
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+            // Out of buffers just ends the multishot; update() rearms it
+            if (!c.closing) {
+                std::cerr << "recv error: " << strerror(-cqe.res) << std::endl;
+            }
+            startClose(c);
+        }
+        update(id, c);
+    };
+
+    auto onSend = [&](uint64_t id, UringConnection& c, const io_uring_cqe& cqe) {
+        c.send_armed = false;
+        if (cqe.res < 0) {
+            if (!c.closing) {
+                std::cerr << "send error: " << strerror(-cqe.res) << std::endl;
+            }
+            startClose(c);
+        } else {
+            c.sending.consume(static_cast<size_t>(cqe.res));
+            worker.stats->bytes_out.add(static_cast<uint64_t>(cqe.res));
+        }
+        update(id, c);
+    };
+
+    armAccept();
+
+    while (running_) {
+        if (!ring.submitAndWait(1000)) {
+            break;
+        }
+
+        ring.forEachCompletion([&](const io_uring_cqe& cqe) {
+            uint64_t id = cqe.user_data >> 2;
+            auto op = static_cast<Op>(cqe.user_data & 3);
+
+            if (op == OP_ACCEPT) {
+                onAccept(cqe);
+                return;
+            }
+
+            auto it = connections.find(id);
+            if (it == connections.end()) {
+                return;
+            }
+            if (op == OP_RECV) {
+                onRecv(id, it->second, cqe);
+            } else if (op == OP_SEND) {
+                onSend(id, it->second, cqe);
+            }
+        });
+
+        if (!accept_armed && running_) {
+            armAccept();
+        }
+    }
+
+    return true;
+}
+
+} // namespace kvstore
@@ -0,0 +1,252 @@
+#include "btree.h"
+#include <algorithm>
+
+namespace kvstore {
+
+struct BPlusTree::Node {
+    explicit Node(bool leaf) : is_leaf(leaf) {}
+    virtual ~Node() = default;
+
+    const bool is_leaf;
+};
+
+struct BPlusTree::Leaf : Node {
+    Leaf() : Node(true) {
+        keys.reserve(kLeafCapacity + 1);
+    }
+
+    std::vector<std::string> keys;
+    Leaf* prev = nullptr;
+    Leaf* next = nullptr;
+};
+
+// children[i] holds keys k with separators[i - 1] <= k < separators[i]
+struct BPlusTree::Internal : Node {
+    Internal() : Node(false) {
+        separators.reserve(kInternalCapacity);
+        children.reserve(kInternalCapacity + 1);
+    }
+
+    std::vector<std::string> separators;
+    std::vector<std::unique_ptr<Node>> children;
+};
+
+BPlusTree::BPlusTree() : root_(std::make_unique<Leaf>()) {
+}
+
+BPlusTree::~BPlusTree() = default;
+
+void BPlusTree::clear() {
+    root_ = std::make_unique<Leaf>();
+    spare_root_.reset();
+    size_ = 0;
+}
+
+const std::string& BPlusTree::Iterator::key() const {
+    return leaf_->keys[pos_];
+}
+
+void BPlusTree::Iterator::next() {
+    if (++pos_ < leaf_->keys.size()) return;
+
+    // Empty leaves are unlinked, so the next one has keys if it exists
+    leaf_ = leaf_->next;
+    pos_ = 0;
+}
+
+size_t BPlusTree::childIndex(const Internal* node, std::string_view key) {
+    auto it = std::upper_bound(node->separators.begin(), node->separators.end(), key,
+                               [](std::string_view k, const std::string& sep) { return k < sep; });
+    return static_cast<size_t>(it - node->separators.begin());
+}
+
+BPlusTree::Iterator BPlusTree::begin() const {
+    const Node* node = root_.get();
+    while (!node->is_leaf) {
+        node = static_cast<const Internal*>(node)->children.front().get();
+    }
+    const Leaf* leaf = static_cast<const Leaf*>(node);
+    return Iterator(leaf->keys.empty() ? nullptr : leaf, 0);
+}
+
+BPlusTree::Iterator BPlusTree::lowerBound(std::string_view key) const {
+    const Node* node = root_.get();
+    while (!node->is_leaf) {
+        const Internal* internal = static_cast<const Internal*>(node);
+        node = internal->children[childIndex(internal, key)].get();
+    }
+
+    const Leaf* leaf = static_cast<const Leaf*>(node);
+    auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key,
+                               [](const std::string& k, std::string_view target) { return k < target; });
+    size_t pos = static_cast<size_t>(it - leaf->keys.begin());
+    if (pos < leaf->keys.size()) {
+        return Iterator(leaf, pos);
+    }
+    return Iterator(leaf->next, 0);
+}
+
+bool BPlusTree::full(const Node* node) {
+    return node->is_leaf ? static_cast<const Leaf*>(node)->keys.size() >= kLeafCapacity
+                         : static_cast<const Internal*>(node)->children.size() >= kInternalCapacity;
+}
+
+bool BPlusTree::insert(std::string_view key) {
+    // Only a full root can split, and the new root must exist before it
+    // does: failing to allocate one afterwards would lose its right half
+    if (!spare_root_ && full(root_.get())) {
+        spare_root_ = std::make_unique<Internal>();
+    }
+
+    Split split;
+    if (!insertInto(root_.get(), key, split)) {
+        return false;
+    }
+
+    if (split.node) {
+        std::unique_ptr<Internal> root = std::move(spare_root_);
+        root->separators.push_back(std::move(split.separator));
+        root->children.push_back(std::move(root_));
+        root->children.push_back(std::move(split.node));
+        root_ = std::move(root);
+    }
+    return true;
+}
+
+// Out of memory, insertion throws before the key goes in or leaves a node
+// over capacity: allocations come before anything is moved, and a node
+// that cannot be split stays whole until a later insert splits it.
+bool BPlusTree::insertInto(Node* node, std::string_view key, Split& split) {
+    if (node->is_leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key,
+                                   [](const std::string& k, std::string_view target) { return k < target; });
+        if (it != leaf->keys.end() && *it == key) {
+            return false;
+        }
+        leaf->keys.emplace(it, key);
+        ++size_;
+
+        if (leaf->keys.size() > kLeafCapacity) {
+            auto right = std::make_unique<Leaf>();
+            size_t half = leaf->keys.size() / 2;
+            std::string separator = leaf->keys[half];
+            std::move(leaf->keys.begin() + half, leaf->keys.end(), std::back_inserter(right->keys));
+            leaf->keys.resize(half);
+
+            right->prev = leaf;
+            right->next = leaf->next;
+            if (leaf->next) leaf->next->prev = right.get();
+            leaf->next = right.get();
+
+            split.separator = std::move(separator);
+            split.node = std::move(right);
+        }
+        return true;
+    }
+
+    Internal* internal = static_cast<Internal*>(node);
+    size_t index = childIndex(internal, key);
+
+    // Room for a split child, so taking it in cannot fail
+    internal->separators.reserve(internal->separators.size() + 1);
+    internal->children.reserve(internal->children.size() + 1);
+
+    Split child_split;
+    if (!insertInto(internal->children[index].get(), key, child_split)) {
+        return false;
+    }
+
+    if (child_split.node) {
+        internal->separators.insert(internal->separators.begin() + index,
+                                    std::move(child_split.separator));
+        internal->children.insert(internal->children.begin() + index + 1,
+                                  std::move(child_split.node));
+
+        if (internal->children.size() > kInternalCapacity) {
+            auto right = std::make_unique<Internal>();
+            size_t half = internal->children.size() / 2;
+
+            // The separator between the halves moves up to the parent
+            split.separator = std::move(internal->separators[half - 1]);
+            std::move(internal->separators.begin() + half, internal->separators.end(),
+                      std::back_inserter(right->separators));
+            std::move(internal->children.begin() + half, internal->children.end(),
+                      std::back_inserter(right->children));
+            internal->separators.resize(half - 1);
+            internal->children.resize(half);
+
+            split.node = std::move(right);
+        }
+    }
+    return true;
+}
+
+bool BPlusTree::erase(std::string_view key) {
+    bool emptied = false;
+    if (!eraseFrom(root_.get(), key, emptied)) {
+        return false;
+    }
+    --size_;
+
+    if (emptied && !root_->is_leaf) {
+        // The last key is gone
+        root_ = std::make_unique<Leaf>();
+        return true;
+    }
+
+    // Collapse a root with a single child so lookups don't pay for it
+    while (!root_->is_leaf) {
+        Internal* root = static_cast<Internal*>(root_.get());
+        if (root->children.size() != 1) break;
+        std::unique_ptr<Node> child = std::move(root->children.front());
+        root_ = std::move(child);
+    }
+    return true;
+}
+
+bool BPlusTree::eraseFrom(Node* node, std::string_view key, bool& emptied) {
+    if (node->is_leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key,
+                                   [](const std::string& k, std::string_view target) { return k < target; });
+        if (it == leaf->keys.end() || *it != key) {
+            return false;
+        }
+        leaf->keys.erase(it);
+        emptied = leaf->keys.empty();
+        return true;
+    }
+
+    Internal* internal = static_cast<Internal*>(node);
+    size_t index = childIndex(internal, key);
+    bool child_emptied = false;
+    if (!eraseFrom(internal->children[index].get(), key, child_emptied)) {
+        return false;
+    }
+
+    if (child_emptied) {
+        Node* child = internal->children[index].get();
+        if (child->is_leaf) {
+            unlink(static_cast<Leaf*>(child));
+        }
+
+        // Drop the child together with the separator on one side of it
+        internal->children.erase(internal->children.begin() + index);
+        if (!internal->separators.empty()) {
+            size_t sep = index > 0 ? index - 1 : 0;
+            internal->separators.erase(internal->separators.begin() + sep);
+        }
+        emptied = internal->children.empty();
+    }
+    return true;
+}
+
+void BPlusTree::unlink(Leaf* leaf) {
+    if (leaf->prev) leaf->prev->next = leaf->next;
+    if (leaf->next) leaf->next->prev = leaf->prev;
+    leaf->prev = nullptr;
+    leaf->next = nullptr;
+}
+
+} // namespace kvstore
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <cstddef>
+
+namespace kvstore {
+
+    // In-memory B+tree holding an ordered set of keys. Leaves store keys in
+    // contiguous sorted arrays and are linked left to right, so a range scan
+    // is a descent followed by a sequential walk. Short keys live inside the
+    // std::string itself, so scanning them does not chase pointers.
+    //
+    // Nodes are freed when they become empty rather than merged when they
+    // become underfull. The tree stays balanced (all leaves are at the same
+    // depth); a delete-heavy workload just leaves some nodes sparse.
+    class BPlusTree {
+    public:
+        BPlusTree();
+        ~BPlusTree();
+
+        BPlusTree(const BPlusTree&) = delete;
+        BPlusTree& operator=(const BPlusTree&) = delete;
+
+        // Returns false if the key was already present. If it throws
+        // std::bad_alloc, the key is either absent or fully inserted.
+        bool insert(std::string_view key);
+
+        // Returns false if the key was not present
+        bool erase(std::string_view key);
+
+        size_t size() const { return size_; }
+        void clear();
+
+        // Exchange contents; iterators follow their keys
+        void swap(BPlusTree& other) noexcept {
+            root_.swap(other.root_);
+            std::swap(size_, other.size_);
+            spare_root_.swap(other.spare_root_);
+        }
+
+    private:
+        struct Node;
+        struct Leaf;
+        struct Internal;
+
+    public:
+        // Forward iterator over the keys in order. Invalidated by any
+        // modification of the tree.
+        class Iterator {
+        public:
+            bool valid() const { return leaf_ != nullptr; }
+            const std::string& key() const;
+            void next();
+
+        private:
+            friend class BPlusTree;
+            Iterator(const Leaf* leaf, size_t pos) : leaf_(leaf), pos_(pos) {}
+
+            const Leaf* leaf_;
+            size_t pos_;
+        };
+
+        Iterator begin() const;
+
+        // First key >= key
+        Iterator lowerBound(std::string_view key) const;
+
+    private:
+        static constexpr size_t kLeafCapacity = 32;
+        static constexpr size_t kInternalCapacity = 64;   // children
+
+        std::unique_ptr<Node> root_;
+        size_t size_ = 0;
+
+        // Allocated ahead of a root split; see insert()
+        std::unique_ptr<Internal> spare_root_;
+
+        // Set when insertion splits a node: the new right sibling and the
+        // smallest key it covers
+        struct Split {
+            std::unique_ptr<Node> node;
+            std::string separator;
+        };
+
+        bool insertInto(Node* node, std::string_view key, Split& split);
+
+        // Returns false if the key was not found; sets emptied when the node
+        // has no keys (leaf) or children (internal) left afterwards
+        bool eraseFrom(Node* node, std::string_view key, bool& emptied);
+
+        // True if one more key or child would make node split
+        static bool full(const Node* node);
+
+        static size_t childIndex(const Internal* node, std::string_view key);
+        void unlink(Leaf* leaf);
+    };
+
+} // namespace kvstore
@@ -0,0 +1,205 @@
+#include "compression.h"
+#include <cstring>
+#include <cstdint>
+
+namespace kvstore {
+
+namespace {
+    constexpr size_t kSizeField = 4;
+
+    // LZ4 block format limits: matches are at least 4 bytes, the last 5
+    // bytes are always literals, and no match starts in the last 12 bytes
+    constexpr size_t kMinMatch = 4;
+    constexpr size_t kLastLiterals = 5;
+    constexpr size_t kMatchFindLimit = 12;
+    constexpr size_t kMaxOffset = 65535;
+    constexpr unsigned kHashLog = 12;
+
+    uint32_t load32(const uint8_t* p) {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        return v;
+    }
+
+    uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - kHashLog);
+    }
+
+    // Worst case: every byte a literal, plus one length byte per 255
+    size_t maxBlockSize(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    uint8_t* writeLength(uint8_t* op, size_t length) {
+        while (length >= 255) {
+            *op++ = 255;
+            length -= 255;
+        }
+        *op++ = static_cast<uint8_t>(length);
+        return op;
+    }
+
+    // Appends one sequence: literals [anchor, anchor + literals) followed by
+    // a match of match_len bytes at offset back (none if match_len is 0)
+    uint8_t* writeSequence(uint8_t* op, const uint8_t* anchor, size_t literals,
+                           size_t offset, size_t match_len) {
+        uint8_t* token = op++;
+        *token = static_cast<uint8_t>((literals >= 15 ? 15 : literals) << 4);
+        if (literals >= 15) {
+            op = writeLength(op, literals - 15);
+        }
+        std::memcpy(op, anchor, literals);
+        op += literals;
+
+        if (match_len > 0) {
+            *op++ = static_cast<uint8_t>(offset);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+            size_t code = match_len - kMinMatch;
+            *token |= static_cast<uint8_t>(code >= 15 ? 15 : code);
+            if (code >= 15) {
+                op = writeLength(op, code - 15);
+            }
+        }
+        return op;
+    }
+
+    // Greedy single-pass compressor with a 4K-entry hash table of the most
+    // recent position of each 4-byte sequence. Steps faster through data
+    // that keeps failing to match, so incompressible input stays cheap.
+    size_t compressBlock(const uint8_t* src, size_t size, uint8_t* dst) {
+        uint8_t* op = dst;
+        const uint8_t* anchor = src;
+
+        if (size > kMatchFindLimit) {
+            uint32_t table[1u << kHashLog] = {};
+            const uint8_t* ip = src + 1;
+            const uint8_t* match_limit = src + size - kMatchFindLimit;
+            const uint8_t* extend_limit = src + size - kLastLiterals;
+
+            while (ip < match_limit) {
+                uint32_t sequence = load32(ip);
+                uint32_t h = hash(sequence);
+                const uint8_t* candidate = src + table[h];
+                table[h] = static_cast<uint32_t>(ip - src);
+
+                if (candidate >= ip || static_cast<size_t>(ip - candidate) > kMaxOffset ||
+                    load32(candidate) != sequence) {
+                    ip += 1 + (static_cast<size_t>(ip - anchor) >> 6);
+                    continue;
+                }
+
+                // Grow the match backwards over pending literals, then forwards
+                while (ip > anchor && candidate > src && ip[-1] == candidate[-1]) {
+                    --ip;
+                    --candidate;
+                }
+                size_t length = kMinMatch;
+                while (ip + length < extend_limit && ip[length] == candidate[length]) {
+                    ++length;
+                }
+
+                op = writeSequence(op, anchor, static_cast<size_t>(ip - anchor),
+                                   static_cast<size_t>(ip - candidate), length);
+                ip += length;
+                anchor = ip;
+                if (ip < match_limit) {
+                    table[hash(load32(ip - 2))] = static_cast<uint32_t>(ip - 2 - src);
+                }
+            }
+        }
+
+        op = writeSequence(op, anchor, static_cast<size_t>(src + size - anchor), 0, 0);
+        return static_cast<size_t>(op - dst);
+    }
+
+    bool readLength(const uint8_t*& ip, const uint8_t* end, size_t& length) {
+        uint8_t byte;
+        do {
+            if (ip >= end) return false;
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    // Bounds-checked on every step, as the input may come off the wire
+    bool decompressBlock(const uint8_t* src, size_t size, uint8_t* dst, size_t dst_size) {
+        const uint8_t* ip = src;
+        const uint8_t* end = src + size;
+        uint8_t* op = dst;
+        uint8_t* op_end = dst + dst_size;
+
+        while (ip < end) {
+            uint8_t token = *ip++;
+
+            size_t literals = token >> 4;
+            if (literals == 15 && !readLength(ip, end, literals)) return false;
+            if (literals > static_cast<size_t>(end - ip) || literals > static_cast<size_t>(op_end - op)) {
+                return false;
+            }
+            std::memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+
+            // The last sequence has no match
+            if (ip == end) break;
+
+            if (end - ip < 2) return false;
+            size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            if (offset == 0 || offset > static_cast<size_t>(op - dst)) return false;
+
+            size_t length = token & 15;
+            if (length == 15 && !readLength(ip, end, length)) return false;
+            length += kMinMatch;
+            if (length > static_cast<size_t>(op_end - op)) return false;
+
+            // Overlapping matches repeat the bytes just written
+            const uint8_t* match = op - offset;
+            if (offset >= length) {
+                std::memcpy(op, match, length);
+                op += length;
+            } else {
+                for (size_t i = 0; i < length; ++i) {
+                    *op++ = *match++;
+                }
+            }
+        }
+        return op == op_end;
+    }
+}
+
+bool Compression::compress(std::string_view value, std::string& out) {
+    if (value.size() > UINT32_MAX) return false;
+
+    out.resize(kSizeField + maxBlockSize(value.size()));
+    uint8_t* dst = reinterpret_cast<uint8_t*>(out.data());
+    uint32_t size = static_cast<uint32_t>(value.size());
+    dst[0] = static_cast<uint8_t>(size >> 24);
+    dst[1] = static_cast<uint8_t>(size >> 16);
+    dst[2] = static_cast<uint8_t>(size >> 8);
+    dst[3] = static_cast<uint8_t>(size);
+
+    size_t block = compressBlock(reinterpret_cast<const uint8_t*>(value.data()), value.size(),
+                                 dst + kSizeField);
+    out.resize(kSizeField + block);
+    return out.size() <= value.size() - value.size() / 8;
+}
+
+size_t Compression::originalSize(std::string_view compressed) {
+    if (compressed.size() < kSizeField) return 0;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(compressed.data());
+    return (static_cast<size_t>(p[0]) << 24) | (static_cast<size_t>(p[1]) << 16) |
+           (static_cast<size_t>(p[2]) << 8) | p[3];
+}
+
+bool Compression::decompress(std::string_view compressed, std::string& out) {
+    if (compressed.size() < kSizeField + 1) return false;
+
+    out.resize(originalSize(compressed));
+    return decompressBlock(reinterpret_cast<const uint8_t*>(compressed.data()) + kSizeField,
+                           compressed.size() - kSizeField,
+                           reinterpret_cast<uint8_t*>(out.data()), out.size());
+}
+
+} // namespace kvstore
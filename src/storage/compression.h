@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+namespace kvstore {
+
+    // Value compression with a self-contained implementation of the LZ4
+    // block format: byte-aligned, no entropy coding, so decompression runs
+    // at memory speed. A compressed value is [raw_size(4)][LZ4 block].
+    // Stored entries, WAL and snapshot records and replies each carry a flag
+    // saying whether their value is in this form.
+    class Compression {
+    public:
+        // Compresses value into out. Returns false, with out unspecified, if
+        // that would not save at least an eighth of the size.
+        static bool compress(std::string_view value, std::string& out);
+
+        // Restores the original value; false if compressed is malformed
+        static bool decompress(std::string_view compressed, std::string& out);
+
+        // Size of the value compressed holds, without decompressing it
+        static size_t originalSize(std::string_view compressed);
+    };
+
+} // namespace kvstore
@@ -0,0 +1,83 @@
+#include "crc32c.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace kvstore {
+
+namespace {
+    constexpr uint32_t kPolynomial = 0x82F63B78;  // reflected
+
+    constexpr std::array<uint32_t, 256> makeTable() {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (crc & 1 ? kPolynomial : 0);
+            }
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    constexpr std::array<uint32_t, 256> kTable = makeTable();
+
+    uint32_t crc32cSoftware(uint32_t crc, const uint8_t* p, size_t n) {
+        while (n--) {
+            crc = kTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    uint32_t crc32cHardware(uint32_t crc, const uint8_t* p, size_t n) {
+        uint64_t crc64 = crc;
+        for (; n >= 8; n -= 8, p += 8) {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+        crc = static_cast<uint32_t>(crc64);
+        while (n--) {
+            crc = _mm_crc32_u8(crc, *p++);
+        }
+        return crc;
+    }
+
+    const bool kHaveHardware = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    uint32_t crc32cHardware(uint32_t crc, const uint8_t* p, size_t n) {
+        for (; n >= 8; n -= 8, p += 8) {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            crc = __crc32cd(crc, word);
+        }
+        while (n--) {
+            crc = __crc32cb(crc, *p++);
+        }
+        return crc;
+    }
+
+    const bool kHaveHardware = true;
+#endif
+}
+
+uint32_t crc32c(const void* data, size_t size, uint32_t crc) {
+    const auto* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+    if (kHaveHardware) {
+        return ~crc32cHardware(crc, p, size);
+    }
+#endif
+    return ~crc32cSoftware(crc, p, size);
+}
+
+} // namespace kvstore
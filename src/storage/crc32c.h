@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace kvstore {
+
+    // CRC-32C (Castagnoli), as used by iSCSI, ext4 and most storage
+    // engines. Uses the CPU's CRC32 instruction when it has one (SSE4.2 on
+    // x86-64, the CRC extension on AArch64) and a lookup table otherwise.
+    // Pass a previous result as crc to continue a checksum over more data.
+    uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+} // namespace kvstore
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <memory>
+#include <new>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace kvstore {
+
+    // Immutable string in 24 bytes. Up to 23 bytes are stored inline, so
+    // typical keys need no allocation of their own; longer ones get exactly
+    // one allocation of their length.
+    class CompactString {
+    public:
+        static constexpr size_t kInlineCapacity = 23;
+
+        CompactString() { buf_[kTag] = 0; }
+
+        explicit CompactString(std::string_view s) {
+            if (s.size() <= kInlineCapacity) {
+                std::memcpy(buf_, s.data(), s.size());
+                buf_[kTag] = static_cast<char>(s.size());
+            } else {
+                char* ptr = new char[s.size()];
+                std::memcpy(ptr, s.data(), s.size());
+                size_t size = s.size();
+                std::memcpy(buf_, &ptr, sizeof(ptr));
+                std::memcpy(buf_ + sizeof(ptr), &size, sizeof(size));
+                buf_[kTag] = kHeapTag;
+            }
+        }
+
+        ~CompactString() {
+            if (onHeap()) {
+                delete[] heapPtr();
+            }
+        }
+
+        CompactString(CompactString&& other) noexcept {
+            std::memcpy(buf_, other.buf_, sizeof(buf_));
+            other.buf_[kTag] = 0;
+        }
+
+        CompactString& operator=(CompactString&& other) noexcept {
+            if (this != &other) {
+                if (onHeap()) delete[] heapPtr();
+                std::memcpy(buf_, other.buf_, sizeof(buf_));
+                other.buf_[kTag] = 0;
+            }
+            return *this;
+        }
+
+        CompactString(const CompactString&) = delete;
+        CompactString& operator=(const CompactString&) = delete;
+
+        std::string_view view() const {
+            if (onHeap()) {
+                size_t size;
+                std::memcpy(&size, buf_ + sizeof(char*), sizeof(size));
+                return std::string_view(heapPtr(), size);
+            }
+            return std::string_view(buf_, static_cast<uint8_t>(buf_[kTag]));
+        }
+
+        // Bytes allocated outside the object
+        size_t heapBytes() const { return onHeap() ? view().size() : 0; }
+
+    private:
+        static constexpr size_t kTag = 23;
+        static constexpr char kHeapTag = static_cast<char>(0xff);
+
+        bool onHeap() const { return buf_[kTag] == kHeapTag; }
+
+        char* heapPtr() const {
+            char* ptr;
+            std::memcpy(&ptr, buf_, sizeof(ptr));
+            return ptr;
+        }
+
+        alignas(8) char buf_[24];
+    };
+
+    // Open-addressing hash map from string keys to V, in the style of
+    // Abseil's Swiss tables. Slots are stored flat in one array alongside a
+    // parallel array of control bytes: each holds 7 bits of the key's hash
+    // for a full slot, or marks it empty or deleted. A lookup probes groups
+    // of 16 control bytes at a time (one SSE2 compare where available) and
+    // only touches a slot whose hash bits match, so most lookups read one
+    // control group and one slot.
+    //
+    // Growing is incremental: the old table is kept alongside the new one
+    // and each insert or erase moves a couple of groups across, so no single
+    // operation pays for rehashing the whole table. Lookups check both.
+    //
+    // Pointers to slots are invalidated by any insert or erase.
+    template <typename V>
+    class FlatMap {
+    public:
+        struct Slot {
+            CompactString key;
+            V value;
+        };
+
+        FlatMap() = default;
+        ~FlatMap() { clear(); }
+
+        FlatMap(const FlatMap&) = delete;
+        FlatMap& operator=(const FlatMap&) = delete;
+
+        size_t size() const { return current_.size + old_.size; }
+        bool empty() const { return size() == 0; }
+
+        Slot* find(std::string_view key) {
+            return const_cast<Slot*>(static_cast<const FlatMap*>(this)->find(key));
+        }
+
+        const Slot* find(std::string_view key) const {
+            uint64_t hash = hashOf(key);
+            if (const Slot* slot = current_.find(key, hash)) return slot;
+            return old_.capacity ? old_.find(key, hash) : nullptr;
+        }
+
+        // Returns the slot for key and whether it was newly inserted with a
+        // default-constructed value
+        std::pair<Slot*, bool> tryEmplace(std::string_view key) {
+            migrateStep();
+
+            uint64_t hash = hashOf(key);
+            if (Slot* slot = current_.find(key, hash)) {
+                return {slot, false};
+            }
+
+            // Starting a resize leaves current_ empty, so the check above
+            // still holds afterwards
+            reserveOne();
+
+            // Still in the old table: move it over now
+            if (old_.capacity) {
+                if (Slot* slot = old_.find(key, hash)) {
+                    Slot* moved = current_.insert(hash, std::move(*slot));
+                    old_.erase(slot);
+                    return {moved, false};
+                }
+            }
+
+            return {current_.insert(hash, Slot{CompactString(key), V()}), true};
+        }
+
+        bool erase(std::string_view key) {
+            Slot* slot = find(key);
+            if (!slot) return false;
+            erase(slot);
+            return true;
+        }
+
+        void erase(Slot* slot) {
+            if (current_.owns(slot)) {
+                current_.erase(slot);
+            } else {
+                old_.erase(slot);
+            }
+            migrateStep();
+        }
+
+        void clear() {
+            current_.release();
+            old_.release();
+            migrate_group_ = 0;
+        }
+
+        // Exchange contents; slot pointers follow their entries
+        void swap(FlatMap& other) noexcept {
+            std::swap(current_, other.current_);
+            std::swap(old_, other.old_);
+            std::swap(migrate_group_, other.migrate_group_);
+        }
+
+        // Calls fn(const Slot&) for every entry, in no particular order
+        template <typename Fn>
+        void forEach(Fn&& fn) const {
+            current_.forEach(fn);
+            old_.forEach(fn);
+        }
+
+        // A pseudo-random entry, or nullptr if the map is empty. Entries
+        // right after a run of empty slots are slightly favoured.
+        template <typename Rng>
+        Slot* sample(Rng& rng) {
+            size_t total = size();
+            if (total == 0) return nullptr;
+            Table& table = static_cast<size_t>(rng() % total) < current_.size ? current_ : old_;
+            return table.sampleFrom(static_cast<size_t>(rng()));
+        }
+
+        // Bytes held by the slot and control arrays
+        size_t tableBytes() const {
+            return (current_.capacity + old_.capacity) * (sizeof(Slot) + 1);
+        }
+
+    private:
+        static constexpr size_t kGroupSize = 16;
+        static constexpr size_t kInitialCapacity = 16;
+
+        // Groups moved from the old table per insert or erase. The new table
+        // has twice the capacity, so the old one is always drained well
+        // before the new one fills up.
+        static constexpr size_t kMigrateGroups = 2;
+
+        static constexpr int8_t kEmpty = -128;
+        static constexpr int8_t kDeleted = -2;
+
+        // Bitmask of the control bytes in a group that match a condition
+        struct Group {
+            explicit Group(const int8_t* ctrl) : ctrl_(ctrl) {}
+
+#ifdef __SSE2__
+            uint32_t match(int8_t h2) const {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl_));
+                return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), bytes)));
+            }
+
+            // Empty and deleted are the only negative values below -1
+            uint32_t matchFree() const {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl_));
+                return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), bytes)));
+            }
+#else
+            uint32_t match(int8_t h2) const {
+                uint32_t mask = 0;
+                for (size_t i = 0; i < kGroupSize; ++i) {
+                    if (ctrl_[i] == h2) mask |= 1u << i;
+                }
+                return mask;
+            }
+
+            uint32_t matchFree() const {
+                uint32_t mask = 0;
+                for (size_t i = 0; i < kGroupSize; ++i) {
+                    if (ctrl_[i] < -1) mask |= 1u << i;
+                }
+                return mask;
+            }
+#endif
+            uint32_t matchEmpty() const { return match(kEmpty); }
+
+            const int8_t* ctrl_;
+        };
+
+        struct Table {
+            int8_t* ctrl = nullptr;
+            Slot* slots = nullptr;
+            size_t capacity = 0;     // a power of two, multiple of kGroupSize
+            size_t size = 0;
+            size_t deleted = 0;
+
+            size_t groupMask() const { return capacity / kGroupSize - 1; }
+
+            bool owns(const Slot* slot) const {
+                return slot >= slots && slot < slots + capacity;
+            }
+
+            void allocate(size_t cap) {
+                capacity = cap;
+                ctrl = new int8_t[cap];
+                std::memset(ctrl, static_cast<uint8_t>(kEmpty), cap);
+                slots = static_cast<Slot*>(::operator new(cap * sizeof(Slot), std::align_val_t(alignof(Slot))));
+            }
+
+            void release() {
+                if (!capacity) return;
+                for (size_t i = 0; i < capacity; ++i) {
+                    if (ctrl[i] >= 0) slots[i].~Slot();
+                }
+                delete[] ctrl;
+                ::operator delete(slots, std::align_val_t(alignof(Slot)));
+                *this = Table();
+            }
+
+            // Quadratic probing over groups: visits every group once
+            template <typename Visit>
+            const Slot* probe(uint64_t hash, Visit&& visit) const {
+                size_t group = (hash >> 7) & groupMask();
+                for (size_t step = 1; step <= capacity / kGroupSize; ++step) {
+                    const Slot* found = nullptr;
+                    if (visit(group, found)) return found;
+                    group = (group + step) & groupMask();
+                }
+                return nullptr;
+            }
+
+            const Slot* find(std::string_view key, uint64_t hash) const {
+                if (!capacity) return nullptr;
+                int8_t h2 = static_cast<int8_t>(hash & 0x7f);
+                return probe(hash, [&](size_t group, const Slot*& found) {
+                    size_t base = group * kGroupSize;
+                    Group g(ctrl + base);
+                    for (uint32_t mask = g.match(h2); mask; mask &= mask - 1) {
+                        size_t i = base + static_cast<size_t>(__builtin_ctz(mask));
+                        if (slots[i].key.view() == key) {
+                            found = &slots[i];
+                            return true;
+                        }
+                    }
+                    // An empty slot ends the probe sequence
+                    return g.matchEmpty() != 0;
+                });
+            }
+
+            Slot* find(std::string_view key, uint64_t hash) {
+                return const_cast<Slot*>(static_cast<const Table*>(this)->find(key, hash));
+            }
+
+            // The key must not be present and there must be room
+            Slot* insert(uint64_t hash, Slot&& entry) {
+                size_t index = 0;
+                probe(hash, [&](size_t group, const Slot*&) {
+                    uint32_t mask = Group(ctrl + group * kGroupSize).matchFree();
+                    if (!mask) return false;
+                    index = group * kGroupSize + static_cast<size_t>(__builtin_ctz(mask));
+                    return true;
+                });
+
+                if (ctrl[index] == kDeleted) --deleted;
+                ctrl[index] = static_cast<int8_t>(hash & 0x7f);
+                ++size;
+                return new (&slots[index]) Slot(std::move(entry));
+            }
+
+            void erase(Slot* slot) {
+                size_t index = static_cast<size_t>(slot - slots);
+                slot->~Slot();
+                --size;
+
+                // If the group still has an empty slot, no probe sequence
+                // ever continued past it, so this slot can become empty too
+                size_t base = index & ~(kGroupSize - 1);
+                if (Group(ctrl + base).matchEmpty()) {
+                    ctrl[index] = kEmpty;
+                } else {
+                    ctrl[index] = kDeleted;
+                    ++deleted;
+                }
+            }
+
+            template <typename Fn>
+            void forEach(Fn& fn) const {
+                for (size_t i = 0; i < capacity; ++i) {
+                    if (ctrl[i] >= 0) fn(static_cast<const Slot&>(slots[i]));
+                }
+            }
+
+            Slot* sampleFrom(size_t start) {
+                for (size_t n = 0; n < capacity; ++n) {
+                    size_t i = (start + n) & (capacity - 1);
+                    if (ctrl[i] >= 0) return &slots[i];
+                }
+                return nullptr;
+            }
+        };
+
+        Table current_;
+        Table old_;               // being drained into current_, if capacity != 0
+        size_t migrate_group_ = 0;
+
+        static uint64_t hashOf(std::string_view key) {
+            // The store picks shards by the same std::hash, so the low bits
+            // are shared by every key in a map; mix them all before use
+            uint64_t h = std::hash<std::string_view>{}(key);
+            __uint128_t m = static_cast<__uint128_t>(h) * 0x9E3779B97F4A7C15ULL;
+            return static_cast<uint64_t>(m) ^ static_cast<uint64_t>(m >> 64);
+        }
+
+        // Make room for one more entry in current_, starting a resize if the
+        // load factor would pass 7/8
+        void reserveOne() {
+            if (!current_.capacity) {
+                current_.allocate(kInitialCapacity);
+                return;
+            }
+            if ((current_.size + current_.deleted + 1) * 8 <= current_.capacity * 7) {
+                return;
+            }
+
+            // A resize is still running (only possible if the table was
+            // mostly tombstones); finish it before starting another
+            while (old_.capacity) {
+                migrateStep();
+            }
+
+            // Mostly deleted slots: rebuild at the same size instead of growing
+            size_t capacity = current_.capacity;
+            if ((current_.size + 1) * 16 > capacity * 7) {
+                capacity *= 2;
+            }
+
+            old_ = current_;
+            current_ = Table();
+            current_.allocate(capacity);
+            migrate_group_ = 0;
+        }
+
+        void migrateStep() {
+            if (!old_.capacity) return;
+
+            size_t groups = old_.capacity / kGroupSize;
+            for (size_t n = 0; n < kMigrateGroups && migrate_group_ < groups; ++n, ++migrate_group_) {
+                size_t base = migrate_group_ * kGroupSize;
+                for (size_t i = base; i < base + kGroupSize; ++i) {
+                    if (old_.ctrl[i] < 0) continue;
+                    Slot& slot = old_.slots[i];
+                    current_.insert(hashOf(slot.key.view()), std::move(slot));
+                    old_.erase(&slot);
+                }
+            }
+
+            if (migrate_group_ == groups) {
+                old_.release();
+                migrate_group_ = 0;
+            }
+        }
+    };
+
+} // namespace kvstore
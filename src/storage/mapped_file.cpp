@@ -0,0 +1,49 @@
+#include "mapped_file.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace kvstore {
+
+MappedFile::MappedFile(const std::string& path) : path_(path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st{};
+    if (::fstat(fd, &st) != 0) {
+        std::cerr << "fstat error on " << path << ": " << strerror(errno) << std::endl;
+        ::close(fd);
+        return;
+    }
+
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+        void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            std::cerr << "mmap error on " << path << ": " << strerror(errno) << std::endl;
+            ::close(fd);
+            size_ = 0;
+            return;
+        }
+        ::madvise(addr, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const uint8_t*>(addr);
+    }
+
+    // The mapping keeps the file contents reachable on its own
+    ::close(fd);
+    open_ = true;
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+}
+
+} // namespace kvstore
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace kvstore {
+
+    // Read-only, sequentially-advised mmap of a whole file. Used by recovery
+    // so log and snapshot records can be applied straight out of the page
+    // cache without being copied into intermediate buffers first.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const std::string& path() const { return path_; }
+        bool isOpen() const { return open_; }
+        const uint8_t* data() const { return data_; }
+        size_t size() const { return size_; }
+
+    private:
+        std::string path_;
+        bool open_ = false;
+        const uint8_t* data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+} // namespace kvstore
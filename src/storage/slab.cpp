@@ -0,0 +1,304 @@
+#include "slab.h"
+#include <sys/mman.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <cstring>
+#include <utility>
+#include <cstdint>
+
+namespace kvstore {
+
+    // One mapping of kArenaSize bytes, split into pages. Kept apart from
+    // the mapping so that pages handed back stay untouched.
+    struct SlabAllocator::Arena {
+        Arena* prev = nullptr;
+        Arena* next = nullptr;
+        char* base = nullptr;
+        char* bump = nullptr;              // next page never handed out
+        std::vector<char*> free_pages;     // handed back, memory released
+        size_t used = 0;                   // pages handed out
+
+        bool hasRoom() const { return !free_pages.empty() || bump != base + kArenaSize; }
+    };
+
+    // Lives at the start of its page; chunks follow it
+    struct SlabAllocator::Page {
+        Page* prev = nullptr;
+        Page* next = nullptr;
+        Arena* arena = nullptr;
+        char* free = nullptr;    // freed chunks, linked through their first bytes
+        char* bump = nullptr;    // next chunk never handed out
+        char* end = nullptr;     // past the last whole chunk
+        uint32_t used = 0;
+        uint32_t size_class = 0;
+        uint32_t chunk_size = 0;
+
+        bool isFull() const { return !free && bump == end; }
+    };
+
+    namespace {
+        // Room for the Page header; chunks follow, 16-byte aligned like every
+        // class size
+        constexpr size_t kHeaderSize = 64;
+    }
+
+    SlabAllocator::SlabAllocator() : classes_(classSizes().size()) {
+        static_assert(kHeaderSize >= sizeof(Page), "page header too large");
+    }
+
+    SlabAllocator::~SlabAllocator() {
+        for (Arena* head : {available_, exhausted_}) {
+            while (head) {
+                Arena* next = head->next;
+                ::munmap(head->base, kArenaSize);
+                delete head;
+                head = next;
+            }
+        }
+    }
+
+    void SlabAllocator::swap(SlabAllocator& other) noexcept {
+        // Pages and arenas point at each other, never at the allocator
+        classes_.swap(other.classes_);
+        std::swap(available_, other.available_);
+        std::swap(exhausted_, other.exhausted_);
+        std::swap(arenas_, other.arenas_);
+        std::swap(allocated_, other.allocated_);
+        std::swap(large_bytes_, other.large_bytes_);
+        std::swap(pages_, other.pages_);
+        std::swap(carved_, other.carved_);
+    }
+
+    const std::vector<size_t>& SlabAllocator::classSizes() {
+        // Steps of 16 bytes up to 128, then four classes per power of two,
+        // so a chunk wastes at most about 20% of its size
+        static const std::vector<size_t> sizes = [] {
+            std::vector<size_t> result;
+            for (size_t size = 16; size <= 128; size += 16) {
+                result.push_back(size);
+            }
+            for (size_t base = 128; base < kMaxChunkSize; base *= 2) {
+                for (size_t step = 1; step <= 4; ++step) {
+                    result.push_back(base + base / 4 * step);
+                }
+            }
+            return result;
+        }();
+        return sizes;
+    }
+
+    size_t SlabAllocator::classIndex(size_t size) {
+        if (size <= 128) {
+            return (size - 1) / 16;
+        }
+        const auto& sizes = classSizes();
+        return static_cast<size_t>(std::lower_bound(sizes.begin(), sizes.end(), size) - sizes.begin());
+    }
+
+    size_t SlabAllocator::capacityFor(size_t size) {
+        if (size == 0 || size > kMaxChunkSize) {
+            return size;
+        }
+        return classSizes()[classIndex(size)];
+    }
+
+    size_t SlabAllocator::chunksPerPage(size_t chunk_size) {
+        return (kPageSize - kHeaderSize) / chunk_size;
+    }
+
+    template <typename Node>
+    void SlabAllocator::unlink(Node*& head, Node* node) {
+        if (node->prev) node->prev->next = node->next;
+        if (node->next) node->next->prev = node->prev;
+        if (head == node) head = node->next;
+        node->prev = nullptr;
+        node->next = nullptr;
+    }
+
+    template <typename Node>
+    void SlabAllocator::push(Node*& head, Node* node) {
+        node->prev = nullptr;
+        node->next = head;
+        if (head) head->prev = node;
+        head = node;
+    }
+
+    SlabAllocator::Arena* SlabAllocator::newArena() {
+        auto arena = std::make_unique<Arena>();
+        arena->free_pages.reserve(kArenaSize / kPageSize);
+
+        // Map a page more than needed and trim, so every page is aligned to
+        // its size and a chunk's page is found by masking its address
+        size_t span = kArenaSize + kPageSize;
+        void* raw = ::mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return nullptr;
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = (start + kPageSize - 1) & ~(kPageSize - 1);
+        if (aligned > start) {
+            ::munmap(raw, aligned - start);
+        }
+        if (aligned + kArenaSize < start + span) {
+            ::munmap(reinterpret_cast<void*>(aligned + kArenaSize), start + span - aligned - kArenaSize);
+        }
+
+        arena->base = reinterpret_cast<char*>(aligned);
+        arena->bump = arena->base;
+        ++arenas_;
+        return arena.release();
+    }
+
+    void SlabAllocator::releaseArena(Arena* arena) {
+        unlink(available_, arena);
+        ::munmap(arena->base, kArenaSize);
+        delete arena;
+        --arenas_;
+    }
+
+    SlabAllocator::Page* SlabAllocator::newPage(size_t index) {
+        Arena* arena = available_;
+        if (!arena) {
+            arena = newArena();
+            if (!arena) {
+                return nullptr;
+            }
+            push(available_, arena);
+        }
+
+        char* base;
+        if (!arena->free_pages.empty()) {
+            base = arena->free_pages.back();
+            arena->free_pages.pop_back();
+        } else {
+            base = arena->bump;
+            arena->bump += kPageSize;
+        }
+        ++arena->used;
+        if (!arena->hasRoom()) {
+            unlink(available_, arena);
+            push(exhausted_, arena);
+        }
+
+        // Chunks are carved lazily, so untouched ones never become resident
+        size_t chunk_size = classSizes()[index];
+        Page* page = new (base) Page();
+        page->arena = arena;
+        page->size_class = static_cast<uint32_t>(index);
+        page->chunk_size = static_cast<uint32_t>(chunk_size);
+        page->bump = base + kHeaderSize;
+        page->end = page->bump + chunksPerPage(chunk_size) * chunk_size;
+        carved_ += kHeaderSize;
+
+        ++classes_[index].pages;
+        ++pages_;
+        return page;
+    }
+
+    void SlabAllocator::releasePage(Page* page) {
+        --classes_[page->size_class].pages;
+        --pages_;
+        carved_ -= static_cast<size_t>(page->bump - reinterpret_cast<char*>(page));
+
+        Arena* arena = page->arena;
+        if (!arena->hasRoom()) {
+            unlink(exhausted_, arena);
+            push(available_, arena);
+        }
+
+        // Keep one arena mapped even when it is empty, like a class's last
+        // page. Other pages keep their mapping but not their memory.
+        if (--arena->used == 0 && arenas_ > 1) {
+            releaseArena(arena);
+            return;
+        }
+        ::madvise(page, kPageSize, MADV_DONTNEED);
+        arena->free_pages.push_back(reinterpret_cast<char*>(page));
+    }
+
+    char* SlabAllocator::allocate(size_t size) {
+        if (size > kMaxChunkSize) {
+            char* ptr = static_cast<char*>(::operator new(size));
+            large_bytes_ += size;
+            allocated_ += size;
+            return ptr;
+        }
+
+        size_t index = classIndex(size);
+        ClassState& cls = classes_[index];
+        Page* page = cls.partial;
+        if (!page) {
+            page = newPage(index);
+            if (!page) {
+                throw std::bad_alloc();
+            }
+            push(cls.partial, page);
+        }
+
+        char* chunk;
+        if (page->free) {
+            chunk = page->free;
+            std::memcpy(&page->free, chunk, sizeof(char*));
+        } else {
+            chunk = page->bump;
+            page->bump += page->chunk_size;
+            carved_ += page->chunk_size;
+        }
+        ++page->used;
+        ++cls.used_chunks;
+        allocated_ += page->chunk_size;
+
+        if (page->isFull()) {
+            unlink(cls.partial, page);
+            push(cls.full, page);
+        }
+        return chunk;
+    }
+
+    void SlabAllocator::deallocate(char* ptr, size_t capacity) {
+        if (capacity > kMaxChunkSize) {
+            ::operator delete(ptr);
+            large_bytes_ -= capacity;
+            allocated_ -= capacity;
+            return;
+        }
+
+        Page* page = reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(ptr) & ~(kPageSize - 1));
+        ClassState& cls = classes_[page->size_class];
+        if (page->isFull()) {
+            unlink(cls.full, page);
+            push(cls.partial, page);
+        }
+
+        std::memcpy(ptr, &page->free, sizeof(char*));
+        page->free = ptr;
+        --page->used;
+        --cls.used_chunks;
+        allocated_ -= page->chunk_size;
+
+        // Keep a class's last page so a key that is repeatedly set and
+        // deleted does not map and unmap a page each time
+        if (page->used == 0 && cls.pages > 1) {
+            unlink(cls.partial, page);
+            releasePage(page);
+        }
+    }
+
+    void SlabAllocator::addStats(Stats& stats) const {
+        const auto& sizes = classSizes();
+        stats.classes.resize(sizes.size());
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            ClassStats& out = stats.classes[i];
+            out.chunk_size = sizes[i];
+            out.pages += classes_[i].pages;
+            out.used_chunks += classes_[i].used_chunks;
+            out.free_chunks += classes_[i].pages * chunksPerPage(sizes[i]) - classes_[i].used_chunks;
+        }
+        stats.allocated += allocated_;
+        stats.reserved += arenas_ * kArenaSize + large_bytes_;
+        stats.touched += carved_ + large_bytes_;
+        stats.pages += pages_;
+    }
+
+} // namespace kvstore
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace kvstore {
+
+    // Size-classed allocator for stored values. Memory is mapped from the OS
+    // in 4 MiB arenas and handed out in 64 KiB pages, each dedicated to one
+    // size class and carved into equal chunks on demand; freed chunks go
+    // back on their page's free list. A page whose last chunk is freed
+    // (unless it is its class's only page) goes back to its arena and its
+    // memory to the OS, and an arena with no pages left is unmapped, so
+    // memory held tracks the live data instead of the high-water mark, and
+    // churn cannot fragment the general-purpose heap. One mapping per arena
+    // keeps even a large store far below the kernel's limit on mappings.
+    // Values larger than the biggest class are allocated individually.
+    //
+    // Not thread-safe: each shard owns one and uses it under its lock. The
+    // destructor frees all pages, but large allocations must have been
+    // deallocated by then.
+    class SlabAllocator {
+    public:
+        SlabAllocator();
+        ~SlabAllocator();
+
+        SlabAllocator(const SlabAllocator&) = delete;
+        SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+        // Storage for size bytes (size > 0). The chunk may be larger; its
+        // real size is capacityFor(size), which deallocate() must be given.
+        // Throws std::bad_alloc if the OS has no memory to map.
+        char* allocate(size_t size);
+        void deallocate(char* ptr, size_t capacity);
+
+        static size_t capacityFor(size_t size);
+
+        // Exchange every page and allocation with other; chunks handed out
+        // by one are then deallocated through the other
+        void swap(SlabAllocator& other) noexcept;
+
+        struct ClassStats {
+            size_t chunk_size = 0;
+            size_t pages = 0;
+            size_t used_chunks = 0;
+            size_t free_chunks = 0;   // carved or not, on this class's pages
+        };
+
+        struct Stats {
+            size_t allocated = 0;   // bytes in chunks and large allocations in use
+            size_t reserved = 0;    // bytes of arenas mapped plus large allocations
+            size_t touched = 0;     // reserved minus never-carved page space,
+                                    // which the OS does not back with memory
+            size_t pages = 0;
+            std::vector<ClassStats> classes;
+        };
+
+        // Adds this allocator's figures to stats
+        void addStats(Stats& stats) const;
+
+        static constexpr size_t kPageSize = 64 * 1024;
+        static constexpr size_t kArenaSize = 4 * 1024 * 1024;
+
+        // Largest size served from pages; a page holds at least three chunks
+        static constexpr size_t kMaxChunkSize = 16 * 1024;
+
+    private:
+        struct Page;
+        struct Arena;
+        struct ClassState {
+            Page* partial = nullptr;   // pages with a free or uncarved chunk
+            Page* full = nullptr;
+            size_t pages = 0;
+            size_t used_chunks = 0;
+        };
+
+        std::vector<ClassState> classes_;
+        Arena* available_ = nullptr;   // arenas with a page to give out
+        Arena* exhausted_ = nullptr;
+        size_t arenas_ = 0;
+        size_t allocated_ = 0;
+        size_t large_bytes_ = 0;
+        size_t pages_ = 0;
+        size_t carved_ = 0;      // page bytes up to each page's bump pointer
+
+        static size_t classIndex(size_t size);
+        static const std::vector<size_t>& classSizes();
+        static size_t chunksPerPage(size_t chunk_size);
+
+        Page* newPage(size_t index);
+        void releasePage(Page* page);
+        Arena* newArena();
+        void releaseArena(Arena* arena);
+
+        // Intrusive doubly linked lists of pages or arenas
+        template <typename Node>
+        static void unlink(Node*& head, Node* node);
+        template <typename Node>
+        static void push(Node*& head, Node* node);
+    };
+
+} // namespace kvstore
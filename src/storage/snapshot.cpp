@@ -0,0 +1,228 @@
+#include "snapshot.h"
+#include "mapped_file.h"
+#include "wal.h"
+#include "crc32c.h"
+#include "compression.h"
+#include <iostream>
+#include <filesystem>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace kvstore {
+
+namespace {
+    const char kMagic[6] = {'K', 'V', 'S', 'N', 'A', 'P'};
+    constexpr uint16_t kVersion = 4;
+    constexpr uint8_t kFlagCompressed = 1;
+    constexpr size_t kHeaderSize = 16;
+    constexpr size_t kFlushThreshold = 1024 * 1024;
+
+    void putUint32(std::vector<uint8_t>& buf, uint32_t val) {
+        uint32_t net_val = htonl(val);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&net_val);
+        buf.insert(buf.end(), bytes, bytes + 4);
+    }
+
+    void putUint64(std::vector<uint8_t>& buf, uint64_t val) {
+        putUint32(buf, static_cast<uint32_t>(val >> 32));
+        putUint32(buf, static_cast<uint32_t>(val));
+    }
+
+    void fsyncParentDir(const std::string& path) {
+        std::filesystem::path p(path);
+        std::filesystem::path dir = p.has_parent_path() ? p.parent_path() : std::filesystem::path(".");
+        int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            ::fsync(dir_fd);
+            ::close(dir_fd);
+        }
+    }
+}
+
+SnapshotWriter::SnapshotWriter(const std::string& path, uint64_t last_segment)
+    : path_(path), tmp_path_(path + ".tmp") {
+    fd_ = ::open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        std::cerr << "Failed to create snapshot " << tmp_path_
+                  << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    buffer_.reserve(kFlushThreshold + 4096);
+    buffer_.insert(buffer_.end(), kMagic, kMagic + sizeof(kMagic));
+    buffer_.push_back(static_cast<uint8_t>(kVersion >> 8));
+    buffer_.push_back(static_cast<uint8_t>(kVersion));
+    putUint64(buffer_, last_segment);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    // Not committed: throw the partial file away
+    if (fd_ >= 0) {
+        ::close(fd_);
+        ::unlink(tmp_path_.c_str());
+    }
+}
+
+void SnapshotWriter::flushBuffer() {
+    size_t written = 0;
+    while (!failed_ && written < buffer_.size()) {
+        ssize_t n = ::write(fd_, buffer_.data() + written, buffer_.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Snapshot write error: " << strerror(errno) << std::endl;
+            failed_ = true;
+            break;
+        }
+        written += static_cast<size_t>(n);
+    }
+    buffer_.clear();
+}
+
+void SnapshotWriter::add(std::string_view key, std::string_view value, int64_t deadline_ms, bool compressed) {
+    if (!ok()) return;
+
+    size_t start = buffer_.size();
+    putUint32(buffer_, 0);   // checksum, filled in below
+    putUint32(buffer_, key.size());
+    buffer_.insert(buffer_.end(), key.begin(), key.end());
+    putUint32(buffer_, value.size());
+    buffer_.insert(buffer_.end(), value.begin(), value.end());
+
+    char deadline[WAL::kDeadlineSize];
+    WAL::encodeDeadline(deadline_ms, deadline);
+    buffer_.insert(buffer_.end(), deadline, deadline + sizeof(deadline));
+    buffer_.push_back(compressed ? kFlagCompressed : 0);
+
+    uint32_t net_crc = htonl(crc32c(buffer_.data() + start + 4, buffer_.size() - start - 4));
+    std::memcpy(buffer_.data() + start, &net_crc, 4);
+    ++count_;
+
+    if (buffer_.size() >= kFlushThreshold) {
+        flushBuffer();
+    }
+}
+
+bool SnapshotWriter::commit() {
+    if (!ok()) return false;
+
+    flushBuffer();
+    if (!failed_ && ::fsync(fd_) != 0) {
+        std::cerr << "Snapshot fsync error: " << strerror(errno) << std::endl;
+        failed_ = true;
+    }
+
+    ::close(fd_);
+    fd_ = -1;
+
+    if (failed_) {
+        ::unlink(tmp_path_.c_str());
+        return false;
+    }
+
+    if (std::rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+        std::cerr << "Snapshot rename error: " << strerror(errno) << std::endl;
+        ::unlink(tmp_path_.c_str());
+        return false;
+    }
+
+    fsyncParentDir(path_);
+    return true;
+}
+
+bool Snapshot::load(const MappedFile& file, uint64_t& last_segment, const Visitor& visit, bool& damaged) {
+    const std::string& path = file.path();
+    damaged = false;
+    if (!file.isOpen()) {
+        std::error_code ec;
+        if (std::filesystem::exists(path, ec)) {
+            std::cerr << "Cannot read snapshot: " << path << std::endl;
+            damaged = true;
+        }
+        return false;
+    }
+
+    const uint8_t* data = file.data();
+    const size_t size = file.size();
+
+    if (size < kHeaderSize || std::memcmp(data, kMagic, sizeof(kMagic)) != 0) {
+        std::cerr << "Invalid snapshot: " << path << std::endl;
+        damaged = true;
+        return false;
+    }
+
+    uint16_t version = static_cast<uint16_t>((data[6] << 8) | data[7]);
+    if (version < 1 || version > kVersion) {
+        std::cerr << "Unsupported snapshot version " << version << ": " << path << std::endl;
+        damaged = true;
+        return false;
+    }
+
+    last_segment = 0;
+    for (size_t i = 8; i < kHeaderSize; ++i) {
+        last_segment = (last_segment << 8) | data[i];
+    }
+
+    auto readLength = [data](size_t at) {
+        uint32_t net_val;
+        std::memcpy(&net_val, data + at, 4);
+        return ntohl(net_val);
+    };
+
+    const size_t crc_size = version >= 4 ? 4 : 0;
+    const size_t deadline_size = version >= 2 ? WAL::kDeadlineSize : 0;
+    const size_t flags_size = version >= 3 ? 1 : 0;
+    const char zero_deadline[WAL::kDeadlineSize] = {};
+    std::string scratch;
+
+    // Snapshots are published by rename, so a short read or a bad checksum
+    // means the file was damaged after the fact. Everything before the
+    // damage is visited; whether to go on with that is the caller's call.
+    size_t offset = kHeaderSize;
+    while (offset < size) {
+        const size_t record = offset;
+        if (size - offset < crc_size + 4) break;
+        offset += crc_size;
+        uint32_t key_len = readLength(offset);
+        offset += 4;
+        if (size - offset < static_cast<size_t>(key_len) + 4) break;
+        std::string_view key(reinterpret_cast<const char*>(data + offset), key_len);
+        uint32_t value_len = readLength(offset + key_len);
+        offset += key_len + 4;
+        if (size - offset < static_cast<size_t>(value_len) + deadline_size + flags_size) break;
+        std::string_view value(reinterpret_cast<const char*>(data + offset), value_len);
+        offset += value_len;
+
+        std::string_view deadline(reinterpret_cast<const char*>(data + offset), deadline_size);
+        offset += deadline_size;
+        if (deadline_size > 0 && std::memcmp(deadline.data(), zero_deadline, deadline_size) == 0) {
+            deadline = std::string_view();
+        }
+        bool compressed = flags_size > 0 && (data[offset] & kFlagCompressed);
+        offset += flags_size;
+
+        // Older versions have no checksum; their compressed values at least
+        // have to decompress, as reads take that for granted
+        if (crc_size > 0 ? crc32c(data + record + 4, offset - record - 4) != readLength(record)
+                         : compressed && !Compression::decompress(value, scratch)) {
+            damaged = true;
+            offset = record;
+            break;
+        }
+        visit(key, value, deadline, compressed);
+    }
+
+    if (damaged) {
+        std::cerr << "Snapshot is damaged at offset " << offset << ": " << path << std::endl;
+    } else if (offset < size) {
+        std::cerr << "Snapshot is truncated: " << path << std::endl;
+        damaged = true;
+    }
+
+    return true;
+}
+
+} // namespace kvstore
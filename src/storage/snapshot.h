@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+namespace kvstore {
+
+    class MappedFile;
+
+    // Point-in-time image of the store. A snapshot records the id of the last
+    // WAL segment it covers; recovery loads it and replays only later
+    // segments.
+    //
+    // Format: [magic "KVSNAP"(6)][version(2)][last_segment(8)]
+    //         then [crc32c(4)][key_len(4)][key][value_len(4)][value]
+    //         [deadline(8)][flags(1)] until EOF, the checksum covering the
+    //         rest of its record. Version 1 files have no deadline field,
+    //         version 2 files no flags and version 3 files no checksum. A
+    //         deadline of 0 means the key does not expire; see
+    //         WAL::encodeDeadline(). Flag 1 marks a value kept in
+    //         Compression's compressed form.
+    class SnapshotWriter {
+    public:
+        // Writes go to "<path>.tmp"; commit() renames it over path, so a crash
+        // mid-snapshot leaves the previous snapshot intact.
+        SnapshotWriter(const std::string& path, uint64_t last_segment);
+        ~SnapshotWriter();
+
+        SnapshotWriter(const SnapshotWriter&) = delete;
+        SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+        bool ok() const { return fd_ >= 0 && !failed_; }
+
+        void add(std::string_view key, std::string_view value, int64_t deadline_ms = 0,
+                 bool compressed = false);
+
+        // Flush, fsync and atomically publish the snapshot
+        bool commit();
+
+        size_t count() const { return count_; }
+
+    private:
+        std::string path_;
+        std::string tmp_path_;
+        int fd_ = -1;
+        bool failed_ = false;
+        size_t count_ = 0;
+        std::vector<uint8_t> buffer_;
+
+        void flushBuffer();
+    };
+
+    class Snapshot {
+    public:
+        // key and value point into the caller's mapping of the file, as does
+        // deadline: the encoded expiry, or empty if the key does not expire
+        using Visitor = std::function<void(std::string_view key, std::string_view value,
+                                           std::string_view deadline, bool compressed)>;
+
+        // Returns false if the file is missing or not a readable snapshot.
+        // Sets damaged if the file exists but is not a snapshot, or if it is
+        // truncated or fails a checksum; the records before the damage have
+        // been visited by then. The WAL segments the file covered are gone,
+        // so the caller decides whether that partial store will do.
+        static bool load(const MappedFile& file, uint64_t& last_segment, const Visitor& visit,
+                         bool& damaged);
+    };
+
+} // namespace kvstore
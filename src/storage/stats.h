@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace kvstore {
+
+    // Statistics with a single writer thread and any number of readers. The
+    // writer updates with a relaxed load and store instead of an atomic
+    // read-modify-write, so recording costs about as much as a plain
+    // increment and never bounces a cache line between writers; readers may
+    // see a value that is slightly stale, never a torn one. Give each thread
+    // its own instances and sum them when reporting.
+    class Counter {
+    public:
+        void add(uint64_t n = 1) {
+            value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value_{0};
+    };
+
+    // Latency histogram over nanoseconds, single writer like Counter.
+    // Buckets are log-linear, eight per power of two, so a reported
+    // percentile is within 12.5% of the true value.
+    class Histogram {
+    public:
+        static constexpr size_t kSubBuckets = 8;
+        static constexpr size_t kBuckets = 64 * kSubBuckets;
+
+        void record(uint64_t ns) {
+            Counter& bucket = buckets_[bucketFor(ns)];
+            bucket.add();
+            count_.add();
+            sum_.add(ns);
+        }
+
+        // A point-in-time copy; merge() several to combine threads
+        struct Summary {
+            std::array<uint64_t, kBuckets> buckets{};
+            uint64_t count = 0;
+            uint64_t sum = 0;
+
+            // Lower bound of the bucket holding the p-quantile (0 < p <= 1)
+            uint64_t percentile(double p) const {
+                if (count == 0) return 0;
+                uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(count));
+                if (rank == 0) rank = 1;
+                uint64_t seen = 0;
+                for (size_t i = 0; i < kBuckets; ++i) {
+                    seen += buckets[i];
+                    if (seen >= rank) return lowerBound(i);
+                }
+                return lowerBound(kBuckets - 1);
+            }
+        };
+
+        void mergeInto(Summary& summary) const {
+            for (size_t i = 0; i < kBuckets; ++i) {
+                summary.buckets[i] += buckets_[i].get();
+            }
+            summary.count += count_.get();
+            summary.sum += sum_.get();
+        }
+
+        static size_t bucketFor(uint64_t ns) {
+            if (ns < kSubBuckets) return static_cast<size_t>(ns);
+            size_t exponent = 63 - static_cast<size_t>(__builtin_clzll(ns));  // >= 3
+            size_t sub = static_cast<size_t>(ns >> (exponent - 3)) & (kSubBuckets - 1);
+            return (exponent - 2) * kSubBuckets + sub;
+        }
+
+        static uint64_t lowerBound(size_t bucket) {
+            if (bucket < kSubBuckets) return bucket;
+            size_t exponent = bucket / kSubBuckets + 2;
+            return (kSubBuckets + bucket % kSubBuckets) << (exponent - 3);
+        }
+
+    private:
+        std::array<Counter, kBuckets> buckets_;
+        Counter count_;
+        Counter sum_;
+    };
+
+} // namespace kvstore
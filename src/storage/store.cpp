@@ -1,71 +1,1345 @@
 #include "store.h"
 #include "wal.h"
+#include "snapshot.h"
+#include "mapped_file.h"
+#include "compression.h"
 #include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <iostream>
+#include <new>
+#include <random>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
 
 namespace kvstore {
 
-    Store::Store() : Store("kvstore.wal") {
+    namespace {
+        // Records handed to the recovery threads per round
+        constexpr size_t kRecoveryBatchSize = 64 * 1024;
+
+        // Most keys the active expirer deletes from one shard per lock hold
+        constexpr size_t kExpireBatch = 256;
+
+        // The expiry heap is rebuilt from the live deadlines once stale
+        // entries outnumber them by this much, so repeatedly re-expiring the
+        // same keys cannot grow it without bound
+        constexpr size_t kExpiryHeapSlack = 1024;
+
+        // Most keys a single write evicts; any remaining excess is left to
+        // the writes that follow
+        constexpr size_t kMaxEvictionsPerWrite = 16;
+
+        // LFU counter: new keys start here so they are not the first to go,
+        // increments get less likely as it grows (so 255 takes ~1M hits),
+        // and it loses one point per minute without access
+        constexpr uint8_t kLfuInitial = 5;
+        constexpr double kLfuLogFactor = 10;
+        constexpr uint32_t kLfuDecayMs = 60 * 1000;
+
+        std::minstd_rand& threadRng() {
+            thread_local std::minstd_rand rng(std::random_device{}());
+            return rng;
+        }
+
+        StoreConfig configForWal(const std::string& wal_filename) {
+            StoreConfig config;
+            config.wal_filename = wal_filename;
+            return config;
+        }
+    }
+
+    Store::Store() : Store(StoreConfig{}) {
     }
 
     Store::Store(const std::string& wal_filename)
-        : wal_filename_(wal_filename), wal_(std::make_unique<WAL>(wal_filename)) {
+        : Store(configForWal(wal_filename)) {
+    }
+
+    Store::Store(const StoreConfig& config)
+        : shards_(config.num_shards > 0 ? config.num_shards : 1),
+          wal_filename_(config.wal_filename),
+          snapshot_filename_(config.wal_filename + ".snapshot"),
+          wal_(std::make_unique<WAL>(config.wal_filename, config.wal)),
+          snapshot_interval_sec_(config.snapshot_interval_sec),
+          expire_interval_ms_(config.replica ? 0 : config.expire_interval_ms),
+          max_memory_(config.replica ? 0 : config.max_memory),
+          eviction_(config.eviction),
+          eviction_samples_(std::max<size_t>(1, config.eviction_samples)),
+          ordered_index_(config.ordered_index),
+          compress_threshold_(config.compress_threshold),
+          salvage_snapshot_(config.salvage_snapshot),
+          replica_(config.replica) {
+        recovery_threads_ = config.recovery_threads;
+        if (recovery_threads_ == 0) {
+            recovery_threads_ = std::max<size_t>(1, std::thread::hardware_concurrency());
+        }
+        recovery_threads_ = std::min(recovery_threads_, shards_.size());
+
+        // Versions are not persisted; starting each clock at a random point
+        // makes a version read before a restart unlikely to match after it
+        for (auto& shard : shards_) {
+            shard.version_clock = static_cast<uint32_t>(threadRng()());
+        }
+
         recover();
+        if (!recovered_) {
+            // Leave the log as it is; see recovered()
+            return;
+        }
+
+        // The limit may be lower than what was recovered
+        while (max_memory_ > 0 && usedMemory() > max_memory_ && evictOne(nullptr, 0)) {
+        }
+
+        if (snapshot_interval_sec_ > 0) {
+            snapshot_thread_ = std::thread(&Store::snapshotLoop, this);
+        }
+        if (expire_interval_ms_ > 0) {
+            expire_thread_ = std::thread(&Store::expireLoop, this);
+        }
+    }
+
+    Store::~Store() {
+        {
+            std::lock_guard<std::mutex> lock(background_mutex_);
+            stopping_ = true;
+        }
+        background_cv_.notify_all();
+
+        if (snapshot_thread_.joinable()) {
+            snapshot_thread_.join();
+        }
+        if (expire_thread_.joinable()) {
+            expire_thread_.join();
+        }
+
+        for (auto& shard : shards_) {
+            releaseValues(shard);
+        }
+    }
+
+    size_t Store::shardIndex(std::string_view key) const {
+        return std::hash<std::string_view>{}(key) % shards_.size();
+    }
+
+    Store::Shard& Store::shardFor(std::string_view key) {
+        return shards_[shardIndex(key)];
+    }
+
+    const Store::Shard& Store::shardFor(std::string_view key) const {
+        return shards_[shardIndex(key)];
+    }
+
+    int64_t Store::nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    int64_t Store::deadlineAfter(int64_t now_ms, int64_t ttl_ms) {
+        return now_ms + std::clamp<int64_t>(ttl_ms, 0, kMaxTtlMs);
+    }
+
+    void Store::waitLogged(uint64_t lsn) {
+        if (!wal_->waitFor(lsn) && !log_failed_.exchange(true, std::memory_order_relaxed)) {
+            std::cerr << "WAL failed: writes are no longer acknowledged" << std::endl;
+        }
+    }
+
+    bool Store::isExpired(const Shard& shard, std::string_view key) {
+        // Most shards have no expiring keys; skip the copy and clock read
+        if (shard.expires.empty()) return false;
+        const auto* deadline = shard.expires.find(key);
+        return deadline && deadline->value <= nowMs();
+    }
+
+    void Store::setDeadline(Shard& shard, std::string_view key, int64_t deadline_ms) {
+        shard.expires.tryEmplace(key).first->value = deadline_ms;
+        shard.expiry_heap.emplace(deadline_ms, std::string(key));
+
+        if (shard.expiry_heap.size() > 2 * shard.expires.size() + kExpiryHeapSlack) {
+            std::vector<ExpiryEntry> live;
+            live.reserve(shard.expires.size());
+            shard.expires.forEach([&live](const auto& slot) {
+                live.emplace_back(slot.value, std::string(slot.key.view()));
+            });
+            shard.expiry_heap = ExpiryHeap(std::greater<ExpiryEntry>(), std::move(live));
+        }
+    }
+
+    void Store::clearDeadline(Shard& shard, std::string_view key) {
+        if (!shard.expires.empty()) {
+            shard.expires.erase(key);
+        }
+    }
+
+    size_t Store::entrySize(const Slot& slot) const {
+        // Strings short enough for the small-string buffer own no allocation
+        static const size_t inline_capacity = std::string().capacity();
+
+        std::string_view key = slot.key.view();
+        size_t size = slot.key.heapBytes() + slot.value.capacity();
+        if (ordered_index_) {
+            size += sizeof(std::string) + (key.size() > inline_capacity ? key.size() + 1 : 0);
+        }
+        return size;
+    }
+
+    void Store::account(Shard& shard, size_t before, size_t after) {
+        shard.memory += after - before;
+        if (after >= before) {
+            used_memory_.fetch_add(after - before, std::memory_order_relaxed);
+        } else {
+            used_memory_.fetch_sub(before - after, std::memory_order_relaxed);
+        }
+    }
+
+    void Store::encode(std::string_view value, Encoded& out) const {
+        out.compressed = compress_threshold_ > 0 && value.size() >= compress_threshold_ &&
+                         value.size() <= kMaxCompressedSize && Compression::compress(value, out.buffer);
+        out.value = out.compressed ? std::string_view(out.buffer) : value;
+    }
+
+    std::string& Store::decodeBuffer() {
+        thread_local std::string buffer;
+        return buffer;
+    }
+
+    std::string_view Store::decoded(const Item& item) {
+        if (!item.compressed) {
+            return item.view();
+        }
+        // Stored values were compressed by this process, came in a WAL or
+        // replication record that passed its checksum, or were loaded from
+        // a snapshot record that did. This cannot fail short of memory
+        // corruption.
+        std::string& buffer = decodeBuffer();
+        trimDecoded();
+        Compression::decompress(item.view(), buffer);
+        return buffer;
+    }
+
+    void Store::trimDecoded() {
+        // Only values logged before the size cap decompress to more than it
+        std::string& buffer = decodeBuffer();
+        if (buffer.capacity() > kMaxCompressedSize) {
+            std::string().swap(buffer);
+        }
+    }
+
+    Store::Slot* Store::upsert(Shard& shard, std::string_view key, std::string_view value, bool compressed) {
+        size_t table_before = shard.data.tableBytes();
+        auto [slot, inserted] = shard.data.tryEmplace(key);
+        size_t before = table_before + (inserted ? 0 : entrySize(*slot));
+
+        try {
+            if (inserted && ordered_index_) {
+                shard.index.insert(key);
+            }
+            assignValue(shard, slot->value, value, compressed);
+        } catch (const std::bad_alloc&) {
+            // Out of memory: don't leave an empty entry behind, in the table
+            // or the index. erase() drops the key from both.
+            if (inserted) {
+                account(shard, before, shard.data.tableBytes() + entrySize(*slot));
+                erase(shard, slot);
+            }
+            throw;
+        }
+        slot->value.version = nextVersion(shard);
+        account(shard, before, shard.data.tableBytes() + entrySize(*slot));
+
+        if (inserted && max_memory_ > 0) {
+            slot->value.frequency.store(kLfuInitial, std::memory_order_relaxed);
+        }
+        touch(slot->value);
+        return slot;
+    }
+
+    uint32_t Store::nextVersion(Shard& shard) {
+        // 0 stands for a missing key
+        if (++shard.version_clock == 0) {
+            ++shard.version_clock;
+        }
+        return shard.version_clock;
+    }
+
+    void Store::erase(Shard& shard, Slot* slot) {
+        size_t before = shard.data.tableBytes() + entrySize(*slot);
+        clearDeadline(shard, slot->key.view());
+        if (ordered_index_) {
+            shard.index.erase(slot->key.view());
+        }
+        if (slot->value.data) {
+            shard.values.deallocate(slot->value.data, slot->value.capacity());
+        }
+        shard.value_bytes -= slot->value.size;
+        shard.data.erase(slot);
+        account(shard, before, shard.data.tableBytes());
+    }
+
+    void Store::assignValue(Shard& shard, Item& item, std::string_view value, bool compressed) {
+        size_t capacity = SlabAllocator::capacityFor(value.size());
+        if (capacity != item.capacity()) {
+            // Allocate first, so the item is untouched if that throws
+            char* data = capacity ? shard.values.allocate(value.size()) : nullptr;
+            if (item.data) {
+                shard.values.deallocate(item.data, item.capacity());
+            }
+            item.data = data;
+        }
+        if (!value.empty()) {
+            std::memcpy(item.data, value.data(), value.size());
+        }
+        shard.value_bytes = shard.value_bytes - item.size + value.size();
+        item.size = static_cast<uint32_t>(value.size());
+        item.compressed = compressed;
+    }
+
+    void Store::releaseValues(Shard& shard) {
+        shard.data.forEach([&shard](const Slot& slot) {
+            if (slot.value.data) {
+                shard.values.deallocate(slot.value.data, slot.value.capacity());
+            }
+        });
+        shard.value_bytes = 0;
+    }
+
+    double Store::MemoryStats::fragmentation() const {
+        return value_bytes ? static_cast<double>(slab.touched) / static_cast<double>(value_bytes) : 1.0;
+    }
+
+    Store::MemoryStats Store::memoryStats() const {
+        MemoryStats stats;
+        for (const auto& shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            stats.value_bytes += shard.value_bytes;
+            shard.values.addStats(stats.slab);
+        }
+        return stats;
+    }
+
+    std::string Store::prefixEnd(std::string_view prefix) {
+        std::string end(prefix);
+        while (!end.empty() && static_cast<uint8_t>(end.back()) == 0xff) {
+            end.pop_back();
+        }
+        if (!end.empty()) {
+            end.back() = static_cast<char>(static_cast<uint8_t>(end.back()) + 1);
+        }
+        return end;
+    }
+
+    std::string Store::dataDirectory() const {
+        std::filesystem::path dir = std::filesystem::path(wal_filename_).parent_path();
+        return dir.empty() ? std::string(".") : dir.string();
+    }
+
+    uint32_t Store::lruClock() {
+        // Wraps every ~49 days; idle times are computed modulo 2^32
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    uint8_t Store::decayedFrequency(const Item& item, uint32_t now) {
+        uint32_t idle = now - item.access.load(std::memory_order_relaxed);
+        uint32_t decay = idle / kLfuDecayMs;
+        uint8_t frequency = item.frequency.load(std::memory_order_relaxed);
+        return decay >= frequency ? 0 : static_cast<uint8_t>(frequency - decay);
+    }
+
+    void Store::touch(const Item& item) const {
+        // Without a memory limit nothing reads this; don't dirty the line
+        if (max_memory_ == 0) return;
+
+        uint32_t now = lruClock();
+        if (eviction_ == EvictionPolicy::LFU) {
+            uint8_t frequency = decayedFrequency(item, now);
+            if (frequency < 255) {
+                double base = frequency > kLfuInitial ? frequency - kLfuInitial : 0;
+                double p = 1.0 / (base * kLfuLogFactor + 1);
+                if (std::uniform_real_distribution<double>(0.0, 1.0)(threadRng()) < p) {
+                    ++frequency;
+                }
+            }
+            // Racing readers may lose an increment; the counter is a hint
+            item.frequency.store(frequency, std::memory_order_relaxed);
+        }
+        item.access.store(now, std::memory_order_relaxed);
+    }
+
+    void Store::evictIfNeeded(const std::string_view* written, size_t count) {
+        if (max_memory_ == 0) return;
+
+        for (size_t i = 0; i < kMaxEvictionsPerWrite && usedMemory() > max_memory_; ++i) {
+            if (!evictOne(written, count)) break;
+        }
+    }
+
+    bool Store::evictOne(const std::string_view* spared, size_t count) {
+        auto& rng = threadRng();
+        size_t start = rng() % shards_.size();
+
+        for (size_t n = 0; n < shards_.size(); ++n) {
+            Shard& shard = shards_[(start + n) % shards_.size()];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            if (shard.data.empty()) continue;
+
+            const size_t samples = eviction_ == EvictionPolicy::RANDOM ? 1 : eviction_samples_;
+            const uint32_t now = lruClock();
+            Slot* victim = nullptr;
+            uint64_t victim_score = 0;
+
+            for (size_t s = 0; s < samples; ++s) {
+                Slot* slot = shard.data.sample(rng);
+                if (std::find(spared, spared + count, slot->key.view()) != spared + count) {
+                    continue;
+                }
+
+                // Higher score = better victim
+                uint32_t idle = now - slot->value.access.load(std::memory_order_relaxed);
+                uint64_t score = idle;
+                if (eviction_ == EvictionPolicy::LFU) {
+                    // Least frequent first, then least recent
+                    score = (static_cast<uint64_t>(255 - decayedFrequency(slot->value, now)) << 32) | idle;
+                }
+                if (!victim || score > victim_score) {
+                    victim = slot;
+                    victim_score = score;
+                }
+            }
+            if (!victim) continue;   // only drew spared keys; try another shard
+
+            // Logged but not waited for, like an expiry: if the record is lost
+            // the key simply comes back, and no client was told otherwise
+            if (wal_) {
+                wal_->append(WALOperation::DELETE, victim->key.view(), "");
+            }
+            erase(shard, victim);
+            evicted_keys_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    bool Store::parseEvictionPolicy(const std::string& name, EvictionPolicy& policy) {
+        if (name == "lru") {
+            policy = EvictionPolicy::LRU;
+        } else if (name == "lfu") {
+            policy = EvictionPolicy::LFU;
+        } else if (name == "random") {
+            policy = EvictionPolicy::RANDOM;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void Store::applyRecovered(Shard& shard, const WAL::Entry& entry) {
+        // The caller owns the shard: recovery exclusively, without locks,
+        // and replication by holding its lock
+        if (entry.op == WALOperation::SET || entry.op == WALOperation::SET_COMPRESSED) {
+            upsert(shard, entry.key, entry.value, entry.op == WALOperation::SET_COMPRESSED);
+            clearDeadline(shard, entry.key);
+        } else if (entry.op == WALOperation::DELETE) {
+            if (Slot* slot = shard.data.find(entry.key)) {
+                erase(shard, slot);
+            }
+        } else if (entry.op == WALOperation::EXPIRE_AT) {
+            // Deadlines that have already passed are kept; the key is
+            // invisible to readers and the expirer logs its deletion
+            int64_t deadline = 0;
+            if (shard.data.find(entry.key) && WAL::decodeDeadline(entry.value, deadline)) {
+                setDeadline(shard, entry.key, deadline);
+            }
+        }
     }
 
     void Store::recover() {
         std::cout << "Starting recovery..." << std::endl;
 
-        auto entries = WAL::replay(wal_filename_);
+        // Records are applied straight out of the mapped files. With several
+        // threads, each one owns a disjoint set of shards; records are handed
+        // out in bounded batches so every shard still sees its records in
+        // log order. Batches must be drained before a file is unmapped.
+        const size_t threads = recovery_threads_;
+        std::vector<std::vector<std::pair<Shard*, WAL::Entry>>> batches(threads);
+        size_t batched = 0;
+
+        auto drain = [&] {
+            if (batched == 0) return;
+
+            auto applyBatch = [this, &batches](size_t t) {
+                for (const auto& item : batches[t]) {
+                    applyRecovered(*item.first, item.second);
+                }
+                batches[t].clear();
+            };
+
+            std::vector<std::thread> workers;
+            for (size_t t = 1; t < threads; ++t) {
+                workers.emplace_back(applyBatch, t);
+            }
+            applyBatch(0);
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            batched = 0;
+        };
+
+        std::function<void(const WAL::Entry&)> dispatch = [&](const WAL::Entry& entry) {
+            // A batch is one record; its sub-records may span shards
+            if (entry.op == WALOperation::BATCH) {
+                if (!WAL::forEachInBatch(entry.value, dispatch)) {
+                    std::cerr << "Skipping malformed WAL batch record" << std::endl;
+                }
+                return;
+            }
+
+            size_t index = shardIndex(entry.key);
+            if (threads == 1) {
+                applyRecovered(shards_[index], entry);
+                return;
+            }
+            batches[index % threads].emplace_back(&shards_[index], entry);
+            if (++batched >= kRecoveryBatchSize) {
+                drain();
+            }
+        };
+
+        uint64_t covered = 0;
+        bool have_snapshot = false;
+        bool damaged = false;
+        {
+            MappedFile file(snapshot_filename_);
+            have_snapshot = Snapshot::load(file, covered,
+                [&](std::string_view key, std::string_view value, std::string_view deadline, bool compressed) {
+                    dispatch(WAL::Entry{compressed ? WALOperation::SET_COMPRESSED : WALOperation::SET, key, value});
+                    if (!deadline.empty()) {
+                        dispatch(WAL::Entry{WALOperation::EXPIRE_AT, key, deadline});
+                    }
+                }, damaged);
+            drain();
+        }
+        if (damaged && !salvage_snapshot_) {
+            std::cerr << "Recovery stopped: the snapshot is damaged and the WAL it covered is gone; "
+                         "restart with --salvage-snapshot to serve what can be read" << std::endl;
+            recovered_ = false;
+            return;
+        }
+        if (have_snapshot) {
+            std::cout << "Loaded snapshot covering WAL segments <= " << covered << std::endl;
+        }
+
+        const uint64_t active = wal_ ? wal_->activeSegment() : UINT64_MAX;
+        std::vector<WAL::Segment> segments;
+        for (const auto& segment : WAL::listSegments(wal_filename_)) {
+            if (segment.id >= active) {
+                break;
+            }
+            if (!have_snapshot || segment.id > covered) {
+                segments.push_back(segment);
+            }
+        }
+
+        // The tail is the last segment holding records; a crash may only
+        // have torn that one
+        size_t tail = 0;
+        for (size_t i = segments.size(); i-- > 0;) {
+            if (!WAL::isEmpty(MappedFile(segments[i].path))) {
+                tail = i;
+                break;
+            }
+        }
 
-        for (const auto& entry : entries) {
-            if (entry.op == WALOperation::SET) {
-                data_[entry.key] = entry.value;
-            } else if (entry.op == WALOperation::DELETE) {
-                data_.erase(entry.key);
+        for (size_t i = 0; i < segments.size(); ++i) {
+            MappedFile file(segments[i].path);
+            bool ok = WAL::replay(file, dispatch, i >= tail);
+            drain();
+            if (!ok) {
+                std::cerr << "Recovery stopped: the WAL is damaged before its end" << std::endl;
+                recovered_ = false;
+                return;
             }
         }
 
-        std::cout << "Recovery complete. " << data_.size() << " keys in store." << std::endl;
+        std::cout << "Recovery complete. " << size() << " keys in store." << std::endl;
     }
 
-    void Store::set(const std::string& key, const std::string& value) {
-        // Log to WAL BEFORE modifying data
+    void Store::set(std::string_view key, std::string_view value) {
+        Shard& shard = shardFor(key);
+        Encoded encoded;
+        encode(value, encoded);
+
+        uint64_t lsn = 0;
+        {
+            // Log to WAL BEFORE modifying data. The record is appended under
+            // the shard lock so the log order matches the order in which
+            // writes to the same key are applied in memory.
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            if (wal_) {
+                lsn = wal_->append(setOperation(encoded), key, encoded.value);
+            }
+            upsert(shard, key, encoded.value, encoded.compressed);
+            clearDeadline(shard, key);
+        }
+
+        // Wait for the group commit outside the lock so other writers to
+        // this shard can join the same batch.
         if (wal_) {
-            wal_->logSet(key, value);
+            waitLogged(lsn);
         }
+        evictIfNeeded(key);
+    }
+
+    void Store::set(std::string_view key, std::string_view value, int64_t ttl_ms) {
+        Shard& shard = shardFor(key);
+        int64_t deadline = deadlineAfter(nowMs(), ttl_ms);
+        char encoded_deadline[WAL::kDeadlineSize];
+        WAL::encodeDeadline(deadline, encoded_deadline);
+        Encoded encoded;
+        encode(value, encoded);
 
-        std::unique_lock<std::shared_mutex> lock(mutex_);
-        data_[key] = value;
+        uint64_t lsn = 0;
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            // One record, so replay never sees the value without its deadline
+            if (wal_) {
+                lsn = wal_->appendBatch({
+                    {setOperation(encoded), key, encoded.value},
+                    {WALOperation::EXPIRE_AT, key, std::string_view(encoded_deadline, sizeof(encoded_deadline))}
+                });
+            }
+            upsert(shard, key, encoded.value, encoded.compressed);
+            setDeadline(shard, key, deadline);
+        }
+
+        if (wal_) {
+            waitLogged(lsn);
+        }
+        evictIfNeeded(key);
     }
 
-    std::optional<std::string> Store::get(const std::string& key) {
-        std::shared_lock<std::shared_mutex> lock(mutex_);
-        auto it = data_.find(key);
-        if (it != data_.end()) {
-            return it->second;
+    template <typename Fn>
+    uint32_t Store::update(std::string_view key, bool keep_deadline, Fn&& fn) {
+        Shard& shard = shardFor(key);
+        std::string value;
+        Encoded encoded;
+
+        uint64_t lsn = 0;
+        uint32_t version = 0;
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            Slot* slot = shard.data.find(key);
+            const Item* current = slot && !isExpired(shard, key) ? &slot->value : nullptr;
+            if (!fn(current, value)) {
+                return 0;
+            }
+            encode(value, encoded);
+
+            const auto* deadline = keep_deadline && current && !shard.expires.empty()
+                                       ? shard.expires.find(key) : nullptr;
+
+            // The result is logged, not the operation, so replay over a
+            // snapshot that already holds it reaches the same value
+            if (deadline) {
+                char encoded_deadline[WAL::kDeadlineSize];
+                WAL::encodeDeadline(deadline->value, encoded_deadline);
+                if (wal_) {
+                    lsn = wal_->appendBatch({
+                        {setOperation(encoded), key, encoded.value},
+                        {WALOperation::EXPIRE_AT, key, std::string_view(encoded_deadline, sizeof(encoded_deadline))}
+                    });
+                }
+                version = upsert(shard, key, encoded.value, encoded.compressed)->value.version;
+            } else {
+                if (wal_) {
+                    lsn = wal_->append(setOperation(encoded), key, encoded.value);
+                }
+                version = upsert(shard, key, encoded.value, encoded.compressed)->value.version;
+                clearDeadline(shard, key);
+            }
         }
+
+        if (wal_) {
+            waitLogged(lsn);
+        }
+        evictIfNeeded(key);
+        return version;
+    }
+
+    std::optional<int64_t> Store::incrBy(std::string_view key, int64_t delta) {
+        int64_t result = 0;
+        uint32_t version = update(key, true, [&](const Item* current, std::string& value) {
+            int64_t number = 0;
+            if (current) {
+                std::string_view text = decoded(*current);
+                const char* end = text.data() + text.size();
+                auto parsed = std::from_chars(text.data(), end, number);
+                if (parsed.ec != std::errc() || parsed.ptr != end) {
+                    return false;
+                }
+            }
+            if (__builtin_add_overflow(number, delta, &result)) {
+                return false;
+            }
+            value = std::to_string(result);
+            return true;
+        });
+        if (version == 0) {
+            return std::nullopt;
+        }
+        return result;
+    }
+
+    size_t Store::append(std::string_view key, std::string_view suffix) {
+        size_t length = 0;
+        update(key, true, [&](const Item* current, std::string& value) {
+            if (current) {
+                value = decoded(*current);
+            }
+            value += suffix;
+            length = value.size();
+            return true;
+        });
+        return length;
+    }
+
+    std::optional<std::string> Store::getSet(std::string_view key, std::string_view value) {
+        std::optional<std::string> previous;
+        update(key, false, [&](const Item* current, std::string& out) {
+            if (current) {
+                previous.emplace(decoded(*current));
+            }
+            out = value;
+            return true;
+        });
+        return previous;
+    }
+
+    bool Store::compareAndSwap(std::string_view key, uint32_t expected, std::string_view value, uint32_t& version) {
+        uint32_t current_version = 0;
+        uint32_t swapped = update(key, false, [&](const Item* current, std::string& out) {
+            current_version = current ? current->version : 0;
+            if (current_version != expected) {
+                return false;
+            }
+            out = value;
+            return true;
+        });
+        version = swapped ? swapped : current_version;
+        return swapped != 0;
+    }
+
+    bool Store::expire(std::string_view key, int64_t ttl_ms) {
+        Shard& shard = shardFor(key);
+        int64_t deadline = deadlineAfter(nowMs(), ttl_ms);
+        char encoded[WAL::kDeadlineSize];
+        WAL::encodeDeadline(deadline, encoded);
+
+        uint64_t lsn = 0;
+        bool exists = false;
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            Slot* slot = shard.data.find(key);
+            if (!slot) {
+                return false;
+            }
+            exists = !isExpired(shard, key);
+
+            if (!exists || ttl_ms <= 0) {
+                if (wal_) {
+                    lsn = wal_->append(WALOperation::DELETE, key, "");
+                }
+                erase(shard, slot);
+            } else {
+                if (wal_) {
+                    lsn = wal_->append(WALOperation::EXPIRE_AT, key,
+                                       std::string_view(encoded, sizeof(encoded)));
+                }
+                setDeadline(shard, key, deadline);
+            }
+        }
+
+        if (wal_) {
+            waitLogged(lsn);
+        }
+        return exists;
+    }
+
+    std::optional<int64_t> Store::ttl(std::string_view key) {
+        Shard& shard = shardFor(key);
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            if (!shard.data.find(key)) {
+                return std::nullopt;
+            }
+
+            const auto* deadline = shard.expires.find(key);
+            if (!deadline) {
+                return kNoExpiry;
+            }
+            int64_t left = deadline->value - nowMs();
+            if (left > 0) {
+                return left;
+            }
+        }
+
+        expireKey(key);
         return std::nullopt;
     }
 
-    bool Store::remove(const std::string& key) {
-        // Log to WAL BEFORE modifying data
+    void Store::expireKey(std::string_view key) {
+        // A replica's keys go when the primary's DELETE arrives
+        if (replica_) return;
+
+        Shard& shard = shardFor(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        if (!isExpired(shard, key)) {
+            return;
+        }
+
+        // Not waited for: nobody is acknowledged for an expiry, and replay
+        // reaches the same state whether or not the record made it
+        if (wal_) {
+            wal_->append(WALOperation::DELETE, key, "");
+        }
+        erase(shard, shard.data.find(key));
+    }
+
+    size_t Store::expireDue(size_t max_per_shard) {
+        if (replica_) return 0;
+
+        size_t expired = 0;
+        std::vector<std::string> victims;
+        std::vector<WAL::Entry> ops;
+
+        for (auto& shard : shards_) {
+            int64_t now = nowMs();
+
+            // Peek under the read lock so readers are not blocked when
+            // nothing in this shard is due
+            {
+                std::shared_lock<std::shared_mutex> lock(shard.mutex);
+                if (shard.expiry_heap.empty() || shard.expiry_heap.top().first > now) {
+                    continue;
+                }
+            }
+
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            size_t examined = 0;
+            while (!shard.expiry_heap.empty() && shard.expiry_heap.top().first <= now &&
+                   examined < max_per_shard) {
+                ExpiryEntry entry = shard.expiry_heap.top();
+                shard.expiry_heap.pop();
+                ++examined;
+
+                const auto* deadline = shard.expires.find(entry.second);
+                if (!deadline || deadline->value != entry.first) {
+                    continue;  // stale: the deadline was changed or cleared
+                }
+                erase(shard, shard.data.find(entry.second));
+                victims.push_back(std::move(entry.second));
+            }
+
+            if (wal_ && !victims.empty()) {
+                for (const auto& key : victims) {
+                    ops.push_back({WALOperation::DELETE, key, std::string_view()});
+                }
+                wal_->appendBatch(ops);
+            }
+
+            expired += victims.size();
+            victims.clear();
+            ops.clear();
+        }
+        return expired;
+    }
+
+    void Store::expireLoop() {
+        std::unique_lock<std::mutex> lock(background_mutex_);
+        while (!stopping_) {
+            lock.unlock();
+            size_t expired = expireDue(kExpireBatch);
+            lock.lock();
+
+            // A full batch means more keys are already due: go again without
+            // sleeping. Each pass still releases every shard lock in between.
+            if (expired >= kExpireBatch) continue;
+
+            background_cv_.wait_for(lock, std::chrono::milliseconds(expire_interval_ms_),
+                                    [this] { return stopping_; });
+        }
+    }
+
+    std::optional<std::string> Store::get(std::string_view key) {
+        std::optional<std::string> result;
+        read(key, [&result](std::string_view value) {
+            result.emplace(value);
+        });
+        return result;
+    }
+
+    bool Store::remove(std::string_view key) {
+        Shard& shard = shardFor(key);
+        uint64_t lsn = 0;
+        bool existed = false;
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            Slot* slot = shard.data.find(key);
+            if (!slot) {
+                return false;
+            }
+            // An expired key is deleted all the same, but reported as missing
+            existed = !isExpired(shard, key);
+
+            // Log to WAL BEFORE modifying data
+            if (wal_) {
+                lsn = wal_->append(WALOperation::DELETE, key, "");
+            }
+            erase(shard, slot);
+        }
+
+        if (wal_) {
+            waitLogged(lsn);
+        }
+        return existed;
+    }
+
+    template <typename Fn>
+    void Store::forEachCopied(Fn&& fn) {
+        std::vector<std::pair<std::string, std::string>> copy;
+        std::vector<int64_t> deadlines;
+        std::vector<bool> compressed;
+
+        for (auto& shard : shards_) {
+            {
+                std::shared_lock<std::shared_mutex> lock(shard.mutex);
+                copy.reserve(shard.data.size());
+                deadlines.reserve(shard.data.size());
+                shard.data.forEach([&](const Slot& slot) {
+                    int64_t deadline = 0;
+                    if (!shard.expires.empty()) {
+                        if (const auto* expiry = shard.expires.find(slot.key.view())) {
+                            deadline = expiry->value;
+                        }
+                    }
+                    copy.emplace_back(slot.key.view(), slot.value.view());
+                    deadlines.push_back(deadline);
+                    compressed.push_back(slot.value.compressed);
+                });
+            }
+            // Values are passed on as stored, compressed or not
+            for (size_t i = 0; i < copy.size(); ++i) {
+                fn(copy[i].first, copy[i].second, deadlines[i], compressed[i]);
+            }
+            copy.clear();
+            deadlines.clear();
+            compressed.clear();
+        }
+    }
+
+    void Store::dump(const WAL::Visitor& visit) {
+        forEachCopied([&visit](std::string_view key, std::string_view value, int64_t deadline, bool compressed) {
+            visit(WAL::Entry{compressed ? WALOperation::SET_COMPRESSED : WALOperation::SET, key, value});
+            if (deadline != 0) {
+                char encoded[WAL::kDeadlineSize];
+                WAL::encodeDeadline(deadline, encoded);
+                visit(WAL::Entry{WALOperation::EXPIRE_AT, key, std::string_view(encoded, sizeof(encoded))});
+            }
+        });
+    }
+
+    void Store::setWalSink(WAL::RecordSink sink) {
+        if (wal_) {
+            wal_->setSink(std::move(sink));
+        }
+    }
+
+    bool Store::replaceWith(std::string_view records) {
+        // Built off to the side, so readers keep the old copy meanwhile
+        std::vector<Shard> staged(shards_.size());
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+            staged[i].version_clock = shards_[i].version_clock;
+        }
+        auto discard = [this, &staged] {
+            for (auto& shard : staged) {
+                clearShard(shard);
+            }
+        };
+
+        std::unique_lock<std::mutex> guard(snapshot_mutex_, std::defer_lock);
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        uint64_t sealed = 0;
+        try {
+            bool intact = true;
+            WAL::Visitor apply = [&](const WAL::Entry& entry) {
+                if (entry.op == WALOperation::BATCH) {
+                    intact = WAL::forEachInBatch(entry.value, apply) && intact;
+                } else {
+                    applyRecovered(staged[shardIndex(entry.key)], entry);
+                }
+            };
+            if (!WAL::decodeRecords(records, apply) || !intact) {
+                std::cerr << "Corrupt full sync; keeping the old copy" << std::endl;
+                discard();
+                return false;
+            }
+
+            // The snapshot stands in for every segment up to the sealed one,
+            // which ends with the last record of the old copy. Once it is
+            // renamed into place, recovery finds the new copy; before, the old.
+            guard.lock();
+            locks.reserve(shards_.size());
+            if (wal_) {
+                sealed = wal_->rotate();
+                SnapshotWriter writer(snapshot_filename_, sealed);
+                for (const auto& shard : staged) {
+                    shard.data.forEach([&](const Slot& slot) {
+                        const auto* expiry = shard.expires.empty() ? nullptr : shard.expires.find(slot.key.view());
+                        writer.add(slot.key.view(), slot.value.view(), expiry ? expiry->value : 0,
+                                   slot.value.compressed);
+                    });
+                }
+                if (!writer.commit()) {
+                    std::cerr << "Could not persist the full sync; keeping the old copy" << std::endl;
+                    discard();
+                    return false;
+                }
+            }
+        } catch (const std::bad_alloc&) {
+            std::cerr << "Out of memory staging the full sync; keeping the old copy" << std::endl;
+            discard();
+            return false;
+        }
+
+        // Nothing below allocates, so memory now matches the disk
+        for (auto& shard : shards_) {
+            locks.emplace_back(shard.mutex);
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            swapContents(shards_[i], staged[i]);
+        }
+        locks.clear();
+
+        if (wal_) {
+            WAL::removeSegments(wal_filename_, sealed);
+        }
+        guard.unlock();
+        discard();
+        return true;
+    }
+
+    void Store::swapContents(Shard& a, Shard& b) noexcept {
+        a.data.swap(b.data);
+        a.values.swap(b.values);
+        std::swap(a.value_bytes, b.value_bytes);
+        a.index.swap(b.index);
+        std::swap(a.memory, b.memory);
+        std::swap(a.version_clock, b.version_clock);
+        a.expires.swap(b.expires);
+        a.expiry_heap.swap(b.expiry_heap);
+    }
+
+    void Store::applyReplicated(const std::vector<WAL::Entry>& entries) {
+        if (entries.empty()) return;
+
+        // Batches are expanded so that every touched shard is locked, and
+        // logged whole, so a batch stays atomic on the replica too
+        std::vector<WAL::Entry> ops;
+        std::vector<std::pair<size_t, size_t>> records;   // [begin, end) in ops
+        for (const WAL::Entry& entry : entries) {
+            size_t begin = ops.size();
+            if (entry.op != WALOperation::BATCH) {
+                ops.push_back(entry);
+            } else if (!WAL::forEachInBatch(entry.value, [&ops](const WAL::Entry& op) { ops.push_back(op); })) {
+                std::cerr << "Skipping malformed replicated batch" << std::endl;
+                continue;
+            }
+            records.emplace_back(begin, ops.size());
+        }
+
+        std::vector<size_t> indices(ops.size());
+        for (size_t i = 0; i < ops.size(); ++i) {
+            indices[i] = shardIndex(ops[i].key);
+        }
+
+        uint64_t lsn = 0;
+        {
+            std::vector<std::unique_lock<std::shared_mutex>> locks;
+            for (size_t index : lockOrder(indices)) {
+                locks.emplace_back(shards_[index].mutex);
+            }
+
+            for (const auto& [begin, end] : records) {
+                if (wal_ && end - begin == 1) {
+                    lsn = wal_->append(ops[begin].op, ops[begin].key, ops[begin].value);
+                } else if (wal_) {
+                    lsn = wal_->appendBatch(std::vector<WAL::Entry>(ops.begin() + begin, ops.begin() + end));
+                }
+                for (size_t i = begin; i < end; ++i) {
+                    applyRecovered(shards_[indices[i]], ops[i]);
+                }
+            }
+        }
+
+        // Nothing is evicted: a replica deletes only what the primary did
+        if (wal_) {
+            waitLogged(lsn);
+        }
+    }
+
+    bool Store::snapshot() {
+        if (!wal_) return false;
+
+        std::lock_guard<std::mutex> guard(snapshot_mutex_);
+
+        // Every record in a segment up to the sealed one was appended under
+        // its shard lock and applied before that lock was released, so the
+        // shard copies below are guaranteed to contain it. Records in later
+        // segments may or may not be included; replaying them over the
+        // snapshot yields the same final state either way.
+        uint64_t sealed = wal_->rotate();
+
+        SnapshotWriter writer(snapshot_filename_, sealed);
+        forEachCopied([&writer](std::string_view key, std::string_view value, int64_t deadline, bool compressed) {
+            writer.add(key, value, deadline, compressed);
+        });
+
+        size_t count = writer.count();
+        if (!writer.commit()) {
+            std::cerr << "Snapshot failed; keeping WAL segments" << std::endl;
+            return false;
+        }
+
+        WAL::removeSegments(wal_filename_, sealed);
+
+        std::cout << "Snapshot written: " << count << " keys, covers WAL segments <= "
+                  << sealed << std::endl;
+        return true;
+    }
+
+    void Store::snapshotLoop() {
+        std::unique_lock<std::mutex> lock(background_mutex_);
+        while (!stopping_) {
+            background_cv_.wait_for(lock, std::chrono::seconds(snapshot_interval_sec_),
+                                  [this] { return stopping_; });
+            if (stopping_) break;
+
+            // Nothing was written since the last snapshot; it is still current
+            uint64_t lsn = wal_->lastLsn();
+            if (lsn == snapshot_lsn_) continue;
+
+            lock.unlock();
+            bool ok = snapshot();
+            lock.lock();
+            if (ok) {
+                snapshot_lsn_ = lsn;
+            }
+        }
+    }
+
+    std::vector<size_t> Store::lockOrder(std::vector<size_t> indices) {
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        return indices;
+    }
+
+    void Store::setMany(const std::vector<std::pair<std::string_view, std::string_view>>& items) {
+        if (items.empty()) return;
+
+        std::vector<size_t> indices(items.size());
+        std::vector<Encoded> encoded(items.size());
+        std::vector<WAL::Entry> ops;
+        ops.reserve(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            indices[i] = shardIndex(items[i].first);
+            encode(items[i].second, encoded[i]);
+            ops.push_back({setOperation(encoded[i]), items[i].first, encoded[i].value});
+        }
+
+        uint64_t lsn = 0;
+        {
+            std::vector<std::unique_lock<std::shared_mutex>> locks;
+            for (size_t index : lockOrder(indices)) {
+                locks.emplace_back(shards_[index].mutex);
+            }
+
+            if (wal_) {
+                lsn = wal_->appendBatch(ops);
+            }
+
+            for (size_t i = 0; i < items.size(); ++i) {
+                Shard& shard = shards_[indices[i]];
+                upsert(shard, items[i].first, encoded[i].value, encoded[i].compressed);
+                clearDeadline(shard, items[i].first);
+            }
+        }
+
         if (wal_) {
-            wal_->logDelete(key);
+            waitLogged(lsn);
+        }
+        if (max_memory_ > 0) {
+            std::vector<std::string_view> written;
+            written.reserve(items.size());
+            for (const auto& item : items) {
+                written.push_back(item.first);
+            }
+            evictIfNeeded(written.data(), written.size());
+        }
+    }
+
+    size_t Store::removeMany(const std::vector<std::string_view>& keys) {
+        if (keys.empty()) return 0;
+
+        std::vector<size_t> indices(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            indices[i] = shardIndex(keys[i]);
+        }
+
+        uint64_t lsn = 0;
+        size_t removed = 0;
+        std::vector<WAL::Entry> ops;
+        {
+            std::vector<std::unique_lock<std::shared_mutex>> locks;
+            for (size_t index : lockOrder(indices)) {
+                locks.emplace_back(shards_[index].mutex);
+            }
+
+            // Only keys that actually existed are logged. Nobody can observe
+            // the shards until the locks are released, so logging after the
+            // erase is equivalent to logging before it. Expired keys are
+            // deleted too but not counted.
+            for (size_t i = 0; i < keys.size(); ++i) {
+                Shard& shard = shards_[indices[i]];
+                Slot* slot = shard.data.find(keys[i]);
+                if (!slot) continue;
+
+                if (!isExpired(shard, keys[i])) ++removed;
+                erase(shard, slot);
+                ops.push_back({WALOperation::DELETE, keys[i], std::string_view()});
+            }
+
+            if (wal_ && !ops.empty()) {
+                lsn = wal_->appendBatch(ops);
+            }
+        }
+
+        if (wal_ && !ops.empty()) {
+            waitLogged(lsn);
+        }
+        return removed;
+    }
+
+    size_t Store::transact(const std::vector<WriteOp>& ops) {
+        if (ops.empty()) return 0;
+
+        const int64_t now = nowMs();
+        std::vector<size_t> indices(ops.size());
+        std::vector<Encoded> encoded(ops.size());
+        std::vector<std::array<char, WAL::kDeadlineSize>> deadlines(ops.size());
+        std::vector<WAL::Entry> log;
+        log.reserve(ops.size());
+        for (size_t i = 0; i < ops.size(); ++i) {
+            const WriteOp& op = ops[i];
+            indices[i] = shardIndex(op.key);
+            if (op.remove) {
+                log.push_back({WALOperation::DELETE, op.key, std::string_view()});
+                continue;
+            }
+            encode(op.value, encoded[i]);
+            log.push_back({setOperation(encoded[i]), op.key, encoded[i].value});
+            if (op.ttl_ms > 0) {
+                WAL::encodeDeadline(deadlineAfter(now, op.ttl_ms), deadlines[i].data());
+                log.push_back({WALOperation::EXPIRE_AT, op.key,
+                               std::string_view(deadlines[i].data(), deadlines[i].size())});
+            }
+        }
+
+        uint64_t lsn = 0;
+        size_t removed = 0;
+        {
+            std::vector<std::unique_lock<std::shared_mutex>> locks;
+            for (size_t index : lockOrder(indices)) {
+                locks.emplace_back(shards_[index].mutex);
+            }
+
+            // Deletes are logged whether or not the key exists yet, since an
+            // earlier op in the same batch may create it
+            if (wal_) {
+                lsn = wal_->appendBatch(log);
+            }
+
+            for (size_t i = 0; i < ops.size(); ++i) {
+                const WriteOp& op = ops[i];
+                Shard& shard = shards_[indices[i]];
+                if (op.remove) {
+                    Slot* slot = shard.data.find(op.key);
+                    if (!slot) continue;
+                    if (!isExpired(shard, op.key)) ++removed;
+                    erase(shard, slot);
+                    continue;
+                }
+
+                upsert(shard, op.key, encoded[i].value, encoded[i].compressed);
+                if (op.ttl_ms > 0) {
+                    setDeadline(shard, op.key, deadlineAfter(now, op.ttl_ms));
+                } else {
+                    clearDeadline(shard, op.key);
+                }
+            }
         }
 
-        std::unique_lock<std::shared_mutex> lock(mutex_);
-        return data_.erase(key) > 0;
+        if (wal_) {
+            waitLogged(lsn);
+        }
+        if (max_memory_ > 0) {
+            std::vector<std::string_view> written;
+            for (const WriteOp& op : ops) {
+                if (!op.remove) written.push_back(op.key);
+            }
+            evictIfNeeded(written.data(), written.size());
+        }
+        return removed;
     }
 
     size_t Store::size() const {
-        std::shared_lock<std::shared_mutex> lock(mutex_);
-        return data_.size();
+        // Hold every shard lock at once so the count is a consistent snapshot,
+        // as it was with a single global lock. Locks are always taken in shard
+        // order, so this cannot deadlock with clear().
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        locks.reserve(shards_.size());
+        size_t total = 0;
+        for (const auto& shard : shards_) {
+            locks.emplace_back(shard.mutex);
+            total += shard.data.size();
+        }
+        return total;
     }
 
     void Store::clear() {
-        std::unique_lock<std::shared_mutex> lock(mutex_);
-        data_.clear();
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        locks.reserve(shards_.size());
+        for (auto& shard : shards_) {
+            locks.emplace_back(shard.mutex);
+        }
+        for (auto& shard : shards_) {
+            clearShard(shard);
+        }
+    }
+
+    void Store::clearShard(Shard& shard) {
+        releaseValues(shard);
+        shard.data.clear();
+        shard.expires.clear();
+        shard.expiry_heap = ExpiryHeap();
+        shard.index.clear();
+        used_memory_.fetch_sub(shard.memory, std::memory_order_relaxed);
+        shard.memory = 0;
     }
 
-} // namespace kvstore
\ No newline at end of file
+} // namespace kvstore
@@ -1,33 +1,652 @@
 #pragma once
 
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <atomic>
+#include <queue>
+#include <functional>
 #include <shared_mutex>
 #include <optional>
 #include <memory>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include "wal.h"
+#include "btree.h"
+#include "flat_map.h"
+#include "slab.h"
 
 namespace kvstore {
 
+    // Which key is evicted when the store is over max_memory. LRU and LFU
+    // are approximate: the victim is the best of a few randomly sampled keys.
+    enum class EvictionPolicy : uint8_t {
+        LRU,     // least recently accessed
+        LFU,     // least frequently accessed (logarithmic, decaying counter)
+        RANDOM
+    };
+
+    struct StoreConfig {
+        std::string wal_filename = "kvstore.wal";
+
+        // Number of independent shards. Each shard has its own lock and map,
+        // so writers to different shards never block each other.
+        size_t num_shards = 16;
+
+        WALConfig wal;
+
+        // Seconds between background snapshots; 0 disables them. Each
+        // snapshot lets the WAL segments it covers be deleted, which bounds
+        // recovery time by the size of the live data.
+        int snapshot_interval_sec = 300;
+
+        // Threads used to apply the snapshot and WAL on startup; 0 means one
+        // per core. Capped at num_shards since each thread owns whole shards.
+        size_t recovery_threads = 0;
+
+        // How often the active expirer looks for due keys. Each pass deletes
+        // a bounded number of keys per shard, so it never holds a shard lock
+        // for long; expired keys are also deleted lazily when read.
+        int expire_interval_ms = 100;
+
+        // Upper bound on the bytes held by keys, values and the hash tables;
+        // 0 means unlimited. Writes that push the store over it evict
+        // a bounded number of keys each, so the cost is spread across
+        // writers instead of paid in one pause.
+        size_t max_memory = 0;
+        EvictionPolicy eviction = EvictionPolicy::LRU;
+        size_t eviction_samples = 5;
+
+        // The store follows a primary and must change only as the primary's
+        // log says. Local eviction and expiry are disabled, whatever
+        // max_memory and expire_interval_ms are; the primary's evictions and
+        // expiries arrive as ordinary deletes. Expired keys are hidden from
+        // reads until then.
+        bool replica = false;
+
+        // Keep every shard's keys in a B+tree as well, for SCAN and PREFIX.
+        // Costs a second copy of each key and a tree insert per new key;
+        // point reads never touch it.
+        bool ordered_index = true;
+
+        // Values of at least this many bytes are compressed before they are
+        // logged and stored, if that saves an eighth or more; 0 disables it.
+        // Reads decompress unless the caller takes the stored form. Values
+        // over 512 KiB are never compressed, since every read of a slice of
+        // one would decompress it whole.
+        size_t compress_threshold = 0;
+
+        // Recover from a damaged snapshot by loading what can be read of it,
+        // rather than refusing to start. The keys past the damage are lost
+        // for good, as the WAL segments the snapshot covered are gone.
+        bool salvage_snapshot = false;
+    };
+
     class Store {
     public:
         Store();
         explicit Store(const std::string& wal_filename);
+        explicit Store(const StoreConfig& config);
+        ~Store();
+
+        Store(const Store&) = delete;
+        Store& operator=(const Store&) = delete;
+
+        // A plain set() clears any expiry the key had
+        void set(std::string_view key, std::string_view value);
+        std::optional<std::string> get(std::string_view key);
+        bool remove(std::string_view key);
+
+        // SET with a time to live: the key expires ttl_ms from now. TTLs
+        // over kMaxTtlMs (about a century) are cut down to it, so a deadline
+        // always fits in 64 bits.
+        static constexpr int64_t kMaxTtlMs = 100LL * 365 * 24 * 3600 * 1000;
+        void set(std::string_view key, std::string_view value, int64_t ttl_ms);
+
+        // Give an existing key a time to live; ttl_ms <= 0 deletes it now.
+        // Returns false if the key does not exist.
+        bool expire(std::string_view key, int64_t ttl_ms);
+
+        // Milliseconds the key has left, kNoExpiry if it never expires, or
+        // nullopt if it does not exist
+        static constexpr int64_t kNoExpiry = -1;
+        std::optional<int64_t> ttl(std::string_view key);
+
+        // Zero-copy GET: calls fn(std::string_view value) under the shard's
+        // read lock instead of copying the value out. fn must not call back
+        // into the store. Returns false if the key does not exist. A
+        // compressed value is decompressed into a per-thread buffer first.
+        template <typename Fn>
+        bool read(std::string_view key, Fn&& fn);
+
+        // read() without the decompression: calls fn(value, compressed) with
+        // the value as stored, for callers that pass it on compressed
+        template <typename Fn>
+        bool readStored(std::string_view key, Fn&& fn);
+
+        // read() with fn(value, version), for a later compareAndSwap()
+        template <typename Fn>
+        bool readVersioned(std::string_view key, Fn&& fn);
+
+        // Atomic read-modify-write. Each takes the key's shard lock once and
+        // logs the value it produces as one SET record, so replaying the log
+        // never depends on the value it started from. Expired keys count as
+        // missing.
+
+        // Adds delta to the value read as a signed 64-bit decimal (a missing
+        // key counts as 0) and returns the result. Returns nullopt and leaves
+        // the key alone if the value is not such a number or the sum
+        // overflows. Keeps the key's expiry.
+        std::optional<int64_t> incrBy(std::string_view key, int64_t delta);
+
+        // Appends suffix to the value, creating the key if it is missing, and
+        // returns the new length. Keeps the key's expiry.
+        size_t append(std::string_view key, std::string_view suffix);
 
-        void set(const std::string& key, const std::string& value);
-        std::optional<std::string> get(const std::string& key);
-        bool remove(const std::string& key);
+        // set() that returns the previous value, or nullopt if there was none
+        std::optional<std::string> getSet(std::string_view key, std::string_view value);
+
+        // Every write gives the key a new version number. Sets the value only
+        // if the key's version is still expected, where 0 means the key must
+        // not exist. version receives the new version on success, and the
+        // current one (0 if missing) otherwise. Versions are not persisted,
+        // so they change across a restart.
+        bool compareAndSwap(std::string_view key, uint32_t expected, std::string_view value, uint32_t& version);
+
+        // Batch operations. Each takes every touched shard lock once, in shard
+        // order, and holds them together, so a batch is applied atomically.
+        // Writes are logged as a single WAL record.
+        void setMany(const std::vector<std::pair<std::string_view, std::string_view>>& items);
+        size_t removeMany(const std::vector<std::string_view>& keys);
+
+        // One write of a transaction: a set, with a time to live if
+        // ttl_ms > 0, or a delete if remove is true
+        struct WriteOp {
+            std::string_view key;
+            std::string_view value;
+            int64_t ttl_ms = 0;
+            bool remove = false;
+        };
+
+        // Applies a mix of sets and deletes, in order, as one batch: readers
+        // see all of them or none, and they share one WAL record, so
+        // recovery does too. Returns how many deletes removed a live key.
+        size_t transact(const std::vector<WriteOp>& ops);
+
+        // Calls fn(index, found, value) for each key, in order, under shared
+        // locks on all touched shards
+        template <typename Fn>
+        void readMany(const std::vector<std::string_view>& keys, Fn&& fn);
+
+        // readMany() with fn(index, found, value, compressed) and values as
+        // stored, like readStored()
+        template <typename Fn>
+        void readManyStored(const std::vector<std::string_view>& keys, Fn&& fn);
+
+        // Ordered range scan: calls fn(key, value) for up to limit live keys
+        // in [start, end), in key order; an empty end means no upper bound.
+        // fn returns false to end the page before key, which the next one
+        // then starts with. Returns the start for the next page, or "" once
+        // the range is exhausted. All shards are read-locked while it runs, so callers
+        // should keep limit modest. Expired keys awaiting collection are
+        // stepped over but count toward a budget of kScanBudgetFactor keys
+        // examined per requested key; a page that runs out of budget comes
+        // back short, possibly empty, with a cursor all the same. Requires
+        // the ordered index.
+        template <typename Fn>
+        std::string scan(std::string_view start, std::string_view end, size_t limit, Fn&& fn);
+
+        // Exclusive upper bound of the keys starting with prefix, for scan();
+        // empty if there is none (the prefix is all 0xff bytes)
+        static std::string prefixEnd(std::string_view prefix);
+
+        bool hasOrderedIndex() const { return ordered_index_; }
+
+        // Directory holding the WAL and snapshots
+        std::string dataDirectory() const;
+
+        // Includes expired keys that have not been collected yet
         size_t size() const;
         void clear();
 
-        // Recover from WAL
+        size_t shardCount() const { return shards_.size(); }
+
+        // Recover from the latest snapshot plus the WAL segments after it
         void recover();
 
+        // False if recovery found the WAL damaged anywhere but at its end,
+        // or the snapshot damaged without salvage_snapshot. It then stopped
+        // there rather than go on from a hole in the history; no snapshots
+        // or expiries run, so the files stay as they were found.
+        bool recovered() const { return recovered_; }
+
+        // Write a point-in-time snapshot and drop the WAL segments it covers.
+        // Writers are only blocked while their own shard is being copied.
+        bool snapshot();
+
+        // Replication. The primary hands every record its WAL writes to the
+        // sink, and dump() describes the whole store as SET and EXPIRE_AT
+        // entries, copying one shard at a time; a dump taken after the sink
+        // started receiving, followed by those records, rebuilds the store
+        // because replaying any record twice has no further effect. A
+        // replica applies what it receives with applyReplicated(), which
+        // logs it like any other write and returns once it is durable.
+        void setWalSink(WAL::RecordSink sink);
+        void dump(const WAL::Visitor& visit);
+        void applyReplicated(const std::vector<WAL::Entry>& entries);
+
+        // Replaces the whole store with the one that records (framed WAL
+        // records, like a dump) describe, for a replica's full sync. The new
+        // copy is built apart from the live shards, written out as the
+        // snapshot and then swapped in under every shard lock, so readers
+        // and recovery alike see the old copy or the new. Nothing is logged
+        // or passed to the WAL sink. Returns false, leaving the store as it
+        // was, if records are corrupt or memory or the snapshot fails. The
+        // caller must be the only writer while it runs, as a replica's
+        // replication thread is.
+        bool replaceWith(std::string_view records);
+
+        // Delete expired keys, at most max_per_shard from each shard. Returns
+        // the number deleted. Called periodically by the expirer thread,
+        // which a replica does not run.
+        size_t expireDue(size_t max_per_shard);
+
+        // True once a write could not be logged as durably as the WAL's
+        // durability mode requires. The failure is permanent: the write it
+        // hit, and any after it, may be lost on restart, so none of them
+        // must be acknowledged as done.
+        bool logFailed() const { return log_failed_.load(std::memory_order_relaxed); }
+
+        // Bytes accounted to live entries, and keys evicted so far
+        size_t usedMemory() const { return used_memory_.load(std::memory_order_relaxed); }
+        uint64_t evictedKeys() const { return evicted_keys_.load(std::memory_order_relaxed); }
+
+        // Live value bytes against the slab memory holding them, summed over
+        // all shards
+        struct MemoryStats {
+            size_t value_bytes = 0;
+            SlabAllocator::Stats slab;
+
+            // Touched slab bytes per live value byte; 1.0 means no overhead
+            double fragmentation() const;
+        };
+        MemoryStats memoryStats() const;
+
+        // The WAL flusher's counters, or nullptr when there is no WAL
+        const WAL::Stats* walStats() const { return wal_ ? &wal_->stats() : nullptr; }
+
+        // Parses "lru", "lfu" or "random"
+        static bool parseEvictionPolicy(const std::string& name, EvictionPolicy& policy);
+
     private:
-        mutable std::shared_mutex mutex_;
-        std::unordered_map<std::string, std::string> data_;
+        static constexpr size_t kScanBudgetFactor = 8;
+
+        // Largest value that is compressed; the size of a GETRANGE slice
+        static constexpr size_t kMaxCompressedSize = 512 * 1024;
+
+        // (deadline, key), ordered earliest first
+        using ExpiryEntry = std::pair<int64_t, std::string>;
+        using ExpiryHeap = std::priority_queue<ExpiryEntry, std::vector<ExpiryEntry>,
+                                               std::greater<ExpiryEntry>>;
+
+        // A stored value plus what eviction needs to know about it. The value
+        // lives in a chunk of the shard's slab allocator, which the store
+        // frees explicitly. The access metadata is updated by readers holding
+        // only the shared lock, hence the (relaxed) atomics; it is only
+        // maintained when a memory limit is set. Items are moved when the
+        // table grows, which only happens under the exclusive lock.
+        struct Item {
+            Item() = default;
+            Item(Item&& other) noexcept
+                : data(other.data), size(other.size), version(other.version),
+                  access(other.access.load(std::memory_order_relaxed)),
+                  frequency(other.frequency.load(std::memory_order_relaxed)),
+                  compressed(other.compressed) {
+                other.data = nullptr;
+                other.size = 0;
+            }
+
+            std::string_view view() const { return std::string_view(data, size); }
+
+            // The slab chunk is always exactly the size class of the value
+            size_t capacity() const { return SlabAllocator::capacityFor(size); }
+
+            char* data = nullptr;
+            uint32_t size = 0;
+            uint32_t version = 0;    // changes on every write; see CAS
+            mutable std::atomic<uint32_t> access{0};   // lruClock() of last access
+            mutable std::atomic<uint8_t> frequency{0};  // LFU counter
+            bool compressed = false;  // data is Compression's compressed form
+        };
+
+        // A value in the form it is logged and stored in. value may point
+        // into buffer, so it is not copyable.
+        struct Encoded {
+            Encoded() = default;
+            Encoded(const Encoded&) = delete;
+            Encoded& operator=(const Encoded&) = delete;
+
+            std::string_view value;
+            bool compressed = false;
+            std::string buffer;   // holds value when it was compressed
+        };
+
+        // Compresses value if it is over the threshold and compresses well.
+        // Call before taking any lock; the result views value or buffer.
+        void encode(std::string_view value, Encoded& out) const;
+        static WALOperation setOperation(const Encoded& encoded) {
+            return encoded.compressed ? WALOperation::SET_COMPRESSED : WALOperation::SET;
+        }
+
+        // The plain value of item, decompressed into a per-thread buffer if
+        // need be; valid until the next call on the same thread or the next
+        // trimDecoded(), which frees the buffer if it has grown past
+        // kMaxCompressedSize
+        static std::string_view decoded(const Item& item);
+        static void trimDecoded();
+        static std::string& decodeBuffer();
+
+        // Runs fn(current, value) under the key's exclusive lock, where
+        // current is the live item or nullptr. If fn returns true, the key is
+        // set to value and the write is logged and waited for. Returns the
+        // key's new version, or 0 if fn declined. keep_deadline carries an
+        // existing expiry over to the new value.
+        template <typename Fn>
+        uint32_t update(std::string_view key, bool keep_deadline, Fn&& fn);
+
+        // Lookups behind read() and readMany(): fn gets the live, unexpired
+        // item (or nullptr for a missing key in readItems) under the lock
+        template <typename Fn>
+        bool readItem(std::string_view key, Fn&& fn);
+        template <typename Fn>
+        void readItems(const std::vector<std::string_view>& keys, Fn&& fn);
+
+        // Key and item share one 48-byte slot
+        using ItemMap = FlatMap<Item>;
+        using Slot = ItemMap::Slot;
+
+        // Aligned to a cache line so that locks of neighbouring shards do not
+        // false-share.
+        struct alignas(64) Shard {
+            mutable std::shared_mutex mutex;
+            ItemMap data;
+            SlabAllocator values;   // storage for data's values
+            size_t value_bytes = 0; // sum of the live values' sizes
+            BPlusTree index;     // the same keys, ordered; empty if disabled
+            size_t memory = 0;   // bytes accounted to this shard's entries
+            uint32_t version_clock = 0;  // last version handed out
+
+            // Deadlines of the keys that expire, and a min-heap over them for
+            // the active expirer. Changing or clearing a deadline leaves the
+            // old heap entry behind; entries that disagree with `expires`
+            // are stale and skipped. A FlatMap so that the read path can
+            // look a key up by string_view without copying it.
+            FlatMap<int64_t> expires;
+            ExpiryHeap expiry_heap;
+        };
+
+        size_t shardIndex(std::string_view key) const;
+        Shard& shardFor(std::string_view key);
+        const Shard& shardFor(std::string_view key) const;
+
+        // Sorted, de-duplicated shard indices: the lock order for a batch
+        static std::vector<size_t> lockOrder(std::vector<size_t> indices);
+        void applyRecovered(Shard& shard, const WAL::Entry& entry);
+        void snapshotLoop();
+
+        // Calls fn(key, value, deadline_ms, compressed) for every key, with
+        // the value as stored and a deadline of 0 if it does not expire.
+        // Each shard is copied under its read lock and fn runs outside it.
+        template <typename Fn>
+        void forEachCopied(Fn&& fn);
+
+        // Wall-clock milliseconds since the Unix epoch; deadlines are absolute
+        // so they mean the same thing after a restart
+        static int64_t nowMs();
+
+        // now_ms + ttl_ms with the TTL clamped to [0, kMaxTtlMs]
+        static int64_t deadlineAfter(int64_t now_ms, int64_t ttl_ms);
+
+        // Wait for the record at lsn, noting in log_failed_ if it is lost
+        void waitLogged(uint64_t lsn);
+
+        // Expiry bookkeeping; the caller holds the shard lock (exclusively,
+        // except for isExpired)
+        static bool isExpired(const Shard& shard, std::string_view key);
+        static void setDeadline(Shard& shard, std::string_view key, int64_t deadline_ms);
+        static void clearDeadline(Shard& shard, std::string_view key);
+
+        // Version for the next write to the shard, under its exclusive lock
+        static uint32_t nextVersion(Shard& shard);
+
+        // Delete a key that a reader found expired, unless it was rewritten
+        // in the meantime. Does nothing on a replica.
+        void expireKey(std::string_view key);
+        void expireLoop();
+
+        // Insert or overwrite key, keeping the memory accounting current.
+        // Does not touch the key's deadline. Caller holds the lock exclusively.
+        Slot* upsert(Shard& shard, std::string_view key, std::string_view value, bool compressed = false);
+
+        // Remove an entry along with its deadline and accounted memory
+        void erase(Shard& shard, Slot* slot);
+
+        // Copy value into the item's slab chunk, reallocating it unless the
+        // size class stays the same
+        static void assignValue(Shard& shard, Item& item, std::string_view value, bool compressed);
+
+        // Free every value's chunk; the caller clears or destroys the map next
+        static void releaseValues(Shard& shard);
+
+        // Drop every key of the shard, under its exclusive lock
+        void clearShard(Shard& shard);
+
+        // Exchange everything but the locks; see replaceWith()
+        static void swapContents(Shard& a, Shard& b) noexcept;
+
+        // Bytes an entry is accounted beyond its table slot: key and value
+        // allocations and the index's key copy. The slot arrays themselves
+        // are accounted as a whole, as they grow and shrink.
+        size_t entrySize(const Slot& slot) const;
+        void account(Shard& shard, size_t before, size_t after);
+
+        // Record an access for the eviction policy
+        void touch(const Item& item) const;
+
+        // Evict until back under max_memory, but at most a few keys per call.
+        // The keys just written are never chosen, so a write cannot evict
+        // its own result.
+        void evictIfNeeded(std::string_view written) { evictIfNeeded(&written, 1); }
+        void evictIfNeeded(const std::string_view* written, size_t count);
+        bool evictOne(const std::string_view* spared, size_t count);
+        static uint32_t lruClock();
+        static uint8_t decayedFrequency(const Item& item, uint32_t now);
+
+        std::vector<Shard> shards_;
         std::string wal_filename_;
+        std::string snapshot_filename_;
         std::unique_ptr<WAL> wal_;
+
+        size_t recovery_threads_;
+        int snapshot_interval_sec_;
+        int expire_interval_ms_;
+        size_t max_memory_;
+        EvictionPolicy eviction_;
+        size_t eviction_samples_;
+        bool ordered_index_;
+        size_t compress_threshold_;
+        bool salvage_snapshot_;
+        bool replica_;
+        bool recovered_ = true;
+        std::atomic<bool> log_failed_{false};
+        std::atomic<size_t> used_memory_{0};
+        std::atomic<uint64_t> evicted_keys_{0};
+        std::mutex snapshot_mutex_;          // one snapshot at a time
+        std::mutex background_mutex_;        // stopping_, snapshot_lsn_
+        std::condition_variable background_cv_;
+        bool stopping_ = false;
+        uint64_t snapshot_lsn_ = UINT64_MAX;  // WAL position of the last snapshot
+        std::thread snapshot_thread_;
+        std::thread expire_thread_;
     };
 
-} // namespace kvstore
\ No newline at end of file
+    template <typename Fn>
+    bool Store::read(std::string_view key, Fn&& fn) {
+        return readItem(key, [&fn](const Item& item) {
+            fn(decoded(item));
+            trimDecoded();
+        });
+    }
+
+    template <typename Fn>
+    bool Store::readStored(std::string_view key, Fn&& fn) {
+        return readItem(key, [&fn](const Item& item) {
+            fn(item.view(), item.compressed);
+        });
+    }
+
+    template <typename Fn>
+    bool Store::readVersioned(std::string_view key, Fn&& fn) {
+        return readItem(key, [&fn](const Item& item) {
+            fn(decoded(item), item.version);
+            trimDecoded();
+        });
+    }
+
+    template <typename Fn>
+    bool Store::readItem(std::string_view key, Fn&& fn) {
+        Shard& shard = shardFor(key);
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            const Slot* slot = shard.data.find(key);
+            if (!slot) {
+                return false;
+            }
+            if (!isExpired(shard, key)) {
+                touch(slot->value);
+                fn(slot->value);
+                return true;
+            }
+        }
+
+        // Expired but not collected yet: delete it now that we know
+        expireKey(key);
+        return false;
+    }
+
+    template <typename Fn>
+    void Store::readMany(const std::vector<std::string_view>& keys, Fn&& fn) {
+        readItems(keys, [&fn](size_t i, const Item* item) {
+            fn(i, item != nullptr, item ? decoded(*item) : std::string_view());
+        });
+        trimDecoded();
+    }
+
+    template <typename Fn>
+    void Store::readManyStored(const std::vector<std::string_view>& keys, Fn&& fn) {
+        readItems(keys, [&fn](size_t i, const Item* item) {
+            if (item) {
+                fn(i, true, item->view(), item->compressed);
+            } else {
+                fn(i, false, std::string_view(), false);
+            }
+        });
+    }
+
+    template <typename Fn>
+    void Store::readItems(const std::vector<std::string_view>& keys, Fn&& fn) {
+        std::vector<size_t> indices(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            indices[i] = shardIndex(keys[i]);
+        }
+
+        std::vector<std::string_view> expired;
+        {
+            std::vector<std::shared_lock<std::shared_mutex>> locks;
+            for (size_t index : lockOrder(indices)) {
+                locks.emplace_back(shards_[index].mutex);
+            }
+
+            for (size_t i = 0; i < keys.size(); ++i) {
+                const Shard& shard = shards_[indices[i]];
+                const Slot* slot = shard.data.find(keys[i]);
+                if (slot && isExpired(shard, keys[i])) {
+                    expired.push_back(keys[i]);
+                    slot = nullptr;
+                }
+                if (slot) {
+                    touch(slot->value);
+                }
+                fn(i, slot ? &slot->value : nullptr);
+            }
+        }
+
+        for (std::string_view key : expired) {
+            expireKey(key);
+        }
+    }
+
+    template <typename Fn>
+    std::string Store::scan(std::string_view start, std::string_view end, size_t limit, Fn&& fn) {
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        locks.reserve(shards_.size());
+        for (auto& shard : shards_) {
+            locks.emplace_back(shard.mutex);
+        }
+
+        // k-way merge of the shards' indexes, smallest key on top
+        struct Head {
+            BPlusTree::Iterator it;
+            const Shard* shard;
+        };
+        auto later = [](const Head& a, const Head& b) { return a.it.key() > b.it.key(); };
+        std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+        for (const auto& shard : shards_) {
+            auto it = shard.index.lowerBound(start);
+            if (it.valid()) {
+                heads.push({it, &shard});
+            }
+        }
+
+        const size_t budget = limit > SIZE_MAX / kScanBudgetFactor ? SIZE_MAX : limit * kScanBudgetFactor;
+        size_t emitted = 0;
+        size_t examined = 0;
+        const std::string* last = nullptr;
+        while (!heads.empty()) {
+            Head head = heads.top();
+            const std::string& key = head.it.key();
+            if (!end.empty() && key >= end) {
+                break;
+            }
+            if (emitted == limit) {
+                // More remain; the next page starts just after the last key
+                return last ? *last + '\0' : std::string(start);
+            }
+            if (examined == budget) {
+                // Mostly expired keys so far; resume with this one
+                return key;
+            }
+            heads.pop();
+            ++examined;
+
+            const Slot* found = head.shard->data.find(key);
+            if (found && !isExpired(*head.shard, key)) {
+                if (!fn(std::string_view(key), decoded(found->value))) {
+                    return key;
+                }
+                last = &key;
+                ++emitted;
+            }
+
+            head.it.next();
+            if (head.it.valid()) {
+                heads.push(head);
+            }
+        }
+        return std::string();
+    }
+
+} // namespace kvstore
@@ -2,111 +2,755 @@
 // Created by Owner on 11/4/2025.
 //
 #include "wal.h"
+#include "mapped_file.h"
+#include "crc32c.h"
 #include <iostream>
 #include <vector>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <filesystem>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace kvstore {
 
-WAL::WAL(const std::string& filename) : filename_(filename) {
-    file_.open(filename_, std::ios::binary | std::ios::app);
-    if (!file_.is_open()) {
-        std::cerr << "Failed to open WAL file: " << filename_ << std::endl;
+namespace fs = std::filesystem;
+
+namespace {
+    // Writers stall in append() once this much is waiting for the flusher, so
+    // a slow disk cannot make the batch grow without bound.
+    constexpr size_t kMaxPendingBytes = 64 * 1024 * 1024;
+
+    const char kMagic[6] = {'K', 'V', 'W', 'L', 'O', 'G'};
+    constexpr uint16_t kVersion = 2;
+    constexpr size_t kHeaderSize = 8;
+    constexpr size_t kRecordHeaderSize = 8;   // crc32c + length
+    constexpr size_t kMinPayloadSize = 9;     // op + two empty strings
+
+    uint32_t getUint32(const uint8_t* data) {
+        uint32_t net_val;
+        std::memcpy(&net_val, data, 4);
+        return ntohl(net_val);
+    }
+
+    void putUint32(std::vector<uint8_t>& buf, uint32_t val) {
+        uint32_t net_val = htonl(val);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&net_val);
+        buf.insert(buf.end(), bytes, bytes + 4);
     }
 }
 
+WAL::WAL(const std::string& filename) : WAL(filename, WALConfig{}) {
+}
+
+WAL::WAL(const std::string& filename, const WALConfig& config)
+    : filename_(filename), config_(config) {
+    config_.segment_size = std::max(kBlockSize,
+                                    (config_.segment_size + kBlockSize - 1) / kBlockSize * kBlockSize);
+
+    auto segments = listSegments(filename_);
+    segment_id_ = segments.empty() ? 1 : segments.back().id + 1;
+
+    fd_ = openSegment(segment_id_);
+    if (fd_ < 0) {
+        return;
+    }
+
+    flusher_ = std::thread(&WAL::flusherLoop, this);
+}
+
 WAL::~WAL() {
-    if (file_.is_open()) {
-        file_.close();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    flush_cv_.notify_one();
+
+    if (flusher_.joinable()) {
+        flusher_.join();
     }
+
+    if (fd_ >= 0) {
+        sealSegment();
+        fd_ = -1;
+    }
+    std::free(io_buffer_);
 }
 
-bool WAL::writeEntry(WALOperation op, const std::string& key, const std::string& value) {
-    if (!file_.is_open()) return false;
+std::string WAL::segmentPath(const std::string& base, uint64_t id) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%06llu", static_cast<unsigned long long>(id));
+    return base + suffix;
+}
 
-    std::lock_guard<std::mutex> lock(mutex_);
+std::vector<WAL::Segment> WAL::listSegments(const std::string& base) {
+    std::vector<Segment> segments;
+
+    fs::path base_path(base);
+    fs::path dir = base_path.has_parent_path() ? base_path.parent_path() : fs::path(".");
+    const std::string prefix = base_path.filename().string() + ".";
+
+    std::error_code ec;
+    if (fs::exists(base_path, ec)) {
+        segments.push_back({0, base});
+    }
+
+    for (const auto& dirent : fs::directory_iterator(dir, ec)) {
+        std::string name = dirent.path().filename().string();
+        if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        std::string digits = name.substr(prefix.size());
+        if (digits.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+        uint64_t id = std::strtoull(digits.c_str(), nullptr, 10);
+        if (id > 0) {
+            segments.push_back({id, segmentPath(base, id)});
+        }
+    }
+
+    std::sort(segments.begin(), segments.end(),
+              [](const Segment& a, const Segment& b) { return a.id < b.id; });
+    return segments;
+}
+
+void WAL::removeSegments(const std::string& base, uint64_t up_to) {
+    for (const auto& segment : listSegments(base)) {
+        if (segment.id > up_to) break;
+        if (::unlink(segment.path.c_str()) != 0) {
+            std::cerr << "Failed to remove WAL segment " << segment.path
+                      << ": " << strerror(errno) << std::endl;
+        }
+    }
+}
+
+int WAL::openSegment(uint64_t id) {
+    std::string path = segmentPath(filename_, id);
+    const int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    int fd = ::open(path.c_str(), flags | (config_.direct_io ? O_DIRECT : 0), 0644);
+    if (fd < 0 && config_.direct_io && errno == EINVAL) {
+        std::cerr << "WAL: O_DIRECT not supported for " << path
+                  << ", using buffered writes" << std::endl;
+        config_.direct_io = false;
+        fd = ::open(path.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        std::cerr << "Failed to open WAL file: " << path
+                  << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // Without preallocation (file systems lacking fallocate) the writes
+    // still work; they just extend the file as they go.
+    if (::fallocate(fd, 0, 0, static_cast<off_t>(config_.segment_size)) != 0) {
+        std::cerr << "WAL fallocate error: " << strerror(errno) << std::endl;
+    }
+    allocated_ = config_.segment_size;
+    block_offset_ = 0;
+
+    // The header goes out right away, so even an empty segment is valid
+    uint8_t header[kHeaderSize];
+    std::memcpy(header, kMagic, sizeof(kMagic));
+    header[6] = static_cast<uint8_t>(kVersion >> 8);
+    header[7] = static_cast<uint8_t>(kVersion);
+    if (!reserveIoBuffer(kBlockSize)) {
+        ::close(fd);
+        return -1;
+    }
+    std::memset(io_buffer_, 0, kBlockSize);
+    std::memcpy(io_buffer_, header, kHeaderSize);
+    if (!writeIoBuffer(fd, 0, kBlockSize)) {
+        ::close(fd);
+        return -1;
+    }
+    partial_.assign(header, header + kHeaderSize);
+
+    // Make the new directory entry durable too, otherwise an fdatasync'd
+    // record could still vanish with its file after a power loss.
+    fs::path dir = fs::path(path).has_parent_path() ? fs::path(path).parent_path() : fs::path(".");
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+    }
+    return fd;
+}
 
+void WAL::encodeEntry(std::vector<uint8_t>& out, WALOperation op, std::string_view key, std::string_view value) {
     // Write operation type
-    uint8_t op_byte = static_cast<uint8_t>(op);
-    file_.write(reinterpret_cast<const char*>(&op_byte), 1);
+    out.push_back(static_cast<uint8_t>(op));
 
     // Write key length and key
-    uint32_t key_len = htonl(key.size());
-    file_.write(reinterpret_cast<const char*>(&key_len), 4);
-    file_.write(key.data(), key.size());
+    putUint32(out, key.size());
+    out.insert(out.end(), key.begin(), key.end());
 
     // Write value length and value
-    uint32_t value_len = htonl(value.size());
-    file_.write(reinterpret_cast<const char*>(&value_len), 4);
-    file_.write(value.data(), value.size());
+    putUint32(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+size_t WAL::beginRecord(std::vector<uint8_t>& out) {
+    size_t start = out.size();
+    out.resize(start + kRecordHeaderSize);
+    return start;
+}
+
+void WAL::endRecord(std::vector<uint8_t>& out, size_t start) {
+    uint8_t* header = out.data() + start;
+    uint32_t net_len = htonl(static_cast<uint32_t>(out.size() - start - kRecordHeaderSize));
+    std::memcpy(header + 4, &net_len, 4);
+    uint32_t net_crc = htonl(crc32c(header + 4, out.size() - start - 4));
+    std::memcpy(header, &net_crc, 4);
+}
+
+void WAL::encodeRecord(std::vector<uint8_t>& out, WALOperation op, std::string_view key, std::string_view value) {
+    size_t start = beginRecord(out);
+    encodeEntry(out, op, key, value);
+    endRecord(out, start);
+}
+
+bool WAL::decodeRecords(std::string_view records, const Visitor& visit) {
+    const auto* data = reinterpret_cast<const uint8_t*>(records.data());
+    size_t offset = 0;
+    while (offset < records.size()) {
+        std::string_view payload;
+        if (!decodeRecord(data, records.size(), offset, payload)) return false;
+
+        Entry entry;
+        size_t pos = 0;
+        const auto* bytes = reinterpret_cast<const uint8_t*>(payload.data());
+        if (!decodeEntry(bytes, payload.size(), pos, entry) || pos != payload.size()) return false;
+        visit(entry);
+    }
+    return true;
+}
+
+void WAL::setSink(RecordSink sink) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sink_ = std::move(sink);
+}
+
+uint64_t WAL::append(WALOperation op, std::string_view key, std::string_view value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0) return 0;
+
+    done_cv_.wait(lock, [this] { return pending_.size() < kMaxPendingBytes || failed_; });
 
-    // Flush to disk for durability
-    file_.flush();
+    // The flusher only sleeps when the batch is empty, so only the first
+    // writer into a fresh batch needs to wake it.
+    bool was_empty = pending_.empty();
+    encodeRecord(pending_, op, key, value);
+    uint64_t lsn = ++appended_lsn_;
 
-    return file_.good();
+    if (was_empty) {
+        flush_cv_.notify_one();
+    }
+    return lsn;
 }
 
-bool WAL::logSet(const std::string& key, const std::string& value) {
-    return writeEntry(WALOperation::SET, key, value);
+uint64_t WAL::appendBatch(const std::vector<Entry>& ops) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0) return 0;
+
+    done_cv_.wait(lock, [this] { return pending_.size() < kMaxPendingBytes || failed_; });
+
+    bool was_empty = pending_.empty();
+
+    // An ordinary record with an empty key whose value holds
+    // [count(4)] followed by count sub-record payloads
+    size_t start = beginRecord(pending_);
+    pending_.push_back(static_cast<uint8_t>(WALOperation::BATCH));
+    putUint32(pending_, 0);
+    size_t len_pos = pending_.size();
+    putUint32(pending_, 0);
+    putUint32(pending_, ops.size());
+    for (const auto& op : ops) {
+        encodeEntry(pending_, op.op, op.key, op.value);
+    }
+
+    uint32_t net_len = htonl(static_cast<uint32_t>(pending_.size() - len_pos - 4));
+    std::memcpy(pending_.data() + len_pos, &net_len, 4);
+    endRecord(pending_, start);
+
+    uint64_t lsn = ++appended_lsn_;
+
+    if (was_empty) {
+        flush_cv_.notify_one();
+    }
+    return lsn;
 }
 
-bool WAL::logDelete(const std::string& key) {
-    return writeEntry(WALOperation::DELETE, key, "");
+bool WAL::waitFor(uint64_t lsn) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0) return false;
+
+    switch (config_.durability) {
+        case Durability::NONE:
+            break;
+        case Durability::FSYNC_PER_BATCH:
+            done_cv_.wait(lock, [this, lsn] { return synced_lsn_ >= lsn || failed_; });
+            break;
+        case Durability::OS_BUFFERED:
+        case Durability::FSYNC_INTERVAL:
+            done_cv_.wait(lock, [this, lsn] { return written_lsn_ >= lsn || failed_; });
+            break;
+    }
+    return !failed_;
+}
+
+bool WAL::logSet(std::string_view key, std::string_view value) {
+    return waitFor(append(WALOperation::SET, key, value));
+}
+
+bool WAL::logDelete(std::string_view key) {
+    return waitFor(append(WALOperation::DELETE, key, ""));
 }
 
 void WAL::sync() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t target = appended_lsn_;
+    if (fd_ < 0 || synced_lsn_ >= target) return;
+
+    sync_requested_ = true;
+    flush_cv_.notify_one();
+    done_cv_.wait(lock, [this, target] { return synced_lsn_ >= target || failed_; });
+}
+
+uint64_t WAL::lastLsn() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return appended_lsn_;
+}
+
+uint64_t WAL::activeSegment() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return segment_id_;
+}
+
+uint64_t WAL::rotate() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0) return segment_id_;
+
+    // Keep the flusher out while the segment is switched. Writers are not
+    // blocked: anything they append from here on goes to the new segment.
+    done_cv_.wait(lock, [this] { return !io_busy_; });
+    io_busy_ = true;
+
+    std::vector<uint8_t> tail;
+    tail.swap(pending_);
+    uint64_t boundary_lsn = appended_lsn_;
+    bool has_sink = static_cast<bool>(sink_);
+    lock.unlock();
+
+    // The tail may itself fill the segment and roll over, so the sealed id
+    // is only known once it is written
+    bool ok = writeBlocks(tail);
+    if (ok && has_sink && !tail.empty()) {
+        sink_(tail.data(), tail.size());
+    }
+    uint64_t sealed_id = segment_id_;
+    ok = rollSegment() && ok;
+
+    lock.lock();
+    if (!ok) {
+        failed_ = true;
+    } else {
+        written_lsn_ = boundary_lsn;
+        synced_lsn_ = boundary_lsn;
+    }
+    io_busy_ = false;
+    done_cv_.notify_all();
+    flush_cv_.notify_one();
+
+    return sealed_id;
+}
+
+bool WAL::sealSegment() {
+    bool ok = true;
+    if (::ftruncate(fd_, static_cast<off_t>(block_offset_ + partial_.size())) != 0) {
+        std::cerr << "WAL truncate error: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+    if (::fdatasync(fd_) != 0) {
+        std::cerr << "WAL fdatasync error: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+    ::close(fd_);
+    return ok;
+}
+
+bool WAL::rollSegment() {
+    bool ok = sealSegment();
+    uint64_t next_id = segment_id_ + 1;
+    int fd = openSegment(next_id);
+
     std::lock_guard<std::mutex> lock(mutex_);
-    if (file_.is_open()) {
-        file_.flush();
+    fd_ = fd;
+    segment_id_ = next_id;
+    return ok && fd >= 0;
+}
+
+bool WAL::reserveIoBuffer(size_t size) {
+    if (size <= io_capacity_) return true;
+
+    std::free(io_buffer_);
+    io_capacity_ = std::max(size, io_capacity_ * 2);
+    if (posix_memalign(reinterpret_cast<void**>(&io_buffer_), kBlockSize, io_capacity_) != 0) {
+        std::cerr << "WAL: cannot allocate a " << io_capacity_ << " byte write buffer" << std::endl;
+        io_buffer_ = nullptr;
+        io_capacity_ = 0;
+        return false;
+    }
+    return true;
+}
+
+bool WAL::writeIoBuffer(int fd, uint64_t offset, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = ::pwrite(fd, io_buffer_ + written, length - written,
+                             static_cast<off_t>(offset + written));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && config_.direct_io) {
+                // Some file systems accept O_DIRECT in open() but not in write()
+                std::cerr << "WAL: O_DIRECT write rejected, using buffered writes" << std::endl;
+                config_.direct_io = false;
+                int flags = fcntl(fd, F_GETFL);
+                if (flags >= 0 && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0) continue;
+            }
+            std::cerr << "WAL write error: " << strerror(errno) << std::endl;
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool WAL::writeBlocks(const std::vector<uint8_t>& data) {
+    if (data.empty()) return true;
+
+    // Move on rather than overflow the segment. A batch bigger than a whole
+    // segment gets one to itself, extended past its preallocation.
+    size_t logged = partial_.size() + data.size();
+    if (block_offset_ + logged > allocated_ && (block_offset_ > 0 || partial_.size() > kHeaderSize)) {
+        if (!rollSegment()) return false;
+        logged = partial_.size() + data.size();
+    }
+
+    size_t length = (logged + kBlockSize - 1) / kBlockSize * kBlockSize;
+    if (!reserveIoBuffer(length)) {
+        return false;
+    }
+
+    if (!partial_.empty()) {
+        std::memcpy(io_buffer_, partial_.data(), partial_.size());
+    }
+    std::memcpy(io_buffer_ + partial_.size(), data.data(), data.size());
+    std::memset(io_buffer_ + logged, 0, length - logged);
+
+    if (!writeIoBuffer(fd_, block_offset_, length)) {
+        return false;
+    }
+
+    // Full blocks are done with; the last one is rewritten by the next batch
+    size_t full = logged / kBlockSize * kBlockSize;
+    block_offset_ += full;
+    partial_.assign(io_buffer_ + full, io_buffer_ + logged);
+    return true;
+}
+
+void WAL::flusherLoop() {
+    using Clock = std::chrono::steady_clock;
+    const auto interval = std::chrono::milliseconds(config_.fsync_interval_ms);
+    auto next_sync = Clock::now() + interval;
+    std::vector<uint8_t> batch;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        auto ready = [this] {
+            return !io_busy_ && (stopping_ || sync_requested_ || !pending_.empty());
+        };
+        if (config_.durability == Durability::FSYNC_INTERVAL) {
+            // The interval sync is due even with nothing pending, but never
+            // while rotate() owns the segment; it notifies when done
+            if (!flush_cv_.wait_until(lock, next_sync, ready)) {
+                flush_cv_.wait(lock, [this] { return !io_busy_; });
+            }
+        } else {
+            flush_cv_.wait(lock, ready);
+        }
+
+        // Take the whole batch; writers keep appending to a fresh one while
+        // this one is on its way to disk.
+        batch.swap(pending_);
+        uint64_t batch_lsn = appended_lsn_;
+        bool dirty = batch_lsn > synced_lsn_;
+        bool stop = stopping_;
+        bool do_sync = sync_requested_ || stop ||
+                       config_.durability == Durability::FSYNC_PER_BATCH;
+        sync_requested_ = false;
+        io_busy_ = true;
+        bool has_sink = static_cast<bool>(sink_);
+        lock.unlock();
+
+        auto write_start = Clock::now();
+        bool ok = writeBlocks(batch);
+        if (ok && !batch.empty()) {
+            stats_.write_ns.record(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - write_start).count()));
+            stats_.batches.add();
+            stats_.bytes.add(batch.size());
+            if (has_sink) {
+                sink_(batch.data(), batch.size());
+            }
+        }
+        batch.clear();
+
+        if (config_.durability == Durability::FSYNC_INTERVAL && Clock::now() >= next_sync) {
+            do_sync = true;
+            next_sync = Clock::now() + interval;
+        }
+
+        if (ok && do_sync && dirty) {
+            auto sync_start = Clock::now();
+            if (::fdatasync(fd_) != 0) {
+                std::cerr << "WAL fdatasync error: " << strerror(errno) << std::endl;
+                ok = false;
+            } else {
+                stats_.fsync_ns.record(static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sync_start).count()));
+                stats_.fsyncs.add();
+            }
+        }
+
+        lock.lock();
+        if (!ok) {
+            failed_ = true;
+        }
+        written_lsn_ = batch_lsn;
+        if (ok && do_sync) {
+            synced_lsn_ = batch_lsn;
+        }
+        io_busy_ = false;
+        done_cv_.notify_all();
+
+        if (stop && pending_.empty()) {
+            break;
+        }
+    }
+}
+
+bool WAL::parseDurability(const std::string& mode, WALConfig& config) {
+    if (mode == "none") {
+        config.durability = Durability::NONE;
+    } else if (mode == "os-buffered") {
+        config.durability = Durability::OS_BUFFERED;
+    } else if (mode == "fsync-per-batch") {
+        config.durability = Durability::FSYNC_PER_BATCH;
+    } else {
+        // fsync-every-<N>ms
+        const std::string prefix = "fsync-every-";
+        const std::string suffix = "ms";
+        if (mode.size() <= prefix.size() + suffix.size() ||
+            mode.compare(0, prefix.size(), prefix) != 0 ||
+            mode.compare(mode.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            return false;
+        }
+        std::string digits = mode.substr(prefix.size(),
+                                         mode.size() - prefix.size() - suffix.size());
+        if (digits.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        int interval = std::atoi(digits.c_str());
+        if (interval <= 0) {
+            return false;
+        }
+        config.durability = Durability::FSYNC_INTERVAL;
+        config.fsync_interval_ms = interval;
+    }
+    return true;
+}
+
+void WAL::encodeDeadline(int64_t deadline_ms, char* out) {
+    uint64_t val = static_cast<uint64_t>(deadline_ms);
+    for (size_t i = 0; i < kDeadlineSize; ++i) {
+        out[i] = static_cast<char>(val >> (8 * (kDeadlineSize - 1 - i)));
+    }
+}
+
+bool WAL::decodeDeadline(std::string_view payload, int64_t& deadline_ms) {
+    if (payload.size() != kDeadlineSize) return false;
+
+    uint64_t val = 0;
+    for (char c : payload) {
+        val = (val << 8) | static_cast<uint8_t>(c);
+    }
+    deadline_ms = static_cast<int64_t>(val);
+    return true;
+}
+
+bool WAL::decodeEntry(const uint8_t* data, size_t size, size_t& offset, Entry& entry) {
+    auto readLength = [data](size_t at) {
+        uint32_t net_val;
+        std::memcpy(&net_val, data + at, 4);
+        return ntohl(net_val);
+    };
+
+    // Read operation type and key length
+    if (size - offset < 5) return false;
+    entry.op = static_cast<WALOperation>(data[offset]);
+    uint32_t key_len = readLength(offset + 1);
+    size_t pos = offset + 5;
+
+    // Key, then value length
+    if (size - pos < static_cast<size_t>(key_len) + 4) return false;
+    entry.key = std::string_view(reinterpret_cast<const char*>(data + pos), key_len);
+    uint32_t value_len = readLength(pos + key_len);
+    pos += key_len + 4;
+
+    // Value
+    if (size - pos < value_len) return false;
+    entry.value = std::string_view(reinterpret_cast<const char*>(data + pos), value_len);
+    offset = pos + value_len;
+    return true;
+}
+
+bool WAL::forEachInBatch(std::string_view payload, const Visitor& visit) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(payload.data());
+    const size_t size = payload.size();
+    if (size < 4) return false;
+
+    uint32_t net_count;
+    std::memcpy(&net_count, data, 4);
+    uint32_t count = ntohl(net_count);
+
+    // The whole batch is checked before any of it is visited, so a
+    // malformed one is skipped entirely rather than applied in part
+    size_t offset = 4;
+    Entry entry;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!decodeEntry(data, size, offset, entry) || entry.op == WALOperation::BATCH) {
+            return false;
+        }
     }
+
+    offset = 4;
+    for (uint32_t i = 0; i < count; ++i) {
+        decodeEntry(data, size, offset, entry);
+        visit(entry);
+    }
+    return true;
+}
+
+bool WAL::decodeRecord(const uint8_t* data, size_t size, size_t& offset, std::string_view& payload) {
+    if (size - offset < kRecordHeaderSize) return false;
+    uint32_t crc = getUint32(data + offset);
+    uint32_t length = getUint32(data + offset + 4);
+
+    // A length that runs past the file is corrupt, whatever the checksum
+    // says; checking it first also keeps the CRC from reading out of bounds
+    if (length < kMinPayloadSize || length > size - offset - kRecordHeaderSize) return false;
+    if (crc32c(data + offset + 4, 4 + static_cast<size_t>(length)) != crc) return false;
+
+    payload = std::string_view(reinterpret_cast<const char*>(data + offset + kRecordHeaderSize), length);
+    offset += kRecordHeaderSize + length;
+    return true;
 }
 
-std::vector<WAL::Entry> WAL::replay(const std::string& filename) {
-    std::vector<Entry> entries;
+bool WAL::isEmpty(const MappedFile& file) {
+    if (!file.isOpen()) return true;
 
-    std::ifstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
+    const uint8_t* data = file.data();
+    const size_t size = file.size();
+    size_t offset = size >= kHeaderSize && std::memcmp(data, kMagic, sizeof(kMagic)) == 0 ? kHeaderSize : 0;
+    size_t end = std::min(size, offset + kRecordHeaderSize);
+    return std::all_of(data + offset, data + end, [](uint8_t b) { return b == 0; });
+}
+
+bool WAL::replay(const MappedFile& file, const Visitor& visit, bool tail) {
+    const std::string& filename = file.path();
+    if (!file.isOpen()) {
         std::cout << "No WAL file found, starting fresh" << std::endl;
-        return entries;
+        return true;
     }
 
     std::cout << "Replaying WAL from: " << filename << std::endl;
 
-    while (file.good() && file.peek() != EOF) {
-        Entry entry;
+    const uint8_t* data = file.data();
+    const size_t size = file.size();
+    size_t offset = 0;
+    size_t count = 0;
 
-        // Read operation type
-        uint8_t op_byte;
-        file.read(reinterpret_cast<char*>(&op_byte), 1);
-        if (!file.good()) break;
-        entry.op = static_cast<WALOperation>(op_byte);
+    if (size >= kHeaderSize && std::memcmp(data, kMagic, sizeof(kMagic)) == 0) {
+        uint16_t version = static_cast<uint16_t>((data[6] << 8) | data[7]);
+        if (version != kVersion) {
+            std::cerr << "Unsupported WAL version " << version << ": " << filename << std::endl;
+            return false;
+        }
 
-        // Read key length and key
-        uint32_t key_len;
-        file.read(reinterpret_cast<char*>(&key_len), 4);
-        if (!file.good()) break;
-        key_len = ntohl(key_len);
+        offset = kHeaderSize;
+        while (offset < size) {
+            size_t next = offset;
+            std::string_view payload;
+            if (!decodeRecord(data, size, next, payload)) break;
 
-        entry.key.resize(key_len);
-        file.read(&entry.key[0], key_len);
-        if (!file.good()) break;
+            // The payload must be exactly one entry
+            Entry entry;
+            size_t pos = 0;
+            const auto* bytes = reinterpret_cast<const uint8_t*>(payload.data());
+            if (!decodeEntry(bytes, payload.size(), pos, entry) || pos != payload.size()) break;
 
-        // Read value length and value
-        uint32_t value_len;
-        file.read(reinterpret_cast<char*>(&value_len), 4);
-        if (!file.good()) break;
-        value_len = ntohl(value_len);
+            visit(entry);
+            ++count;
+            offset = next;
+        }
+    } else {
+        // Version 1: bare entries. A zero where the next one would start
+        // is unwritten, preallocated space.
+        while (offset < size && data[offset] != 0) {
+            size_t next = offset;
+            Entry entry;
+            if (!decodeEntry(data, size, next, entry)) break;
 
-        entry.value.resize(value_len);
-        file.read(&entry.value[0], value_len);
-        if (!file.good()) break;
+            visit(entry);
+            ++count;
+            offset = next;
+        }
+    }
 
-        entries.push_back(entry);
+    if (offset < size && !tail) {
+        // A sealed segment was truncated to its records, and one that a
+        // crash cut short is only ever followed by empty ones; any leftover
+        // that is not blank space means the segment is damaged
+        if (!std::all_of(data + offset, data + size, [](uint8_t b) { return b == 0; })) {
+            std::cerr << "WAL segment " << filename << " is damaged at offset " << offset
+                      << ", before the end of the log" << std::endl;
+            return false;
+        }
+    } else if (offset < size) {
+        // Unused preallocated space after a crash is all zeros; anything
+        // else is a torn or corrupt write. Either way the log ends here, and
+        // the tail is cut off so that it cannot surface again later.
+        bool zeroed = size - offset >= kRecordHeaderSize
+                          ? std::all_of(data + offset, data + offset + kRecordHeaderSize,
+                                        [](uint8_t b) { return b == 0; })
+                          : false;
+        if (!zeroed) {
+            std::cerr << "Discarding " << (size - offset) << " bytes after the last valid record of "
+                      << filename << std::endl;
+        }
+        if (::truncate(filename.c_str(), static_cast<off_t>(offset)) != 0) {
+            std::cerr << "Failed to truncate " << filename << ": " << strerror(errno) << std::endl;
+        }
     }
 
-    std::cout << "Replayed " << entries.size() << " entries from WAL" << std::endl;
+    std::cout << "Replayed " << count << " entries from WAL" << std::endl;
 
-    return entries;
+    return true;
 }
 
-} // namespace kvstore
\ No newline at end of file
+} // namespace kvstore
@@ -1,49 +1,250 @@
 #pragma once
 
 #include <string>
-#include <fstream>
+#include <string_view>
+#include <functional>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <cstdint>
 #include <vector>
+#include "stats.h"
 
 namespace kvstore {
 
+    class MappedFile;
+
     enum class WALOperation : uint8_t {
         SET = 1,
-        DELETE = 2
+        DELETE = 2,
+
+        // Several SET/DELETE records committed as one; see appendBatch()
+        BATCH = 3,
+
+        // Sets the key's expiry deadline; the value is encodeDeadline()
+        EXPIRE_AT = 4,
+
+        // SET whose value is in Compression's compressed form
+        SET_COMPRESSED = 5
+    };
+
+    // How long a writer waits before its record counts as logged.
+    enum class Durability : uint8_t {
+        NONE,             // don't wait; the flusher writes in the background
+        OS_BUFFERED,      // wait until the batch has been handed to the kernel
+        FSYNC_PER_BATCH,  // wait until the batch has been fdatasync'd
+        FSYNC_INTERVAL    // wait for the write; fdatasync every interval_ms
     };
 
+    struct WALConfig {
+        Durability durability = Durability::OS_BUFFERED;
+        int fsync_interval_ms = 1000;
+
+        // Segments are preallocated to this size (rounded up to whole
+        // blocks), so appends fill blocks that already exist instead of
+        // growing the file, and fdatasync has no metadata to flush. A batch
+        // that does not fit continues in a new segment.
+        size_t segment_size = 64 * 1024 * 1024;
+
+        // Write with O_DIRECT, bypassing the page cache. Falls back to
+        // buffered writes where the file system does not support it.
+        bool direct_io = false;
+    };
+
+    // The log is a sequence of segment files named "<base>.<id>" (ids start
+    // at 1). A file named exactly "<base>", written by older versions, is
+    // treated as segment 0. Every WAL instance starts a fresh segment, and
+    // rotate() seals the active one so a snapshot can supersede it.
+    //
+    // Segment format: [magic "KVWLOG"(6)][version(2)], then records of
+    // [crc32c(4)][length(4)][payload(length)]. The checksum covers the length
+    // and the payload; the payload is [op(1)][key_len(4)][key][value_len(4)]
+    // [value]. Version 1 segments (no header) are bare payloads, one after
+    // another. Replay stops at the first record that is torn or fails its
+    // checksum; only at the end of the log is that expected, and only there
+    // is the segment truncated.
+    //
+    // The active segment is written in whole kBlockSize blocks at aligned
+    // offsets; the last, partly filled block is rewritten by the next batch.
+    // Its preallocated rest stays zeroed, which never passes as a record.
+    // Sealing a segment truncates it to the bytes actually logged.
     class WAL {
     public:
         explicit WAL(const std::string& filename);
+        WAL(const std::string& filename, const WALConfig& config);
         ~WAL();
 
-        // Log a SET operation
-        bool logSet(const std::string& key, const std::string& value);
+        // Group commit: append() queues a record in the shared in-memory batch
+        // and returns its log sequence number; waitFor() blocks until that
+        // record is as durable as the configured mode requires. A single
+        // flusher thread writes (and fsyncs) whole batches, so concurrent
+        // writers share one syscall.
+        uint64_t append(WALOperation op, std::string_view key, std::string_view value);
+        bool waitFor(uint64_t lsn);
 
-        // Log a DELETE operation
-        bool logDelete(const std::string& key);
-
-        // Replay the log to recover state
-        // Returns pairs of (operation, key, value)
+        // One logged operation. When produced by replay, key and value point
+        // into the mapped segment.
         struct Entry {
             WALOperation op;
-            std::string key;
-            std::string value;
+            std::string_view key;
+            std::string_view value;
         };
+        using Visitor = std::function<void(const Entry&)>;
+
+        // Appends ops as a single BATCH record, so replay sees all of them or,
+        // if the record was torn, none
+        uint64_t appendBatch(const std::vector<Entry>& ops);
+
+        // Calls visit for each sub-record of a BATCH record's value. Returns
+        // false, having visited none of them, if the payload is malformed.
+        static bool forEachInBatch(std::string_view payload, const Visitor& visit);
+
+        // Records in their on-disk framing, checksum included, as shipped to
+        // replicas. encodeRecord() appends one to out; decodeRecords() visits
+        // each record of records in turn and returns false at the first one
+        // that is torn or corrupt.
+        static void encodeRecord(std::vector<uint8_t>& out, WALOperation op, std::string_view key,
+                                 std::string_view value);
+        static bool decodeRecords(std::string_view records, const Visitor& visit);
+
+        // Called with every batch of framed records once it has been written
+        // to the log, in log order, on the thread that wrote it, so it must
+        // not block. May be set once, at any time; records written before
+        // then are not passed on.
+        using RecordSink = std::function<void(const uint8_t* records, size_t size)>;
+        void setSink(RecordSink sink);
+
+        // Deadlines are absolute wall-clock times in ms since the Unix epoch,
+        // stored as 8 big-endian bytes, so they survive a restart
+        static constexpr size_t kDeadlineSize = 8;
+        static void encodeDeadline(int64_t deadline_ms, char* out);
+        static bool decodeDeadline(std::string_view payload, int64_t& deadline_ms);
+
+        // Log a SET operation
+        bool logSet(std::string_view key, std::string_view value);
+
+        // Log a DELETE operation
+        bool logDelete(std::string_view key);
+
+        // Replay the log to recover state. Each record of the mapped segment
+        // is handed to the visitor in log order; key and value stay valid for
+        // as long as the caller keeps the mapping alive. A crash can only
+        // tear the end of the log, so in the tail segment anything after the
+        // last intact record is cut off the file. Any other segment must be
+        // intact up to its zeroed end: otherwise replay stops at the damage,
+        // leaves the file alone and returns false, as applying the segments
+        // after it would leave a hole in the history.
+        static bool replay(const MappedFile& file, const Visitor& visit, bool tail);
 
-        static std::vector<Entry> replay(const std::string& filename);
+        // True if the segment holds no records, like the fresh one a crash
+        // during startup leaves behind
+        static bool isEmpty(const MappedFile& file);
 
-        // Sync to disk
+        // Force everything appended so far to disk, regardless of mode
         void sync();
 
+        // Seal the active segment and continue in a new one. Every record
+        // appended before the call is durable in a segment whose id is <= the
+        // returned id; every record appended after it lands in a later one.
+        uint64_t rotate();
+
+        // Sequence number of the most recently appended record
+        uint64_t lastLsn();
+
+        // Id of the segment being appended to. Recovery stops short of it:
+        // its contents are this instance's own writes.
+        uint64_t activeSegment();
+
+        struct Segment {
+            uint64_t id;
+            std::string path;
+        };
+
+        // Existing segments of the log rooted at base, oldest first
+        static std::vector<Segment> listSegments(const std::string& base);
+
+        // Delete every segment with id <= up_to
+        static void removeSegments(const std::string& base, uint64_t up_to);
+
+        static std::string segmentPath(const std::string& base, uint64_t id);
+
+        // Parses "none", "os-buffered", "fsync-per-batch" or "fsync-every-<N>ms"
+        static bool parseDurability(const std::string& mode, WALConfig& config);
+
+        // What the flusher thread has done; only it writes these
+        struct Stats {
+            Counter batches;
+            Counter bytes;
+            Counter fsyncs;
+            Histogram write_ns;   // writing one batch
+            Histogram fsync_ns;
+        };
+        const Stats& stats() const { return stats_; }
+
     private:
+        static constexpr size_t kBlockSize = 4096;
+
         std::string filename_;
-        std::ofstream file_;
+        WALConfig config_;
+        int fd_ = -1;
+        uint64_t segment_id_ = 0;
+
+        // Layout of the active segment. Only the thread that holds io_busy_
+        // (or the constructor and destructor) touches these.
+        uint64_t block_offset_ = 0;       // where the next write starts; block aligned
+        uint64_t allocated_ = 0;          // bytes preallocated in the segment
+        std::vector<uint8_t> partial_;    // logged bytes of the block at block_offset_
+        uint8_t* io_buffer_ = nullptr;    // block-aligned staging area, for O_DIRECT
+        size_t io_capacity_ = 0;
+
         std::mutex mutex_;
+        std::condition_variable flush_cv_;   // wakes the flusher
+        std::condition_variable done_cv_;    // wakes writers waiting on an LSN
+        std::vector<uint8_t> pending_;
+        uint64_t appended_lsn_ = 0;
+        uint64_t written_lsn_ = 0;
+        uint64_t synced_lsn_ = 0;
+        bool sync_requested_ = false;
+        bool stopping_ = false;
+        bool failed_ = false;
+        bool io_busy_ = false;  // a batch is being written outside the lock
+        RecordSink sink_;
+        std::thread flusher_;
+        Stats stats_;
+
+        void flusherLoop();
+
+        // Create segment id, preallocate it and make it the one writeBlocks()
+        // appends to. Returns its descriptor, or -1.
+        int openSegment(uint64_t id);
+
+        // Truncate the active segment to its logged bytes, sync and close it
+        bool sealSegment();
+
+        // Seal the active segment and continue in the next one
+        bool rollSegment();
+
+        // Append data to the active segment, rolling over when it is full
+        bool writeBlocks(const std::vector<uint8_t>& data);
+
+        // Grow the block-aligned staging buffer to at least size bytes
+        bool reserveIoBuffer(size_t size);
+
+        // Write the first length bytes of the staging buffer at offset
+        bool writeIoBuffer(int fd, uint64_t offset, size_t length);
+
+        // Frame the payload encoded into out after position start: fill in
+        // the length and checksum reserved there by beginRecord()
+        static size_t beginRecord(std::vector<uint8_t>& out);
+        static void endRecord(std::vector<uint8_t>& out, size_t start);
+
+        // Record payload: [op(1 byte)][key_len(4)][key][value_len(4)][value]
+        static void encodeEntry(std::vector<uint8_t>& out, WALOperation op, std::string_view key,
+                                std::string_view value);
+        static bool decodeEntry(const uint8_t* data, size_t size, size_t& offset, Entry& entry);
 
-        // Write entry format: [op(1 byte)][key_len(4)][key][value_len(4)][value]
-        bool writeEntry(WALOperation op, const std::string& key, const std::string& value);
+        // The checksummed record at offset, if it is intact
+        static bool decodeRecord(const uint8_t* data, size_t size, size_t& offset, std::string_view& payload);
     };
 
-} // namespace kvstore
\ No newline at end of file
+} // namespace kvstore